@@ -0,0 +1,65 @@
+// Cost of one stack capture by each unwinder, from 8, 32 and 64 frames deep. The
+// benchmarks are built with frame pointers, so every unwinder sees the whole stack.
+// Fails if the frame pointer walk or, on x64, the unwind table comes back with
+// different frames than the system's. The table's captures after the first reuse the
+// outer frames of the one before, as allocations in a loop do.
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "Unwinder.h"
+#include "StackTable.h"
+
+const size_t numCaptures = 1 << 14;
+
+struct Capture{
+	void *frames[backtraceSize];
+	size_t depth;
+	double ns;
+};
+
+// Captures from depth frames below the caller. Reads something volatile on the way
+// back up so the recursion can't become a loop.
+__declspec(noinline) size_t captureAt(size_t depth, Capture &capture){
+	volatile size_t frame = depth;
+	if(depth)
+		return captureAt(depth - 1, capture) + frame;
+	auto start = std::chrono::steady_clock::now();
+	for(size_t i = 0; i < numCaptures; ++i)
+		capture.depth = captureStack(capture.frames, backtraceSize);
+	capture.ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()/numCaptures;
+	return 0;
+}
+
+int main(){
+	bool haveTable = setUnwinder(unwindTableUnwinder);
+	printf("depth  system ns  framepointer ns  table ns\n");
+	for(size_t depth : {(size_t)8, (size_t)32, (size_t)64}){
+		Capture system, framePointer, table;
+		setUnwinder(systemUnwinder);
+		captureAt(depth, system);
+		setUnwinder(framePointerUnwinder);
+		captureAt(depth, framePointer);
+		if(haveTable){
+			setUnwinder(unwindTableUnwinder);
+			captureAt(depth, table);
+			printf("%5zu %10.1f %16.1f %9.1f\n", depth, system.ns, framePointer.ns, table.ns);
+		}else{
+			printf("%5zu %10.1f %16.1f %9s\n", depth, system.ns, framePointer.ns, "-");
+		}
+
+		// Below main the system unwinder carries on into the C library's startup code.
+		size_t compared = (std::min)(depth, (size_t)backtraceSize);
+		if(framePointer.depth < compared || memcmp(system.frames, framePointer.frames, compared*sizeof(void*)) != 0){
+			printf("FAILED: the frame pointer walk found different frames\n");
+			return 1;
+		}
+		// The table reads the startup code's unwind information too, so it goes as far.
+		if(haveTable && (table.depth != system.depth || memcmp(system.frames, table.frames, compared*sizeof(void*)) != 0)){
+			printf("FAILED: the unwind table found different frames\n");
+			return 1;
+		}
+	}
+	return 0;
+}
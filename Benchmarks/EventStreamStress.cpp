@@ -0,0 +1,97 @@
+// Allocations streamed between processes through an EventStream, as in out of process
+// mode. A child process writes mallocs and frees from several threads through an
+// EventStreamWriter while this process reads them into a HeapProfiler. The ring is
+// kept small, so writers regularly find it full and wait for the reader. Fails if the
+// allocations don't all come out balanced.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "EventStream.h"
+#include "HeapProfiler.h"
+
+const size_t numWriters = 4;
+const size_t opsPerWriter = 1 << 18;
+
+void captureAt(size_t depth, StackTrace &trace){
+	if(depth)
+		captureAt(depth - 1, trace);
+	else
+		trace.trace();
+}
+
+void writeAllocations(EventStreamWriter *writer, size_t thread){
+	StackTrace traces[8];
+	for(size_t i = 0; i < 8; ++i)
+		captureAt(i, traces[i]);
+	uintptr_t base = (uintptr_t)(thread + 1) << 36;
+	for(size_t i = 0; i < opsPerWriter; ++i){
+		writer->malloc((void*)(base + i*16), 16 + i % 64, traces[i % 8]);
+		writer->free((void*)(base + i*16));
+	}
+}
+
+// The child, the profiled process.
+int writeStream(const char *name){
+	EventStream *stream = EventStream::open(name);
+	if(!stream)
+		return 1;
+	EventStreamWriter *writer = new EventStreamWriter(stream);
+	std::vector<std::thread> threads;
+	for(size_t i = 0; i < numWriters; ++i)
+		threads.emplace_back(writeAllocations, writer, i);
+	for(std::thread &thread : threads)
+		thread.join();
+	writer->finish(10000);
+	return 0;
+}
+
+int main(){
+	std::string name = "/Heapy_Stream_Test_" + std::to_string(getpid());
+	for(size_t capacity : {(size_t)1 << 10, (size_t)1 << 16}){
+		EventStream *stream = EventStream::create(name.c_str(), capacity);
+		if(!stream){
+			printf("FAILED: could not create %s\n", name.c_str());
+			return 1;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		pid_t pid = fork();
+		if(pid == 0)
+			_exit(writeStream(name.c_str()));
+
+		HeapProfiler *profiler = new HeapProfiler();
+		EventStreamReader reader(stream, profiler);
+		size_t numRecords = 0;
+		while(!reader.exitRequested()){
+			size_t numRead = reader.drain();
+			numRecords += numRead;
+			if(!numRead)
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		stream->acknowledgeExit();
+		int status = 0;
+		waitpid(pid, &status, 0);
+		EventStream::remove(name.c_str());
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		size_t live = 0;
+		std::vector<std::pair<StackId, size_t>> allocs;
+		profiler->getAllocationSiteReport(allocs);
+		for(const auto &alloc : allocs)
+			live += alloc.second;
+		printf("ring of %6zu: %zu records, %.1f million/s\n", capacity, numRecords, numRecords/seconds/1e6);
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0 || live || numRecords < 2*numWriters*opsPerWriter){
+			printf("FAILED: %zu bytes still live\n", live);
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,118 @@
+// Cost added to each call by the two ways of hooking an allocator other than the
+// preloaded interposer, with hooks which just call on to the original: --import-hooks,
+// this program's GOT slots for malloc and free patched, against --inline-hooks, libc's
+// malloc and free detoured with MinHook. The interposer costs the same as a patched
+// GOT slot, both are one call through the GOT. Fails if the hooks weren't called.
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "Platform.h"
+#include "ImportTable.h"
+#include "MinHook.h"
+
+typedef void *(*PtrMalloc)(size_t);
+typedef void (*PtrFree)(void*);
+
+const size_t numPairs = 1 << 22;
+const int numRounds = 20;
+
+static PtrMalloc originalMalloc;
+static PtrFree originalFree;
+static size_t hookCalls = 0;
+
+void *mallocHook(size_t size){
+	++hookCalls;
+	return originalMalloc(size);
+}
+
+void freeHook(void *p){
+	++hookCalls;
+	originalFree(p);
+}
+
+static void *libcMalloc;
+static void *libcFree;
+static void **mallocSlot;
+static void **freeSlot;
+
+bool findSlots(const char *moduleName, void **slot, void *){
+	if(strcmp(moduleName, program_invocation_short_name) != 0)
+		return true;
+	if(*slot == libcMalloc)
+		mallocSlot = slot;
+	if(*slot == libcFree)
+		freeSlot = slot;
+	return true;
+}
+
+// Nanoseconds per malloc and free pair.
+__declspec(noinline) double run(){
+	auto start = std::chrono::steady_clock::now();
+	for(size_t i = 0; i < numPairs; ++i){
+		void *p = malloc(32 + (i & 15));
+		// Keeps the compiler from leaving the pair out.
+		__asm__ volatile("" :: "r"(p) : "memory");
+		free(p);
+	}
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()/numPairs;
+}
+
+int main(){
+	// Binds the GOT slots.
+	run();
+	libcMalloc = dlsym(RTLD_NEXT, "malloc");
+	libcFree = dlsym(RTLD_NEXT, "free");
+	enumerateImportSlots(findSlots, 0);
+	if(!mallocSlot || !freeSlot){
+		printf("FAILED: no GOT slots for malloc and free\n");
+		return 1;
+	}
+
+	PtrMalloc trampolineMalloc;
+	PtrFree trampolineFree;
+	if(MH_Initialize() != MH_OK ||
+	   MH_CreateHook(libcMalloc, (void*)&mallocHook, (void**)&trampolineMalloc) != MH_OK ||
+	   MH_CreateHook(libcFree, (void*)&freeHook, (void**)&trampolineFree) != MH_OK){
+		printf("FAILED: could not create the detours\n");
+		return 1;
+	}
+
+	// Interleaved so changes in the machine's speed hit all three alike.
+	double direct = 1e9, got = 1e9, detour = 1e9;
+	size_t gotCalls = 0, detourCalls = 0;
+	for(int round = 0; round < numRounds; ++round){
+		direct = (std::min)(direct, run());
+
+		originalMalloc = (PtrMalloc)libcMalloc;
+		originalFree = (PtrFree)libcFree;
+		replaceImportSlot(mallocSlot, libcMalloc, (void*)&mallocHook);
+		replaceImportSlot(freeSlot, libcFree, (void*)&freeHook);
+		hookCalls = 0;
+		got = (std::min)(got, run());
+		gotCalls += hookCalls;
+		replaceImportSlot(mallocSlot, (void*)&mallocHook, libcMalloc);
+		replaceImportSlot(freeSlot, (void*)&freeHook, libcFree);
+
+		originalMalloc = trampolineMalloc;
+		originalFree = trampolineFree;
+		MH_EnableHook(MH_ALL_HOOKS);
+		hookCalls = 0;
+		detour = (std::min)(detour, run());
+		MH_DisableHook(MH_ALL_HOOKS);
+		detourCalls += hookCalls;
+	}
+
+	printf("malloc and free pair: direct %.2f ns, GOT patched %.2f ns (%+.2f), MinHook detour %.2f ns (%+.2f)\n",
+		direct, got, got - direct, detour, detour - direct);
+	if(gotCalls < 2*numPairs*numRounds || detourCalls < 2*numPairs*numRounds){
+		printf("FAILED: the hooks weren't called\n");
+		return 1;
+	}
+	return 0;
+}
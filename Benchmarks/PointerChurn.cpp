@@ -0,0 +1,123 @@
+// PointerTable against the std::unordered_map it replaced, with 1k, 100k and 1M live
+// allocations churned by freeing a random one and allocating another in its place.
+// Prints the cost of a malloc and free pair and the memory used per live allocation.
+// Fails if a free doesn't get back the site and size its malloc recorded.
+#include <stdio.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+#include "PointerTable.h"
+
+const size_t churnOps = 1 << 21;
+
+// Counts the bytes the map allocates, nodes and buckets.
+static size_t mapBytes = 0;
+
+template <typename T>
+struct CountingAllocator{
+	typedef T value_type;
+	CountingAllocator(){}
+	template <typename U> CountingAllocator(const CountingAllocator<U>&){}
+	T *allocate(size_t n){
+		mapBytes += n*sizeof(T);
+		return (T*)::operator new(n*sizeof(T));
+	}
+	void deallocate(T *p, size_t n){
+		mapBytes -= n*sizeof(T);
+		::operator delete(p);
+	}
+	template <typename U> bool operator==(const CountingAllocator<U>&) const { return true; }
+	template <typename U> bool operator!=(const CountingAllocator<U>&) const { return false; }
+};
+
+struct Site{
+	StackId stack;
+	size_t size;
+};
+typedef std::unordered_map<void*, Site, std::hash<void*>, std::equal_to<void*>,
+                           CountingAllocator<std::pair<void* const, Site>>> PointerMap;
+
+// The same interface over both.
+struct TableAdapter{
+	PointerTable table;
+	bool insert(void *p, StackId stack, size_t size){ return table.insert(p, stack, size); }
+	bool remove(void *p, StackId &stack, size_t &size){ return table.remove(p, stack, size); }
+	size_t memoryUsage() const { return table.memoryUsage(); }
+};
+
+struct MapAdapter{
+	PointerMap map;
+	bool insert(void *p, StackId stack, size_t size){
+		Site site = {stack, size};
+		return map.emplace(p, site).second;
+	}
+	bool remove(void *p, StackId &stack, size_t &size){
+		auto it = map.find(p);
+		if(it == map.end())
+			return false;
+		stack = it->second.stack;
+		size = it->second.size;
+		map.erase(it);
+		return true;
+	}
+	size_t memoryUsage() const { return mapBytes; }
+};
+
+// Fake, never dereferenced, addresses handed out in order like a fresh heap's.
+void *pointer(size_t index){
+	return (void*)(0x10000000 + index*32);
+}
+StackId stackOf(size_t index){
+	return (StackId)(index % 1000);
+}
+size_t sizeOf(size_t index){
+	return 16 + index % 64;
+}
+
+// Returns false if the table gave back the wrong site or size.
+template <typename Table>
+bool run(size_t numLive, double &nsPerPair, double &bytesPerLive){
+	Table *table = new Table();
+	std::vector<size_t> live(numLive);
+	size_t next = 0;
+	for(size_t i = 0; i < numLive; ++i){
+		live[i] = next++;
+		table->insert(pointer(live[i]), stackOf(live[i]), sizeOf(live[i]));
+	}
+
+	uint64_t random = 88172645463325252ULL;
+	bool correct = true;
+	auto start = std::chrono::steady_clock::now();
+	for(size_t i = 0; i < churnOps; ++i){
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+		size_t &slot = live[random % numLive];
+		StackId stack;
+		size_t size;
+		if(!table->remove(pointer(slot), stack, size) || stack != stackOf(slot) || size != sizeOf(slot))
+			correct = false;
+		slot = next++;
+		table->insert(pointer(slot), stackOf(slot), sizeOf(slot));
+	}
+	nsPerPair = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()/churnOps;
+	bytesPerLive = (double)table->memoryUsage()/numLive;
+	delete table;
+	return correct;
+}
+
+int main(){
+	printf("     live  map ns  table ns  map bytes  table bytes\n");
+	for(size_t numLive : {(size_t)1000, (size_t)100000, (size_t)1000000}){
+		double mapNs, tableNs, mapPerLive, tablePerLive;
+		if(!run<MapAdapter>(numLive, mapNs, mapPerLive) || !run<TableAdapter>(numLive, tableNs, tablePerLive)){
+			printf("FAILED: a free got back the wrong site or size\n");
+			return 1;
+		}
+		printf("%9zu %7.1f %9.1f %10.1f %12.1f\n", numLive, mapNs, tableNs, mapPerLive, tablePerLive);
+	}
+	return 0;
+}
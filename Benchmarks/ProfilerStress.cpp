@@ -0,0 +1,157 @@
+// Multi-threaded stress of HeapProfiler's pointer and stack tables, driven directly
+// rather than through the hooks. Threads record allocations from a handful of sites
+// and swap them through a shared set of slots, so most are freed by a different thread
+// than allocated them. The rate is printed for increasing thread counts, recording
+// directly and through per thread event buffers, along with the CPU time the recording
+// threads spend themselves. Buffered mode moves the table updates onto the aggregator
+// thread, which on a machine with fewer cores than threads competes for the same time.
+// Fails if any allocation is left live, which in buffered mode is what applying a free
+// before its malloc would do.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "HeapProfiler.h"
+
+const size_t numSites = 16;
+const size_t numSlots = 1024;
+const size_t opsPerThread = 1 << 20;
+
+// Distinct stacks, each from a different recursion depth.
+void captureAt(size_t depth, StackTrace &trace){
+	if(depth)
+		captureAt(depth - 1, trace);
+	else
+		trace.trace();
+}
+
+struct Stress{
+	HeapProfiler *profiler;
+	bool buffered;
+	const StackTrace *traces;
+	std::atomic<void*> slots[numSlots];
+	// CPU time of the recording threads.
+	std::atomic<uint64_t> threadNs;
+};
+
+uint64_t threadCpuNs(){
+	timespec time;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+	return (uint64_t)time.tv_sec*1000000000 + time.tv_nsec;
+}
+
+void recordMalloc(Stress &stress, EventBuffer *buffer, void *p, size_t size, const StackTrace &trace){
+	if(buffer)
+		stress.profiler->bufferMalloc(buffer, p, size, trace);
+	else
+		stress.profiler->malloc(p, size, trace);
+}
+
+void recordFree(Stress &stress, EventBuffer *buffer, void *p){
+	if(buffer)
+		stress.profiler->bufferFree(buffer, p);
+	else
+		stress.profiler->free(p, stress.traces[0]);
+}
+
+void stressThread(Stress *stress, size_t thread){
+	uint64_t startNs = threadCpuNs();
+	EventBuffer *buffer = stress->buffered ? stress->profiler->acquireEventBuffer() : 0;
+	// Fake, never dereferenced, addresses which no other thread allocates.
+	uintptr_t base = (uintptr_t)(thread + 1) << 36;
+	for(size_t i = 0; i < opsPerThread; ++i){
+		void *p = (void*)(base + i*16);
+		recordMalloc(*stress, buffer, p, 16 + i % 64, stress->traces[i % numSites]);
+		// Recorded before it's handed on, as a hooked malloc is before it returns.
+		void *old = stress->slots[(i*7 + thread*131) % numSlots].exchange(p);
+		if(old)
+			recordFree(*stress, buffer, old);
+	}
+	if(buffer)
+		stress->profiler->releaseEventBuffer(buffer);
+	stress->threadNs += threadCpuNs() - startNs;
+}
+
+// Returns the live bytes left over, which should be none.
+size_t run(size_t numThreads, bool buffered, const StackTrace *traces){
+	HeapProfiler *profiler = new HeapProfiler();
+	Stress *stress = new Stress();
+	stress->profiler = profiler;
+	stress->buffered = buffered;
+	stress->traces = traces;
+	for(size_t i = 0; i < numSlots; ++i)
+		stress->slots[i] = 0;
+	stress->threadNs = 0;
+
+	std::atomic<bool> done(false);
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for(size_t i = 0; i < numThreads; ++i)
+		threads.emplace_back(stressThread, stress, i);
+	// The aggregator thread of buffered mode.
+	std::thread aggregator([&]{
+		while(buffered && !done){
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			profiler->drainEventBuffers();
+		}
+	});
+	for(std::thread &thread : threads)
+		thread.join();
+	done = true;
+	aggregator.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// A malloc and nearly always a free for each op.
+	double ops = 2.0*opsPerThread*numThreads;
+	printf("%-9s %7zu %7.1f %17.1f %14.1f\n", buffered ? "buffered" : "direct", numThreads, ops/seconds/1e6,
+		seconds*1e9/(2.0*opsPerThread), stress->threadNs/ops);
+
+	EventBuffer *buffer = buffered ? profiler->acquireEventBuffer() : 0;
+	for(size_t i = 0; i < numSlots; ++i){
+		if(stress->slots[i])
+			recordFree(*stress, buffer, stress->slots[i]);
+	}
+	if(buffer){
+		profiler->releaseEventBuffer(buffer);
+		profiler->drainEventBuffers();
+	}
+
+	size_t live = 0;
+	std::vector<std::pair<StackId, size_t>> allocs;
+	profiler->getAllocationSiteReport(allocs);
+	for(const auto &alloc : allocs)
+		live += alloc.second;
+	delete stress;
+	delete profiler;
+	return live;
+}
+
+int main(int argc, char *argv[]){
+	size_t maxThreads = argc > 1 ? (size_t)atoi(argv[1]) : std::thread::hardware_concurrency();
+	if(maxThreads < 1)
+		maxThreads = 1;
+
+	StackTrace traces[numSites];
+	for(size_t i = 0; i < numSites; ++i)
+		captureAt(i, traces[i]);
+
+	printf("mode      threads  Mops/s  ns/op per thread  thread cpu ns\n");
+	for(bool buffered : {false, true}){
+		for(size_t numThreads = 1;; numThreads = (std::min)(numThreads*2, maxThreads)){
+			size_t live = run(numThreads, buffered, traces);
+			if(live){
+				printf("FAILED: %zu bytes still live\n", live);
+				return 1;
+			}
+			if(numThreads == maxThreads)
+				break;
+		}
+	}
+	return 0;
+}
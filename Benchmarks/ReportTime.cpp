@@ -0,0 +1,66 @@
+// Time to write a report of 25 and of 10,000 sites, the first time with none of their
+// addresses symbolised and again once they all are. The stacks are made up from
+// addresses in the C library's code, so they have symbols to look up. Fails if the
+// cached symbols give a different report than looking them up did.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Report.h"
+#include "StackTable.h"
+
+const size_t stackDepth = 16;
+const size_t numAddresses = 4096;
+
+double msSince(std::chrono::steady_clock::time_point start){
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Returns false if the two reports differ.
+bool run(size_t numSites){
+	// Starts with an empty symbol cache.
+	setSymbolProcess(0);
+
+	// Outer frames are shared by many sites, as main and the startup code are.
+	StackTable table;
+	std::vector<std::pair<StackId, size_t>> topAllocs;
+	size_t totalSize = 0;
+	for(size_t i = 0; i < numSites; ++i){
+		StackTrace trace;
+		trace.depth = stackDepth;
+		for(size_t f = 0; f < stackDepth; ++f){
+			size_t address = f < 4 ? (i*7 + f*131) % numAddresses : f*17 + i % 4;
+			trace.backtrace[f] = (char*)&malloc + address*64;
+		}
+		trace.computeHash();
+		topAllocs.push_back(std::make_pair(table.intern(trace), (i + 1)*1024));
+		totalSize += (i + 1)*1024;
+	}
+
+	std::ostringstream cold, warm;
+	auto start = std::chrono::steady_clock::now();
+	writeTopAllocationReport(cold, table, topAllocs, totalSize, 0);
+	double coldMs = msSince(start);
+	start = std::chrono::steady_clock::now();
+	writeTopAllocationReport(warm, table, topAllocs, totalSize, 0);
+	double warmMs = msSince(start);
+
+	printf("%6zu %8.2f %8.2f\n", numSites, coldMs, warmMs);
+	return cold.str() == warm.str();
+}
+
+int main(){
+	printf(" sites  cold ms  warm ms\n");
+	for(size_t numSites : {(size_t)25, (size_t)10000}){
+		if(!run(numSites)){
+			printf("FAILED: the cached symbols gave a different report\n");
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,72 @@
+// Cost of interning stacks into a StackTable as it grows to a million stacks: adding
+// new ones, and finding ones already there, which compares all their frames. The
+// stacks are made up, each a path through a tree of fake return addresses so they
+// share their outer frames like real ones. Fails if stacks with the same hash but
+// different frames are ever merged.
+#include <stdio.h>
+#include <stdint.h>
+
+#include <chrono>
+
+#include "StackTable.h"
+
+const size_t stackDepth = 24;
+
+// The index-th stack. Its innermost frames are picked from 64 functions per level by
+// the digits of index, the outer ones from only a few.
+void makeStack(size_t index, StackTrace &trace){
+	trace.depth = stackDepth;
+	for(size_t i = 0; i < stackDepth; ++i){
+		size_t function = i < 4 ? (index >> (6*i)) & 63 : ((index >> 12) + i) & 7;
+		trace.backtrace[i] = (void*)(0x400000 + i*0x10000 + function*0x40);
+	}
+	trace.computeHash();
+}
+
+double nsPerOp(std::chrono::steady_clock::time_point start, size_t ops){
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()/ops;
+}
+
+// Returns false if the table got anything wrong.
+bool run(size_t numStacks){
+	StackTable table;
+	StackTrace trace;
+
+	auto start = std::chrono::steady_clock::now();
+	for(size_t i = 0; i < numStacks; ++i){
+		makeStack(i, trace);
+		if(table.intern(trace) != i)
+			return false;
+	}
+	double insertNs = nsPerOp(start, numStacks);
+
+	start = std::chrono::steady_clock::now();
+	for(size_t i = 0; i < numStacks; ++i){
+		makeStack(i, trace);
+		if(table.intern(trace) != i)
+			return false;
+	}
+	double lookupNs = nsPerOp(start, numStacks);
+
+	printf("%9zu %10.1f %10.1f %12.2f\n", numStacks, insertNs, lookupNs, 1000.0/insertNs);
+
+	// Colliding hashes, only the frames tell these apart.
+	StackTrace a, b;
+	makeStack(1, a);
+	makeStack(2, b);
+	b.hash = a.hash;
+	StackId idA = table.intern(a);
+	StackId idB = table.intern(b);
+	return idA == 1 && idB != idA && table.matches(idB, b) && !table.matches(idB, a);
+}
+
+int main(){
+	printf("   stacks  insert ns  lookup ns  Minserts/s\n");
+	for(size_t numStacks : {(size_t)1 << 14, (size_t)1 << 17, (size_t)1 << 20}){
+		if(!run(numStacks)){
+			printf("FAILED: wrong stack id\n");
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -1,15 +1,52 @@
+#ifdef _WIN32
 #include <Windows.h>
 #include <Psapi.h>
 #include <strsafe.h>
+#include "dbghelp.h"
+#include <conio.h>
+#include <errno.h>
+#include <stdlib.h>
+#else
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #include <iostream>
 #include <stdio.h>
-#include <conio.h>
+#include <stdint.h>
+#include <chrono>
 #include <thread>
 #include <vector>
 #include <string>
+#include <map>
+#include <fstream>
 #include <algorithm>
 
+#include "HeapProfiler.h"
+#include "EventStream.h"
+#include "Report.h"
+#include "ProfileDump.h"
+#include "PprofExport.h"
+#include "AllocationCounters.h"
+#include "Attach.h"
+#ifndef _WIN32
+#include "ElfSymbols.h"
+#endif
+
+#ifdef _WIN32
 // Inject a DLL into the target process by creating a new thread at LoadLibrary
 // Waits for injected thread to finish and returns its exit code.
 // 
@@ -54,6 +91,7 @@ DWORD LoadLibraryInjection(HANDLE proc, const char *dllName){
 
 	return dwThreadExitCode;
 }
+#endif
 
 std::string getDirectoryOfFile(const std::string &file){
 	size_t pos = (std::min)(file.find_last_of("/"), file.find_last_of("\\"));
@@ -63,16 +101,445 @@ std::string getDirectoryOfFile(const std::string &file){
 		return file.substr(0, pos);
 }
 
+// Options understood by Heapy. Most are for the injected dll and are handed to the target
+// process as an environment variable which HeapyInject reads when it is loaded.
+struct HeapyOption{
+	const char *name;
+	// Null for options only the launcher uses.
+	const char *environmentVariable;
+	bool takesValue;
+	// Largest value of options which take a number, 0 for anything else.
+	uint64_t maxValue;
+	const char *description;
+};
+
+const HeapyOption heapyOptions[] = {
+	{"--buffered", "HEAPY_BUFFERED", false, 0,
+		"Record allocations into per thread buffers which are\n"
+		"       aggregated by a background thread."},
+	{"--sample-rate", "HEAPY_SAMPLE_RATE", true, SIZE_MAX,
+		"Only record roughly one in every <value> bytes allocated.\n"
+		"       Reported sizes are then statistically unbiased estimates."},
+	{"--out-of-process", 0, false, 0,
+		"Stream allocations to this process which does all of the\n"
+		"       bookkeeping, symbol lookup and reporting."},
+	{"--binary", "HEAPY_BINARY", false, 0,
+		"Append compact binary snapshots with raw addresses to Heapy_Profile.bin\n"
+		"       instead of writing text reports. Symbolise them later with --symbolize."},
+	{"--pprof", "HEAPY_PPROF", false, 0,
+		"Also write the latest profile to Heapy_Profile.pb.gz with each report,\n"
+		"       in the gzipped profile.proto format read by pprof."},
+	{"--unwinder", "HEAPY_UNWINDER", true, 0,
+		"How stacks are captured: system (CaptureStackBackTrace, or backtrace on\n"
+		"       Linux, the default), framepointer, which is much faster but needs code\n"
+		"       built with frame pointers (/Oy- on x86, -fno-omit-frame-pointer on Linux,\n"
+		"       not available on x64 Windows), or table (x64 only) which uses unwind\n"
+		"       tables compiled from .pdata or .eh_frame when Heapy starts."},
+	{"--adaptive-depth", "HEAPY_ADAPTIVE_DEPTH", true, SIZE_MAX,
+		"Capture only the innermost 8 frames of each stack until its site has\n"
+		"       allocated <value> bytes in total, then full stacks for that site."},
+	{"--headers", "HEAPY_HEADERS", false, 0,
+		"Keep each allocation's site and size in a small header in front of it\n"
+		"       instead of in a table, so frees need no lookup. Hooks the whole\n"
+		"       malloc family including realloc, _msize and the aligned variants."},
+	{"--counters", "HEAPY_COUNTERS", false, 0,
+		"Start by only counting allocations by size and module, without stack\n"
+		"       traces, until full profiling is switched on with --full-profile."},
+	{"--full-profile", 0, true, INT32_MAX,
+		"Don't launch anything, instead switch the process with id <value>, started\n"
+		"       with --counters, over to full profiling."},
+	{"--attach", 0, true, INT32_MAX,
+		"Don't launch anything, instead profile the running process with id <value>\n"
+		"       until Enter is pressed, then detach and leave it running. Allocations\n"
+		"       from before attaching are reported as untracked, on Windows. On Linux\n"
+		"       libheapy.so is loaded with ptrace, which needs permission to trace the\n"
+		"       process, and libc's malloc and free are detoured as with --inline-hooks."},
+	{"--attach-time", 0, true, INT32_MAX,
+		"With --attach, detach after <value> milliseconds instead."},
+	{"--inline-hooks", "HEAPY_INLINE_HOOKS", false, 0,
+		"Linux only. Also detour malloc and free defined in the program or any other\n"
+		"       library, such as a statically linked allocator, with MinHook as on Windows."},
+	{"--import-hooks", "HEAPY_IMPORT_HOOKS", false, 0,
+		"Hook the allocators by pointing every loaded module's import table (the IAT,\n"
+		"       or the GOT on Linux) at the hooks instead of patching their code. Cheaper\n"
+		"       per call, but misses calls from inside the C runtime itself, from modules\n"
+		"       linking it statically and from modules loaded later."},
+	{"--start-paused", "HEAPY_START_PAUSED", false, 0,
+		"Don't record anything until the program calls HeapyResumeProfiling."},
+	{"--report-interval", "HEAPY_REPORT_INTERVAL", true, UINT32_MAX,
+		"Milliseconds between reports, 10000 by default."},
+	{"--collect-sites", "HEAPY_COLLECT_SITES", true, UINT32_MAX,
+		"Forget the stacks of sites which have had nothing live and allocated\n"
+		"       nothing for <value> milliseconds, keeping only their totals by caller.\n"
+		"       Stops long running processes growing Heapy's tables without bound."},
+	{"--symbolize", 0, true, 0,
+		"Don't launch anything, instead symbolise the binary profile <value>\n"
+		"       and append a text report for each snapshot to Heapy_Profile.txt."},
+};
+
+void printUsage(){
+	std::cout << "Usage: Heapy [options] <exe path> [args to pass to exe]\n"
+	             "       Heapy --symbolize=<binary profile>\n"
+	             "       Heapy [options] --attach=<process id>\n\n"
+	             "       The first argument which is not an option specifies the exe to launch.\n"
+	             "       Subsequent arguments are passed to launched exe.\n\n"
+	             "Options:\n";
+	for(const HeapyOption &option : heapyOptions){
+		std::cout << "    " << option.name << (option.takesValue ? "=<value>" : "") << "\n"
+		          << "       " << option.description << "\n";
+	}
+}
+
+// Parse a whole decimal number up to maxValue, returns false if value isn't one.
+bool parseNumber(const std::string &value, uint64_t maxValue, uint64_t &number){
+	// strtoull would skip spaces and take a sign.
+	if(value.empty() || value[0] < '0' || value[0] > '9')
+		return false;
+	errno = 0;
+	char *end;
+	unsigned long long parsed = strtoull(value.c_str(), &end, 10);
+	if(*end || errno == ERANGE || parsed > maxValue)
+		return false;
+	number = parsed;
+	return true;
+}
+
+// Value of a number option, which parseOptions has checked, or defaultValue if it
+// wasn't given.
+uint64_t getNumberOption(const std::map<std::string, std::string> &options, const char *name, uint64_t defaultValue){
+	uint64_t number = defaultValue;
+	auto value = options.find(name);
+	if(value != options.end())
+		parseNumber(value->second, UINT64_MAX, number);
+	return number;
+}
+
+// Consume leading --options into values, returns the index of the first non option
+// argument or -1 if an option was not recognised or its value is not valid.
+int parseOptions(int argc, char* argv[], std::map<std::string, std::string> &values){
+	int i = 1;
+	for(; i < argc && strncmp(argv[i], "--", 2) == 0; ++i){
+		std::string arg = argv[i];
+		size_t equals = arg.find('=');
+		std::string name = arg.substr(0, equals);
+		std::string value = equals == std::string::npos ? "1" : arg.substr(equals + 1);
+
+		auto option = std::find_if(std::begin(heapyOptions), std::end(heapyOptions),
+			[&](const HeapyOption &o){ return name == o.name; });
+		if(option == std::end(heapyOptions) || option->takesValue != (equals != std::string::npos)){
+			std::cerr << "Bad option " << arg << "\n\n";
+			return -1;
+		}
+		uint64_t number;
+		if(option->maxValue && !parseNumber(value, option->maxValue, number)){
+			std::cerr << "Bad option " << arg << ", the value must be a number up to " << option->maxValue << "\n\n";
+			return -1;
+		}
+
+		// The target process inherits our environment.
+		if(option->environmentVariable){
+#ifdef _WIN32
+			SetEnvironmentVariableA(option->environmentVariable, value.c_str());
+#else
+			setenv(option->environmentVariable, value.c_str(), 1);
+#endif
+		}
+		values[name] = value;
+	}
+	return i;
+}
+
+// How the launcher writes reports in out of process mode.
+struct ReportSettings{
+	size_t sampleInterval;
+	bool binary;
+	bool pprof;
+	uint32_t interval;
+	// Collect sites which have been dead for this many reports, 0 to keep every site.
+	uint32_t collectIdlePasses;
+};
+
+// The same settings HeapyInject reads from its environment when reporting in process.
+ReportSettings getReportSettings(std::map<std::string, std::string> &options){
+	ReportSettings settings;
+	settings.sampleInterval = (size_t)getNumberOption(options, "--sample-rate", 0);
+	settings.binary = options.count("--binary") != 0;
+	settings.pprof = options.count("--pprof") != 0;
+	settings.interval = (uint32_t)getNumberOption(options, "--report-interval", 10000);
+	uint64_t collectAfter = getNumberOption(options, "--collect-sites", 0);
+	uint64_t interval = (std::max)(settings.interval, (uint32_t)1);
+	settings.collectIdlePasses = collectAfter ? (uint32_t)(std::max)((collectAfter + interval - 1)/interval, (uint64_t)1) : 0;
+	return settings;
+}
+
+// Attach mode. The process has its environment already, so the options for the library
+// are handed over as NAME=value strings ending with an empty one, see Attach.h.
+std::string getAttachOptionsBlock(const std::map<std::string, std::string> &options){
+	std::string optionsBlock;
+	for(const HeapyOption &option : heapyOptions){
+		auto value = options.find(option.name);
+		if(option.environmentVariable && value != options.end())
+			optionsBlock += std::string(option.environmentVariable) + "=" + value->second + '\0';
+	}
+	optionsBlock += '\0';
+	return optionsBlock;
+}
+
+// Offline mode. Symbolise the snapshots in a binary profile written with --binary and
+// append a text report for each of them to Heapy_Profile.txt.
+int symbolizeProfileDump(const std::string &path){
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	if(!file){
+		std::cerr << "Could not open " << path << std::endl;
+		return -1;
+	}
+
+#ifdef _WIN32
+	// Modules are loaded into a symbol session of our own instead of a live process,
+	// dbghelp accepts any unique value as its handle.
+	HANDLE session = (HANDLE)(size_t)0x48454150;
+	if(!SymInitialize(session, NULL, false)){
+		std::cerr << "SymInitialize failed" << std::endl;
+		return -1;
+	}
+	setSymbolProcess(session);
+#endif
+
+	// Shared by all the snapshots, stacks seen before are interned to the same id.
+	StackTable *stackTable = new StackTable();
+	std::ofstream report("Heapy_Profile.txt", std::ios::out | std::ios::app);
+
+	ProfileDump dump;
+	size_t numSnapshots = 0;
+	while(readProfileDump(file, dump)){
+		if(dump.pointerSize != sizeof(void*)){
+			std::cerr << path << " was written by a " << dump.pointerSize*8 << " bit process, use the matching Heapy build." << std::endl;
+			return -1;
+		}
+
+#ifdef _WIN32
+		// Modules already loaded for an earlier snapshot are skipped by dbghelp.
+		for(const ProfileDump::Module &module : dump.modules)
+			SymLoadModuleEx(session, NULL, module.path.c_str(), NULL, module.base, (DWORD)module.size, NULL, 0);
+#else
+		// The module files are read for their symbol tables, as for a live process.
+		setSymbolModules(dump.modules);
+#endif
+
+		std::vector<std::pair<StackId, size_t>> allocs;
+		allocs.reserve(dump.sites.size());
+		for(const ProfileDump::Site &site : dump.sites){
+			StackTrace trace;
+			trace.depth = (std::min)(site.frames.size(), (size_t)backtraceSize);
+			for(size_t i = 0; i < trace.depth; ++i)
+				trace.backtrace[i] = (void*)(size_t)site.frames[i];
+			trace.computeHash();
+			allocs.push_back(std::make_pair(stackTable->intern(trace), (size_t)site.liveSize));
+		}
+
+		size_t totalSize = selectTopAllocationSites(allocs, 25);
+		writeTopAllocationReport(report, *stackTable, allocs, totalSize, (size_t)dump.sampleInterval);
+		numSnapshots++;
+	}
+
+	std::cout << "Wrote reports for " << numSnapshots << " snapshots to Heapy_Profile.txt" << std::endl;
+	return 0;
+}
+
+#ifdef _WIN32
+void writeReport(HANDLE process, HeapProfiler *profiler, const ReportSettings &settings){
+	if(settings.collectIdlePasses)
+		profiler->collectDeadSites(settings.collectIdlePasses);
+
+	if(settings.binary){
+		writeProfileDump(profiler, settings.sampleInterval, GetProcessId(process), "Heapy_Profile.bin");
+	}else{
+		// Pick up modules the target has loaded since last time.
+		SymRefreshModuleList(process);
+		forgetMissingSymbols();
+		printTopAllocationReport(profiler, settings.sampleInterval, 25);
+	}
+
+	if(settings.pprof)
+		writePprofProfile(profiler, settings.sampleInterval, GetProcessId(process), "Heapy_Profile.pb.gz");
+}
+
+// Out of process mode. Apply allocations streamed from the target to our own profiler
+// and write the reports from here until the target exits.
+void aggregateOutOfProcess(HANDLE process, EventStream *stream, const ReportSettings &settings){
+	// The target's symbols are looked up through its process handle.
+	if(!SymInitialize(process, NULL, true))
+		std::cerr << "SymInitialize failed\n";
+	setSymbolProcess(process);
+
+	HeapProfiler *profiler = new HeapProfiler();
+	EventStreamReader reader(stream, profiler);
+
+	bool finalReportDone = false;
+	DWORD lastReport = GetTickCount();
+	while(true){
+		size_t numRead = reader.drain();
+
+		if(reader.exitRequested() && !finalReportDone){
+			// The target waits for us in its exit handler so its modules are still loaded.
+			writeReport(process, profiler, settings);
+			stream->acknowledgeExit();
+			finalReportDone = true;
+		}
+
+		if(WaitForSingleObject(process, numRead ? 0 : 1) == WAIT_OBJECT_0){
+			reader.drain();
+			break;
+		}
+
+		if(GetTickCount() - lastReport >= settings.interval){
+			writeReport(process, profiler, settings);
+			lastReport = GetTickCount();
+		}
+	}
+
+	// The target went away without its exit handler running, report what we have.
+	if(!finalReportDone)
+		writeReport(process, profiler, settings);
+}
+
+// Counter mode. Tell a process which is only counting allocations to start profiling them.
+int switchToFullProfile(const std::string &processId){
+	std::string eventName = getFullProfileEventName(strtoul(processId.c_str(), 0, 10));
+	HANDLE event = OpenEventA(EVENT_MODIFY_STATE, FALSE, eventName.c_str());
+	if(!event){
+		std::cerr << "Process " << processId << " is not running with --counters" << std::endl;
+		return -1;
+	}
+	SetEvent(event);
+	CloseHandle(event);
+	std::cout << "Switched process " << processId << " to full profiling" << std::endl;
+	return 0;
+}
+
+// Run start on a new thread in process, returns the thread's exit code.
+DWORD runRemoteThread(HANDLE process, LPTHREAD_START_ROUTINE start){
+	HANDLE thread = CreateRemoteThread(process, NULL, 0, start, NULL, 0, NULL);
+	if(!thread)
+		return 0;
+	WaitForSingleObject(thread, INFINITE);
+	DWORD exitCode = 0;
+	GetExitCodeThread(thread, &exitCode);
+	CloseHandle(thread);
+	return exitCode;
+}
+
+// The copy of the dll called dllName loaded in process.
+HMODULE findRemoteModule(HANDLE process, const std::string &dllName){
+	HMODULE modules[1024];
+	DWORD bytesNeeded;
+	if(!EnumProcessModules(process, modules, sizeof(modules), &bytesNeeded))
+		return 0;
+	DWORD numModules = (std::min)(bytesNeeded, (DWORD)sizeof(modules))/sizeof(HMODULE);
+	for(DWORD i = 0; i < numModules; ++i){
+		char name[MAX_PATH];
+		if(GetModuleBaseNameA(process, modules[i], name, sizeof(name)) && _stricmp(name, dllName.c_str()) == 0)
+			return modules[i];
+	}
+	return 0;
+}
+
+// Address of one of the dll's exports in another process, where it is loaded as module.
+// It's at the same offset from the module as in a copy loaded here.
+LPTHREAD_START_ROUTINE getRemoteExport(HMODULE module, const std::string &dllPath, const char *name){
+	HMODULE local = LoadLibraryExA(dllPath.c_str(), NULL, DONT_RESOLVE_DLL_REFERENCES);
+	if(!local)
+		return 0;
+	FARPROC proc = GetProcAddress(local, name);
+	size_t offset = (size_t)proc - (size_t)local;
+	FreeLibrary(local);
+	return proc ? (LPTHREAD_START_ROUTINE)((size_t)module + offset) : 0;
+}
+
+// Attach mode. Inject into a process which is already running, profile it for a while,
+// then have HeapyInject remove its hooks and free its tables.
+int attachToProcess(const std::string &processId, const std::string &dllPath, const std::string &dllName,
+                    const std::map<std::string, std::string> &options){
+	DWORD pid = strtoul(processId.c_str(), 0, 10);
+	HANDLE process = OpenProcess(PROCESS_CREATE_THREAD | PROCESS_QUERY_INFORMATION | PROCESS_VM_OPERATION |
+	                             PROCESS_VM_READ | PROCESS_VM_WRITE | SYNCHRONIZE, FALSE, pid);
+	if(!process){
+		std::cerr << "Could not open process " << processId << std::endl;
+		return -1;
+	}
+
+	// The process has its environment already, hand the dll's options over in a mapping.
+	std::string optionsBlock = getAttachOptionsBlock(options);
+	HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)optionsBlock.size() + 1,
+	                                    getAttachOptionsName(pid).c_str());
+	void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0) : 0;
+	if(!view){
+		std::cerr << "Error creating the options for process " << processId << std::endl;
+		CloseHandle(process);
+		return -1;
+	}
+	memcpy(view, optionsBlock.data(), optionsBlock.size());
+	UnmapViewOfFile(view);
+
+	std::cout << "Attaching to process " << processId << "..." << std::endl;
+	try{
+		if(!LoadLibraryInjection(process, dllPath.c_str()))
+			throw std::runtime_error("LoadLibrary failed!");
+	}catch(const std::exception &e){
+		// The process handle has been closed for us.
+		std::cerr << "Error while injecting process: " << e.what() << "\n\n";
+		CloseHandle(mapping);
+		return -1;
+	}
+
+	// The dll only sets itself up when asked, outside of the loader lock.
+	HMODULE module = findRemoteModule(process, dllName);
+	LPTHREAD_START_ROUTINE attach = module ? getRemoteExport(module, dllPath, "HeapyAttach") : 0;
+	LPTHREAD_START_ROUTINE detach = module ? getRemoteExport(module, dllPath, "HeapyDetach") : 0;
+	bool attached = attach && detach && runRemoteThread(process, attach);
+	CloseHandle(mapping);
+	if(!attached){
+		std::cerr << "Could not attach to process " << processId << ", is Heapy already profiling it?" << std::endl;
+		CloseHandle(process);
+		return -1;
+	}
+
+	DWORD attachTime = INFINITE;
+	auto attachTimeOption = options.find("--attach-time");
+	if(attachTimeOption != options.end()){
+		attachTime = strtoul(attachTimeOption->second.c_str(), 0, 10);
+		std::cout << "Profiling for " << attachTime << "ms..." << std::endl;
+	}else{
+		std::cout << "Profiling, press Enter to detach..." << std::endl;
+	}
+
+	DWORD start = GetTickCount();
+	while(WaitForSingleObject(process, 100) == WAIT_TIMEOUT){
+		if(attachTime != INFINITE ? GetTickCount() - start >= attachTime : _kbhit() && _getch() == '\r'){
+			bool detached = runRemoteThread(process, detach) != 0;
+			std::cout << (detached ? "Detached from process " : "Could not detach from process ") << processId << std::endl;
+			CloseHandle(process);
+			return detached ? 0 : -1;
+		}
+	}
+
+	// Exiting wrote the last report.
+	std::cout << "Process " << processId << " exited" << std::endl;
+	CloseHandle(process);
+	return 0;
+}
+
 extern "C" int main(int argc, char* argv[]){
-	if(argc < 2){
-		std::cout << "No exe specified!\n\n";
-		std::cout << "Usage: Heapy <exe path> [args to pass to exe]\n\n"
-		             "       The first argument specifies the exe to launch.\n"
-		             "       Subsequent arguments are passed to launched exe.\n";
-			 
+	std::map<std::string, std::string> options;
+	int targetArg = parseOptions(argc, argv, options);
+	if(targetArg < 0){
+		printUsage();
 		return -1;
 	}
-	char *injectionTarget = argv[1];
+	if(options.count("--symbolize"))
+		return symbolizeProfileDump(options["--symbolize"]);
+	if(options.count("--full-profile"))
+		return switchToFullProfile(options["--full-profile"]);
 
 	bool win64 = false;
 	#ifdef _WIN64
@@ -90,8 +557,30 @@ extern "C" int main(int argc, char* argv[]){
 	GetModuleFileNameA(NULL, exePath, MAX_PATH );
 	std::string dllPath = getDirectoryOfFile(std::string(exePath)) + "\\" + heapyInjectDllName;
 
+	// Header mode has to see every allocation, including those from inside the CRT.
+	if(options.count("--headers") && options.count("--import-hooks")){
+		std::cerr << "--headers can't be used with --import-hooks" << std::endl;
+		return -1;
+	}
+
+	if(options.count("--attach")){
+		// Header mode blocks couldn't be freed after detaching, and out of process the
+		// launcher would need to stop aggregating on detach.
+		if(options.count("--headers") || options.count("--out-of-process")){
+			std::cerr << "--headers and --out-of-process can't be used with --attach" << std::endl;
+			return -1;
+		}
+		return attachToProcess(options["--attach"], dllPath, heapyInjectDllName, options);
+	}
+	if(targetArg >= argc){
+		std::cout << "No exe specified!\n\n";
+		printUsage();
+		return -1;
+	}
+	char *injectionTarget = argv[targetArg];
+
 	std::string commandLine = injectionTarget;
-	for(int i = 2; i < argc; ++i){
+	for(int i = targetArg + 1; i < argc; ++i){
 		commandLine += " " + std::string(argv[i]);
 	}
 
@@ -102,6 +591,19 @@ extern "C" int main(int argc, char* argv[]){
 	std::cout << "Dll to inject: " << dllPath << std::endl;
 
 
+	// Create the shared memory the target streams allocations through, it finds it
+	// by name from its environment.
+	EventStream *stream = 0;
+	if(options.count("--out-of-process")){
+		std::string streamName = "Local\\Heapy_Stream_" + std::to_string(GetCurrentProcessId());
+		stream = EventStream::create(streamName.c_str(), 1 << 16);
+		if(!stream){
+			std::cerr << "Error creating event stream " << streamName << std::endl;
+			return -1;
+		}
+		SetEnvironmentVariableA("HEAPY_STREAM", streamName.c_str());
+	}
+
 	DWORD flags = CREATE_SUSPENDED;
 	PROCESS_INFORMATION pi;
 	STARTUPINFOA si;
@@ -138,9 +640,418 @@ extern "C" int main(int argc, char* argv[]){
 	// Once the injection thread has returned it is safe to resume the main thread.
 	ResumeThread(pi.hThread);
 
+	if(stream){
+		aggregateOutOfProcess(pi.hProcess, stream, getReportSettings(options));
+		return 0;
+	}
+
 	// Wait for the target application to exit. 
 	// This doesn't matter to much, but makes heapy nicer to use in test scripts.
 	// (Like the ProfileTestApplication project.)
 	WaitForSingleObject(pi.hProcess, INFINITE);
 	return 0;
 }
+#else
+void writeReport(pid_t pid, HeapProfiler *profiler, const ReportSettings &settings){
+	if(settings.collectIdlePasses)
+		profiler->collectDeadSites(settings.collectIdlePasses);
+
+	if(settings.binary){
+		writeProfileDump(profiler, settings.sampleInterval, (unsigned long)pid, "Heapy_Profile.bin");
+	}else{
+		// Modules the target has loaded since last time are picked up with its map.
+		forgetMissingSymbols();
+		printTopAllocationReport(profiler, settings.sampleInterval, 25);
+	}
+
+	if(settings.pprof)
+		writePprofProfile(profiler, settings.sampleInterval, (unsigned long)pid, "Heapy_Profile.pb.gz");
+}
+
+// Out of process mode, as on Windows. The target is our child, which is reaped here.
+void aggregateOutOfProcess(pid_t pid, EventStream *stream, const ReportSettings &settings){
+	// The target's symbols are read from the files it has mapped.
+	setSymbolProcess((void*)(uintptr_t)pid);
+
+	HeapProfiler *profiler = new HeapProfiler();
+	EventStreamReader reader(stream, profiler);
+
+	bool finalReportDone = false;
+	auto lastReport = std::chrono::steady_clock::now();
+	while(true){
+		size_t numRead = reader.drain();
+
+		if(reader.exitRequested() && !finalReportDone){
+			// The target waits for us in its exit handler so its maps are still there.
+			writeReport(pid, profiler, settings);
+			stream->acknowledgeExit();
+			finalReportDone = true;
+		}
+
+		int status;
+		if(waitpid(pid, &status, WNOHANG) == pid){
+			reader.drain();
+			break;
+		}
+		if(!numRead)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		if(std::chrono::steady_clock::now() - lastReport >= std::chrono::milliseconds(settings.interval)){
+			writeReport(pid, profiler, settings);
+			lastReport = std::chrono::steady_clock::now();
+		}
+	}
+
+	// The target went away without its exit handler running, report what we have.
+	if(!finalReportDone)
+		writeReport(pid, profiler, settings);
+}
+
+// Counter mode. The library switches over to full profiling when sent SIGUSR1.
+int switchToFullProfile(const std::string &processId){
+	if(kill((pid_t)strtol(processId.c_str(), 0, 10), SIGUSR1) != 0){
+		std::cerr << "Could not signal process " << processId << std::endl;
+		return -1;
+	}
+	std::cout << "Switched process " << processId << " to full profiling" << std::endl;
+	return 0;
+}
+
+// Attach mode. Where the file at path is mapped in process pid, 0 if it isn't. Files are
+// matched by device and inode, the maps show their paths with any symlinks resolved.
+uintptr_t findRemoteModule(pid_t pid, const std::string &path){
+	struct stat file;
+	if(stat(path.c_str(), &file) != 0)
+		return 0;
+	std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+	std::string line;
+	while(std::getline(maps, line)){
+		unsigned long long start, end, offset, inode;
+		unsigned int major, minor;
+		char permissions[8];
+		if(sscanf(line.c_str(), "%llx-%llx %7s %llx %x:%x %llu", &start, &end, permissions, &offset, &major, &minor, &inode) == 7 &&
+		   offset == 0 && inode == file.st_ino && makedev(major, minor) == file.st_dev)
+			return (uintptr_t)start;
+	}
+	return 0;
+}
+
+// Whether address in process pid is in the code of one of the files at paths.
+bool isInRemoteModule(pid_t pid, uintptr_t address, const std::vector<std::string> &paths){
+	std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+	std::string line;
+	while(std::getline(maps, line)){
+		unsigned long long start, end, offset, inode;
+		unsigned int major, minor;
+		char permissions[8];
+		if(sscanf(line.c_str(), "%llx-%llx %7s %llx %x:%x %llu", &start, &end, permissions, &offset, &major, &minor, &inode) != 7 ||
+		   address < start || address >= end)
+			continue;
+		for(const std::string &path : paths){
+			struct stat file;
+			if(stat(path.c_str(), &file) == 0 && inode == file.st_ino && makedev(major, minor) == file.st_dev)
+				return true;
+		}
+		return false;
+	}
+	return false;
+}
+
+// Address in process pid of a function in one of the libraries loaded here. It's at the
+// same offset from the start of its library there as here.
+uintptr_t getRemoteFunction(pid_t pid, void *function){
+	Dl_info info;
+	if(!dladdr(function, &info))
+		return 0;
+	uintptr_t base = findRemoteModule(pid, info.dli_fname);
+	return base ? base + ((uintptr_t)function - (uintptr_t)info.dli_fbase) : 0;
+}
+
+// Address of the library's export called name, where it's loaded at base in another process.
+uintptr_t getRemoteExport(const std::string &libraryPath, uintptr_t base, const char *name){
+	uintptr_t address = 0;
+	enumerateElfSymbols(libraryPath.c_str(), base, name, [](const char *, void *found, void *context){
+		*(uintptr_t*)context = (uintptr_t)found;
+		return false;
+	}, &address);
+	return address;
+}
+
+// Wait for the traced process to stop, passing on any signals it gets in the meantime.
+// Returns the signal it stopped with, 0 for a ptrace stop or -1 if it has gone away.
+int waitForStop(pid_t pid){
+	while(true){
+		int status;
+		if(waitpid(pid, &status, __WALL) != pid || !WIFSTOPPED(status))
+			return -1;
+		if(status >> 16 == PTRACE_EVENT_STOP)
+			return 0;
+		if(WSTOPSIG(status) == SIGSEGV)
+			return SIGSEGV;
+		ptrace(PTRACE_CONT, pid, 0, (void*)(uintptr_t)WSTOPSIG(status));
+	}
+}
+
+// Attach mode. There's no CreateRemoteThread, instead the process's main thread is
+// stopped with ptrace and made to call function, as a debugger does, then put back as
+// it was. The first argument points to a copy of string left on its stack past the red
+// zone, the second is arg. The call returns to address 0, where the fault stops the
+// thread again before the program can see it. False if the call couldn't be made.
+//
+// The thread is only borrowed while it's blocked in a system call, or running outside
+// the C library, the dynamic linker and libheapy.so, as otherwise it could be holding
+// a lock which the call would wait on for ever. It's given a second to get to one.
+bool callRemoteFunction(pid_t pid, uintptr_t function, const std::string &string, uintptr_t arg,
+                        const std::string &libraryPath, uintptr_t &result){
+	if(ptrace(PTRACE_SEIZE, pid, 0, 0) != 0)
+		return false;
+
+	Dl_info libc, linker;
+	dladdr((void*)&dlopen, &libc);
+	dladdr((void*)getauxval(AT_BASE), &linker);
+	std::vector<std::string> lockingModules = {libc.dli_fname, linker.dli_fname, libraryPath};
+
+	struct user_regs_struct saved;
+	for(int attempt = 0;; ++attempt){
+		if(ptrace(PTRACE_INTERRUPT, pid, 0, 0) != 0 || waitForStop(pid) != 0 ||
+		   ptrace(PTRACE_GETREGS, pid, 0, &saved) != 0){
+			ptrace(PTRACE_DETACH, pid, 0, 0);
+			return false;
+		}
+		// Interrupted system calls return the kernel's ERESTARTSYS to ERESTART_RESTARTBLOCK.
+		long error = (long)saved.rax;
+		bool blocked = (long)saved.orig_rax >= 0 && (error == -EINTR || (error <= -512 && error >= -516));
+		if(blocked || !isInRemoteModule(pid, saved.rip, lockingModules))
+			break;
+		if(attempt == 100){
+			ptrace(PTRACE_DETACH, pid, 0, 0);
+			return false;
+		}
+		ptrace(PTRACE_CONT, pid, 0, 0);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	struct user_regs_struct call = saved;
+	uintptr_t stringAddress = (saved.rsp - 128 - string.size() - 1) & ~(uintptr_t)15;
+	std::vector<long> words((string.size() + sizeof(long))/sizeof(long), 0);
+	string.copy((char*)&words[0], string.size());
+	bool written = true;
+	for(size_t i = 0; i < words.size(); ++i)
+		written = written && ptrace(PTRACE_POKEDATA, pid, (void*)(stringAddress + i*sizeof(long)), (void*)words[i]) == 0;
+	// The return address, pushed as if by a call, leaves the stack aligned as the ABI has it.
+	call.rsp = stringAddress - 16 - sizeof(long);
+	written = written && ptrace(PTRACE_POKEDATA, pid, (void*)call.rsp, 0) == 0;
+	call.rip = function;
+	call.rdi = string.empty() ? 0 : stringAddress;
+	call.rsi = arg;
+	call.rax = 0;
+	// Not in a system call any more, so the kernel doesn't restart it at the new rip.
+	call.orig_rax = -1;
+	call.eflags &= ~0x400ULL;
+
+	bool returned = false;
+	if(written && ptrace(PTRACE_SETREGS, pid, 0, &call) == 0 && ptrace(PTRACE_CONT, pid, 0, 0) == 0){
+		struct user_regs_struct after;
+		int signal;
+		while((signal = waitForStop(pid)) >= 0){
+			if(signal == SIGSEGV && ptrace(PTRACE_GETREGS, pid, 0, &after) == 0 && after.rip == 0){
+				result = after.rax;
+				returned = true;
+				break;
+			}
+			// A fault in the call itself is the program's to handle.
+			ptrace(PTRACE_CONT, pid, 0, (void*)(uintptr_t)signal);
+		}
+		if(signal < 0)
+			return false;
+	}
+
+	// Put back, a system call it was blocked in is restarted.
+	ptrace(PTRACE_SETREGS, pid, 0, &saved);
+	ptrace(PTRACE_DETACH, pid, 0, 0);
+	return returned;
+}
+
+// Whether process pid is still running, rather than gone or waiting to be reaped.
+bool isProcessRunning(pid_t pid){
+	std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+	std::string line;
+	if(!std::getline(stat, line))
+		return false;
+	size_t end = line.rfind(')');
+	return end != std::string::npos && end + 2 < line.size() && line[end + 2] != 'Z' && line[end + 2] != 'X';
+}
+
+// Attach mode, as on Windows. libheapy.so is loaded into the running process with dlopen,
+// then HeapyAttach and HeapyDetach are called in it. Tracing a process which isn't our
+// child can need privileges, see ptrace_scope in Yama's documentation.
+int attachToProcess(const std::string &processId, const std::string &libraryPath,
+                    const std::map<std::string, std::string> &options){
+	pid_t pid = (pid_t)strtol(processId.c_str(), 0, 10);
+	if(!isProcessRunning(pid)){
+		std::cerr << "Could not find process " << processId << std::endl;
+		return -1;
+	}
+
+	// The library's options, which it reads in HeapyAttach.
+	std::string optionsName = getAttachOptionsName((unsigned long)pid);
+	std::string optionsBlock = getAttachOptionsBlock(options) + '\0';
+	int fd = shm_open(optionsName.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0600);
+	bool written = fd >= 0 && write(fd, optionsBlock.data(), optionsBlock.size()) == (ssize_t)optionsBlock.size();
+	if(fd >= 0)
+		close(fd);
+	if(!written){
+		std::cerr << "Error creating the options for process " << processId << std::endl;
+		shm_unlink(optionsName.c_str());
+		return -1;
+	}
+
+	std::cout << "Attaching to process " << processId << "..." << std::endl;
+	uintptr_t dlopenAddress = getRemoteFunction(pid, (void*)&dlopen);
+	uintptr_t handle = 0;
+	if(!dlopenAddress || !callRemoteFunction(pid, dlopenAddress, libraryPath, RTLD_NOW, libraryPath, handle) || !handle){
+		std::cerr << "Error loading " << libraryPath << " into process " << processId
+		          << ", check that it can be traced and uses the same C library as Heapy." << std::endl;
+		shm_unlink(optionsName.c_str());
+		return -1;
+	}
+
+	uintptr_t base = findRemoteModule(pid, libraryPath);
+	uintptr_t attach = base ? getRemoteExport(libraryPath, base, "HeapyAttach") : 0;
+	uintptr_t detach = base ? getRemoteExport(libraryPath, base, "HeapyDetach") : 0;
+	uintptr_t result = 0;
+	bool attached = attach && detach && callRemoteFunction(pid, attach, "", 0, libraryPath, result) && result;
+	shm_unlink(optionsName.c_str());
+	if(!attached){
+		std::cerr << "Could not attach to process " << processId << ", is Heapy already profiling it?" << std::endl;
+		return -1;
+	}
+
+	long attachTime = -1;
+	auto attachTimeOption = options.find("--attach-time");
+	if(attachTimeOption != options.end()){
+		attachTime = strtol(attachTimeOption->second.c_str(), 0, 10);
+		std::cout << "Profiling for " << attachTime << "ms..." << std::endl;
+	}else{
+		std::cout << "Profiling, press Enter to detach..." << std::endl;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	while(isProcessRunning(pid)){
+		bool detachNow;
+		if(attachTime >= 0){
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			detachNow = std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(attachTime);
+		}else{
+			// Input ending counts as Enter too.
+			pollfd input = {0, POLLIN, 0};
+			char c = 0;
+			detachNow = poll(&input, 1, 100) > 0 && (read(0, &c, 1) <= 0 || c == '\n');
+		}
+		if(!detachNow)
+			continue;
+
+		// HeapyDetach turns the call down while the thread is inside one of the hooks.
+		bool detached = false;
+		for(int attempt = 0; attempt < 100 && !detached && isProcessRunning(pid); ++attempt){
+			if(!callRemoteFunction(pid, detach, "", 0, libraryPath, result))
+				break;
+			detached = result != 0;
+			if(!detached)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		std::cout << (detached ? "Detached from process " : "Could not detach from process ") << processId << std::endl;
+		return detached ? 0 : -1;
+	}
+
+	// Exiting wrote the last report.
+	std::cout << "Process " << processId << " exited" << std::endl;
+	return 0;
+}
+
+// On Linux there's nothing to inject, libheapy.so is preloaded into the target in place
+// of the process it replaces us with. Out of process the target is a child of ours.
+extern "C" int main(int argc, char* argv[]){
+	std::map<std::string, std::string> options;
+	int targetArg = parseOptions(argc, argv, options);
+	if(targetArg < 0){
+		printUsage();
+		return -1;
+	}
+	if(options.count("--symbolize"))
+		return symbolizeProfileDump(options["--symbolize"]);
+	if(options.count("--full-profile"))
+		return switchToFullProfile(options["--full-profile"]);
+
+	// Header mode needs Windows' heap.
+	if(options.count("--headers")){
+		std::cerr << "--headers is only supported on Windows" << std::endl;
+		return -1;
+	}
+	if(options.count("--inline-hooks") && options.count("--import-hooks")){
+		std::cerr << "--inline-hooks can't be used with --import-hooks" << std::endl;
+		return -1;
+	}
+
+	// Assume that the library is in the same directory as the launcher.
+	char exePath[4096];
+	ssize_t exePathLength = readlink("/proc/self/exe", exePath, sizeof(exePath) - 1);
+	exePath[exePathLength > 0 ? exePathLength : 0] = 0;
+	std::string libraryPath = getDirectoryOfFile(std::string(exePath)) + "/libheapy.so";
+
+	if(options.count("--attach")){
+		// The launcher would need to stop aggregating on detach, as on Windows.
+		if(options.count("--out-of-process")){
+			std::cerr << "--out-of-process can't be used with --attach" << std::endl;
+			return -1;
+		}
+		return attachToProcess(options["--attach"], libraryPath, options);
+	}
+	if(targetArg >= argc){
+		std::cout << "No exe specified!\n\n";
+		printUsage();
+		return -1;
+	}
+	char *injectionTarget = argv[targetArg];
+
+	std::cout << "Starting process with heap profiling enabled..." << std::endl;
+	std::cout << "Target exe path: " << injectionTarget << std::endl;
+	std::cout << "Library to preload: " << libraryPath << std::endl;
+
+	const char *preload = getenv("LD_PRELOAD");
+	if(preload && *preload)
+		libraryPath += ":" + std::string(preload);
+	setenv("LD_PRELOAD", libraryPath.c_str(), 1);
+	// Lazily bound GOT slots only hold their function's address once it's been called.
+	if(options.count("--import-hooks"))
+		setenv("LD_BIND_NOW", "1", 1);
+
+	if(!options.count("--out-of-process")){
+		execvp(injectionTarget, argv + targetArg);
+		std::cerr << "Error starting process " << injectionTarget << std::endl;
+		return -1;
+	}
+
+	// Out of process we stay around to read the stream, and start the target as a child.
+	std::string streamName = "/Heapy_Stream_" + std::to_string(getpid());
+	EventStream *stream = EventStream::create(streamName.c_str(), 1 << 16);
+	if(!stream){
+		std::cerr << "Error creating event stream " << streamName << std::endl;
+		return -1;
+	}
+	setenv("HEAPY_STREAM", streamName.c_str(), 1);
+
+	pid_t pid = fork();
+	if(pid == 0){
+		execvp(injectionTarget, argv + targetArg);
+		std::cerr << "Error starting process " << injectionTarget << std::endl;
+		_exit(127);
+	}
+	if(pid > 0)
+		aggregateOutOfProcess(pid, stream, getReportSettings(options));
+	else
+		std::cerr << "Error starting process " << injectionTarget << std::endl;
+	EventStream::remove(streamName.c_str());
+	return pid > 0 ? 0 : -1;
+}
+#endif
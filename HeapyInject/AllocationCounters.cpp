@@ -0,0 +1,110 @@
+#include "AllocationCounters.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include <iomanip>
+#include <map>
+
+size_t AllocationCounters::getSizeClass(size_t size){
+	if(size > ((size_t)1 << (numSizeClasses + 2)))
+		return numSizeClasses - 1;
+	// Class n holds sizes up to 16 << n.
+	unsigned long highest = (unsigned long)((size ? size - 1 : 0) | 15);
+#ifdef _MSC_VER
+	unsigned long bit;
+	_BitScanReverse(&bit, highest);
+#else
+	unsigned long bit = 31 - __builtin_clz((unsigned)highest);
+#endif
+	return bit - 3;
+}
+
+AllocationCounters::~AllocationCounters(){
+	for(ThreadCounters *counters : threadCounters)
+		delete counters;
+}
+
+AllocationCounters::ThreadCounters *AllocationCounters::acquire(){
+	std::lock_guard<std::mutex> lk(mutex);
+	for(size_t i = 0; i < threadCounters.size(); ++i){
+		if(!threadCounters[i]->owned){
+			threadCounters[i]->owned = true;
+			return threadCounters[i];
+		}
+	}
+
+	// Value initialised, so every counter starts at zero.
+	ThreadCounters *counters = new ThreadCounters();
+	counters->owned = true;
+	threadCounters.push_back(counters);
+	return counters;
+}
+
+void AllocationCounters::release(ThreadCounters *counters){
+	std::lock_guard<std::mutex> lk(mutex);
+	counters->owned = false;
+}
+
+void AllocationCounters::setMallocModule(size_t module, const char *name){
+	std::lock_guard<std::mutex> lk(mutex);
+	mallocModules[module] = name;
+}
+
+void AllocationCounters::setFreeModule(size_t module, const char *name){
+	std::lock_guard<std::mutex> lk(mutex);
+	freeModules[module] = name;
+}
+
+void AllocationCounters::writeReport(std::ostream &stream){
+	struct Totals{
+		size_t count;
+		size_t bytes;
+		size_t frees;
+	};
+	std::map<std::string, Totals> modules;
+	Totals classes[numSizeClasses] = {};
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		for(const ThreadCounters *counters : threadCounters){
+			for(size_t c = 0; c < numSizeClasses; ++c){
+				classes[c].count += counters->classCount[c].load(std::memory_order_relaxed);
+				classes[c].bytes += counters->classBytes[c].load(std::memory_order_relaxed);
+			}
+			// Malloc and free hooks are numbered separately, match them up by module.
+			for(size_t m = 0; m < maxModules; ++m){
+				size_t count = counters->moduleCount[m].load(std::memory_order_relaxed);
+				size_t frees = counters->moduleFrees[m].load(std::memory_order_relaxed);
+				if(count){
+					Totals &totals = modules[mallocModules[m]];
+					totals.count += count;
+					totals.bytes += counters->moduleBytes[m].load(std::memory_order_relaxed);
+				}
+				if(frees)
+					modules[freeModules[m]].frees += frees;
+			}
+		}
+	}
+
+	double bytesInAMegaByte = 1024*1024;
+	auto precision = std::setprecision(5);
+	stream << "=======================================\n\n";
+	stream << "Allocation counters.\n\n";
+	stream << "By module:\n";
+	for(auto it = modules.begin(); it != modules.end(); ++it){
+		stream << "    " << it->first << ": " << it->second.count << " allocations, " <<
+			precision << it->second.bytes/bytesInAMegaByte << "Mb, " << it->second.frees << " frees\n";
+	}
+	stream << "\nBy size:\n";
+	for(size_t c = 0; c < numSizeClasses; ++c){
+		if(!classes[c].count)
+			continue;
+		if(c == numSizeClasses - 1)
+			stream << "    over " << ((size_t)1 << (c + 3)) << " bytes: ";
+		else
+			stream << "    up to " << ((size_t)16 << c) << " bytes: ";
+		stream << classes[c].count << " allocations, " << precision << classes[c].bytes/bytesInAMegaByte << "Mb\n";
+	}
+	stream << "\n";
+}
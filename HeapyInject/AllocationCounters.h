@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+#include "Platform.h"
+#include "Arena.h"
+
+// Name of the event the Heapy launcher sets to switch a process in counter mode over
+// to full profiling.
+inline std::string getFullProfileEventName(unsigned long processId){
+	return "Heapy_FullProfile_" + std::to_string(processId);
+}
+
+// Counter mode. Cheap enough to leave on in production: each malloc and free just bumps
+// a few counters owned by the calling thread, bucketed by power of two size class and
+// by the module whose allocator was called. No stacks, locks or tables.
+class AllocationCounters{
+public:
+	// Up to 16 bytes, then each power of two up to 2GB, then everything bigger.
+	static const size_t numSizeClasses = 29;
+	// One per hook, the hook number identifies the module.
+	static const size_t maxModules = 128;
+
+	// Only the owning thread writes its counters, anyone can read them. Aligned so no
+	// two threads' counters share a cache line.
+	struct __declspec(align(64)) ThreadCounters : CacheAligned{
+		std::atomic<size_t> classCount[numSizeClasses];
+		std::atomic<size_t> classBytes[numSizeClasses];
+		std::atomic<size_t> moduleCount[maxModules];
+		std::atomic<size_t> moduleBytes[maxModules];
+		std::atomic<size_t> moduleFrees[maxModules];
+		std::atomic<bool> owned;
+	};
+
+	~AllocationCounters();
+
+	// Counters for a new thread. Those of exited threads are reused, keeping their totals.
+	ThreadCounters *acquire();
+	void release(ThreadCounters *counters);
+
+	static void countMalloc(ThreadCounters *counters, size_t module, size_t size){
+		size_t sizeClass = getSizeClass(size);
+		bump(counters->classCount[sizeClass], 1);
+		bump(counters->classBytes[sizeClass], size);
+		bump(counters->moduleCount[module], 1);
+		bump(counters->moduleBytes[module], size);
+	}
+
+	static void countFree(ThreadCounters *counters, size_t module){
+		bump(counters->moduleFrees[module], 1);
+	}
+
+	// Names of the modules whose malloc and free hook numbers are counted against.
+	void setMallocModule(size_t module, const char *name);
+	void setFreeModule(size_t module, const char *name);
+
+	// Totals over every thread, by module and by size class.
+	void writeReport(std::ostream &stream);
+
+private:
+	// A single writer, so a plain add is enough and much cheaper than a locked one.
+	static void bump(std::atomic<size_t> &counter, size_t value){
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	static size_t getSizeClass(size_t size);
+
+	std::mutex mutex;
+	std::vector<ThreadCounters*> threadCounters;
+	std::string mallocModules[maxModules];
+	std::string freeModules[maxModules];
+};
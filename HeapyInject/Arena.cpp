@@ -0,0 +1,246 @@
+#include "Arena.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <thread>
+
+// VirtualAlloc's allocation granularity, so every region starts on a multiple of it and
+// the region of any block can be found by rounding its address down.
+static const size_t regionSize = 64*1024;
+static const size_t pageSize = 4096;
+// Keeps blocks in the first size classes aligned to cache lines.
+static const size_t regionHeaderSize = 64;
+
+// Two size classes per power of two, anything bigger gets its own region.
+static const size_t sizeClasses[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768,
+                                     1024, 1536, 2048, 3072, 4096, 6144, 8192};
+static const size_t numSizeClasses = sizeof(sizeClasses)/sizeof(sizeClasses[0]);
+static const uint32_t largeRegion = 0xFFFFFFFF;
+
+struct RegionHeader{
+	// Index of the size class of the region's blocks, or largeRegion.
+	uint32_t sizeClass;
+	// Bytes committed for a large region.
+	size_t size;
+};
+
+struct FreeBlock{
+	FreeBlock *next;
+};
+
+// Everything here is zero initialised, so the arena works before any constructors have
+// run. Other globals' constructors can call operator new.
+struct Pool{
+	std::atomic_flag lock;
+	FreeBlock *freeBlocks;
+	// Unused end of the pool's newest region.
+	char *next;
+	char *end;
+};
+
+static Pool pools[numSizeClasses];
+static std::atomic<size_t> usedBytes;
+static std::atomic<size_t> committedBytes;
+
+// Fresh zeroed pages from the system, starting on a regionSize boundary.
+static void *systemAllocate(size_t size){
+#ifdef _WIN32
+	return VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	// mmap only promises page alignment, map enough to trim down to a region boundary.
+	if(size > (size_t)-1 - regionSize)
+		return 0;
+	char *mapping = (char*)mmap(0, size + regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mapping == MAP_FAILED)
+		return 0;
+	char *start = (char*)(((size_t)mapping + regionSize - 1) & ~(regionSize - 1));
+	if(start > mapping)
+		munmap(mapping, start - mapping);
+	munmap(start + size, mapping + regionSize - start);
+	return start;
+#endif
+}
+
+static void systemFree(void *p, size_t size){
+#ifdef _WIN32
+	VirtualFree(p, 0, MEM_RELEASE);
+#else
+	munmap(p, size);
+#endif
+}
+
+static void lockPool(Pool &pool){
+	while(pool.lock.test_and_set(std::memory_order_acquire))
+		std::this_thread::yield();
+}
+
+static void unlockPool(Pool &pool){
+	pool.lock.clear(std::memory_order_release);
+}
+
+static void *allocateLarge(size_t size){
+	if(size > (size_t)-1 - regionHeaderSize - pageSize)
+		return 0;
+	size_t regionBytes = (size + regionHeaderSize + pageSize - 1) & ~(pageSize - 1);
+	char *region = (char*)systemAllocate(regionBytes);
+	if(!region)
+		return 0;
+
+	RegionHeader *header = (RegionHeader*)region;
+	header->sizeClass = largeRegion;
+	header->size = regionBytes;
+	usedBytes += regionBytes;
+	committedBytes += regionBytes;
+	return region + regionHeaderSize;
+}
+
+void *arenaAllocate(size_t size){
+	if(size > sizeClasses[numSizeClasses - 1])
+		return allocateLarge(size);
+
+	size_t sizeClass = std::lower_bound(sizeClasses, sizeClasses + numSizeClasses, size) - sizeClasses;
+	size_t blockSize = sizeClasses[sizeClass];
+	Pool &pool = pools[sizeClass];
+
+	void *block;
+	lockPool(pool);
+	if(pool.freeBlocks){
+		block = pool.freeBlocks;
+		pool.freeBlocks = pool.freeBlocks->next;
+	}else{
+		if((size_t)(pool.end - pool.next) < blockSize){
+			char *region = (char*)systemAllocate(regionSize);
+			if(!region){
+				unlockPool(pool);
+				return 0;
+			}
+			((RegionHeader*)region)->sizeClass = (uint32_t)sizeClass;
+			pool.next = region + regionHeaderSize;
+			pool.end = region + regionSize;
+			committedBytes += regionSize;
+		}
+		block = pool.next;
+		pool.next += blockSize;
+	}
+	unlockPool(pool);
+
+	usedBytes += blockSize;
+	return block;
+}
+
+void *arenaAllocateZeroed(size_t size){
+	if(size > sizeClasses[numSizeClasses - 1])
+		return allocateLarge(size);
+
+	void *block = arenaAllocate(size);
+	if(block)
+		memset(block, 0, size);
+	return block;
+}
+
+void *arenaAllocateAligned(size_t size, size_t alignment){
+	if(alignment > regionHeaderSize)
+		return 0;
+	// Every size class from the header's size up is a multiple of it, except 96 which a
+	// multiple of 64 never rounds up to, and blocks start right after the header. So a
+	// block whose size is a multiple of the header's is aligned to it.
+	if(size > (size_t)-1 - regionHeaderSize)
+		return 0;
+	return arenaAllocate((size + regionHeaderSize - 1) & ~(regionHeaderSize - 1));
+}
+
+void arenaFree(void *p){
+	if(!p)
+		return;
+
+	RegionHeader *header = (RegionHeader*)((size_t)p & ~(regionSize - 1));
+	if(header->sizeClass == largeRegion){
+		usedBytes -= header->size;
+		committedBytes -= header->size;
+		systemFree(header, header->size);
+		return;
+	}
+
+	// Pooled memory is never given back to the system, it's reused for the same size.
+	Pool &pool = pools[header->sizeClass];
+	FreeBlock *block = (FreeBlock*)p;
+	lockPool(pool);
+	block->next = pool.freeBlocks;
+	pool.freeBlocks = block;
+	unlockPool(pool);
+
+	usedBytes -= sizeClasses[header->sizeClass];
+}
+
+ArenaUsage getArenaUsage(){
+	ArenaUsage usage;
+	usage.used = usedBytes.load(std::memory_order_relaxed);
+	usage.committed = committedBytes.load(std::memory_order_relaxed);
+	return usage;
+}
+
+void *operator new(size_t size){
+	void *p = arenaAllocate(size ? size : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](size_t size){
+	return operator new(size);
+}
+
+// Older runtimes implement the nothrow forms with malloc rather than through the
+// replaced operator new, so replace them too.
+void *operator new(size_t size, const std::nothrow_t&) noexcept{
+	return arenaAllocate(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t&) noexcept{
+	return arenaAllocate(size ? size : 1);
+}
+
+void operator delete(void *p) noexcept{
+	arenaFree(p);
+}
+
+void operator delete[](void *p) noexcept{
+	arenaFree(p);
+}
+
+void operator delete(void *p, const std::nothrow_t&) noexcept{
+	arenaFree(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t&) noexcept{
+	arenaFree(p);
+}
+
+// The sized forms, so the standard library's defaults never hand an arena block to free.
+void operator delete(void *p, size_t) noexcept{
+	arenaFree(p);
+}
+
+void operator delete[](void *p, size_t) noexcept{
+	arenaFree(p);
+}
+
+void *CacheAligned::operator new(size_t size){
+	void *p = arenaAllocateAligned(size ? size : 1, 64);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void CacheAligned::operator delete(void *p){
+	arenaFree(p);
+}
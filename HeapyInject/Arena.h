@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+
+// Private heap for Heapy's own data, so that it never allocates from the heap it is
+// profiling or contends for that heap's locks, and its overhead can be measured. Memory
+// comes straight from VirtualAlloc, or mmap elsewhere: small blocks from pools of size classes carved out
+// of 64KB regions, anything bigger gets a region to itself. Global operator new and
+// delete use it, so every container in Heapy does without having to be told.
+void *arenaAllocate(size_t size);
+
+// Zeroed memory. Blocks big enough for their own region are fresh from the system and
+// already zero, so their pages aren't touched until they are used.
+void *arenaAllocateZeroed(size_t size);
+
+// Block aligned to alignment, which can be at most a cache line. Returns null for
+// anything bigger.
+void *arenaAllocateAligned(size_t size, size_t alignment);
+
+void arenaFree(void *p);
+
+// Base for classes with members aligned to cache lines, which plain new only has to
+// honour from C++17. Their objects come from the arena at that alignment.
+struct CacheAligned{
+	static void *operator new(size_t size);
+	static void operator delete(void *p);
+};
+
+struct ArenaUsage{
+	// Bytes in blocks handed out, rounded up to their size class.
+	size_t used;
+	// Bytes committed from the system, including blocks free in the pools.
+	size_t committed;
+};
+
+ArenaUsage getArenaUsage();
@@ -0,0 +1,14 @@
+#pragma once
+#include <string>
+
+// Attach mode. A process Heapy attaches to is already running with its own environment,
+// so the options HeapyInject would read from there are handed over in a file mapping,
+// or a shared memory object on Linux, with this name instead, as NAME=value strings
+// ending with an empty one.
+inline std::string getAttachOptionsName(unsigned long processId){
+#ifdef _WIN32
+	return "Local\\Heapy_Options_" + std::to_string(processId);
+#else
+	return "/Heapy_Options_" + std::to_string(processId);
+#endif
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <stddef.h>
+
+// Append only array which never moves its elements. Elements can be read without
+// locking from any thread once they have been published by the writer.
+template <typename T, size_t chunkSize = 4096, size_t maxChunks = 65536>
+class ChunkedArray{
+public:
+	ChunkedArray() : count(0){
+		for(size_t i = 0; i < maxChunks; ++i)
+			chunks[i] = 0;
+	}
+
+	~ChunkedArray(){
+		for(size_t i = 0; i < maxChunks && chunks[i].load(std::memory_order_relaxed); ++i)
+			delete [] chunks[i].load(std::memory_order_relaxed);
+	}
+
+	static size_t capacity(){
+		return chunkSize*maxChunks;
+	}
+
+	// Number of published elements.
+	size_t size() const {
+		return count.load(std::memory_order_acquire);
+	}
+
+	T &operator[](size_t i) const {
+		return chunks[i / chunkSize].load(std::memory_order_acquire)[i % chunkSize];
+	}
+
+	// Make sure elements up to n exist, without publishing them. n must be at most
+	// capacity(), callers hand out indices so they have to stop there.
+	void reserve(size_t n){
+		if(n == 0)
+			return;
+
+		// Chunks are allocated in order, so if the last one exists so do the rest.
+		size_t last = (n - 1) / chunkSize;
+		if(chunks[last].load(std::memory_order_acquire))
+			return;
+
+		std::lock_guard<std::mutex> lk(growMutex);
+		for(size_t c = 0; c <= last; ++c){
+			if(!chunks[c].load(std::memory_order_relaxed))
+				chunks[c].store(new T[chunkSize](), std::memory_order_release);
+		}
+	}
+
+	// Publish elements up to n, they must have been written already.
+	void publish(size_t n){
+		size_t current = count.load(std::memory_order_relaxed);
+		while(current < n && !count.compare_exchange_weak(current, n, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+private:
+	std::atomic<size_t> count;
+	std::mutex growMutex;
+	mutable std::atomic<T*> chunks[maxChunks];
+
+	ChunkedArray(const ChunkedArray&);
+	ChunkedArray& operator=(const ChunkedArray&);
+};
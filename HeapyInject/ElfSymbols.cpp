@@ -0,0 +1,159 @@
+#ifndef _WIN32
+#include "ElfSymbols.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct ModuleEnumeration{
+	ElfModuleCallback callback;
+	void *context;
+	bool first;
+};
+
+static int enumeratePhdrCallback(dl_phdr_info *info, size_t, void *data){
+	ModuleEnumeration *enumeration = (ModuleEnumeration*)data;
+
+	// The program comes first, without a name.
+	const char *path = info->dlpi_name;
+	const char *moduleName = program_invocation_short_name;
+	if(enumeration->first)
+		path = "/proc/self/exe";
+	else if(!path[0])
+		return 0;
+	else
+		moduleName = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	enumeration->first = false;
+
+	return enumeration->callback(moduleName, path, info->dlpi_addr, enumeration->context) ? 0 : 1;
+}
+
+void enumerateElfModules(ElfModuleCallback callback, void *context){
+	ModuleEnumeration enumeration = {callback, context, true};
+	dl_iterate_phdr(enumeratePhdrCallback, &enumeration);
+}
+
+static const ElfW(Shdr) *findSection(const ElfW(Ehdr) *header, const ElfW(Shdr) *sections, ElfW(Word) type){
+	for(size_t i = 0; i < header->e_shnum; ++i){
+		if(sections[i].sh_type == type)
+			return &sections[i];
+	}
+	return 0;
+}
+
+// The object's file mapped for reading, with its symbol and string tables checked.
+struct ElfFile{
+	const char *bytes;
+	size_t size;
+	const ElfW(Ehdr) *header;
+	const ElfW(Sym) *symbols;
+	const ElfW(Sym) *symbolsEnd;
+	const char *names;
+	size_t namesSize;
+};
+
+static bool openElfFile(const char *path, ElfFile &elf){
+	// Objects without a file behind them, like the vdso, are skipped here.
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return false;
+	struct stat fileStat;
+	void *file = MAP_FAILED;
+	if(fstat(fd, &fileStat) == 0 && (size_t)fileStat.st_size >= sizeof(ElfW(Ehdr)))
+		file = mmap(0, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(file == MAP_FAILED)
+		return false;
+
+	elf.bytes = (const char*)file;
+	elf.size = fileStat.st_size;
+	elf.header = (const ElfW(Ehdr)*)elf.bytes;
+	const int nativeClass = __ELF_NATIVE_CLASS == 64 ? ELFCLASS64 : ELFCLASS32;
+	if(memcmp(elf.header->e_ident, ELFMAG, SELFMAG) != 0 || elf.header->e_ident[EI_CLASS] != nativeClass ||
+	   !elf.header->e_shoff || elf.header->e_shoff + elf.header->e_shnum*sizeof(ElfW(Shdr)) > elf.size ||
+	   elf.header->e_phoff + elf.header->e_phnum*sizeof(ElfW(Phdr)) > elf.size){
+		munmap(file, elf.size);
+		return false;
+	}
+
+	// The full table has everything the dynamic one does, as well as local symbols.
+	const ElfW(Shdr) *sections = (const ElfW(Shdr)*)(elf.bytes + elf.header->e_shoff);
+	const ElfW(Shdr) *symbols = findSection(elf.header, sections, SHT_SYMTAB);
+	if(!symbols)
+		symbols = findSection(elf.header, sections, SHT_DYNSYM);
+	const ElfW(Shdr) *strings = symbols && symbols->sh_link < elf.header->e_shnum ? &sections[symbols->sh_link] : 0;
+	if(!strings || symbols->sh_offset + symbols->sh_size > elf.size || strings->sh_offset + strings->sh_size > elf.size){
+		munmap(file, elf.size);
+		return false;
+	}
+	elf.symbols = (const ElfW(Sym)*)(elf.bytes + symbols->sh_offset);
+	elf.symbolsEnd = elf.symbols + symbols->sh_size/sizeof(ElfW(Sym));
+	elf.names = elf.bytes + strings->sh_offset;
+	elf.namesSize = strings->sh_size;
+	return true;
+}
+
+static void closeElfFile(ElfFile &elf){
+	munmap((void*)elf.bytes, elf.size);
+}
+
+// Functions defined in the file, indirect functions are resolvers rather than the
+// function itself.
+static bool isDefinedFunction(const ElfW(Sym) *symbol){
+	return ELF64_ST_TYPE(symbol->st_info) == STT_FUNC && symbol->st_shndx != SHN_UNDEF && symbol->st_value;
+}
+
+void enumerateElfSymbols(const char *path, uintptr_t base, const char *name, ElfSymbolCallback callback, void *context){
+	ElfFile elf;
+	if(!openElfFile(path, elf))
+		return;
+
+	size_t nameSize = strlen(name) + 1;
+	for(const ElfW(Sym) *symbol = elf.symbols; symbol < elf.symbolsEnd; ++symbol){
+		if(!isDefinedFunction(symbol))
+			continue;
+		if(symbol->st_name + nameSize > elf.namesSize || memcmp(elf.names + symbol->st_name, name, nameSize) != 0)
+			continue;
+		if(!callback(name, (void*)(base + symbol->st_value), context))
+			break;
+	}
+	closeElfFile(elf);
+}
+
+bool findElfSymbol(const char *path, uintptr_t mappedAt, uintptr_t address, std::string &name){
+	ElfFile elf;
+	if(!openElfFile(path, elf))
+		return false;
+
+	// Symbol values are relative to the address the file was linked at, whose first
+	// segment's page is the one mapped at mappedAt.
+	const ElfW(Phdr) *segments = (const ElfW(Phdr)*)(elf.bytes + elf.header->e_phoff);
+	uintptr_t pageMask = ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+	uintptr_t base = mappedAt;
+	for(size_t i = 0; i < elf.header->e_phnum; ++i){
+		if(segments[i].p_type == PT_LOAD){
+			base = mappedAt - (segments[i].p_vaddr & pageMask);
+			break;
+		}
+	}
+
+	const ElfW(Sym) *found = 0;
+	for(const ElfW(Sym) *symbol = elf.symbols; symbol < elf.symbolsEnd; ++symbol){
+		if(!isDefinedFunction(symbol) || symbol->st_name >= elf.namesSize)
+			continue;
+		uintptr_t start = base + symbol->st_value;
+		// Symbols without a size are taken to run up to the next one.
+		if(address >= start && (address < start + symbol->st_size || !symbol->st_size) && (!found || symbol->st_value > found->st_value))
+			found = symbol;
+	}
+	if(found)
+		name.assign(elf.names + found->st_name, strnlen(elf.names + found->st_name, elf.namesSize - found->st_name));
+	closeElfFile(elf);
+	return found != 0;
+}
+#endif
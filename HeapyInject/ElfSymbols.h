@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+
+// Linux's stand in for dbghelp's SymEnumerateModules, SymEnumSymbols and SymGetSymFromAddr,
+// for finding the functions to hook in every object loaded into the process and naming
+// the frames of another process. Callbacks return false to stop the enumeration.
+
+// moduleName is the file name of the program or library loaded from path, base is what
+// the symbol values in its file are relative to.
+typedef bool (*ElfModuleCallback)(const char *moduleName, const char *path, uintptr_t base, void *context);
+typedef bool (*ElfSymbolCallback)(const char *name, void *address, void *context);
+
+// Calls callback for the program and then each library currently loaded.
+void enumerateElfModules(ElfModuleCallback callback, void *context);
+
+// Calls callback for each function called name defined in the object loaded from path
+// at base. The file's full symbol table is used when it hasn't been stripped, so
+// functions which aren't exported, like a statically linked malloc, are found too.
+void enumerateElfSymbols(const char *path, uintptr_t base, const char *name, ElfSymbolCallback callback, void *context);
+
+// Name of the function containing address, in the object loaded from path whose first
+// segment is mapped at mappedAt, from the same symbol tables. False if there is none.
+bool findElfSymbol(const char *path, uintptr_t mappedAt, uintptr_t address, std::string &name);
@@ -0,0 +1,317 @@
+#include "EventStream.h"
+#include "HeapProfiler.h"
+
+#include <string.h>
+#include <new>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// How long a writer waits on a full ring without the reader showing signs of life.
+static const unsigned readerTimeoutMs = 5000;
+
+#ifdef _WIN32
+static void *createSharedMemory(const char *name, size_t size){
+	HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		(DWORD)((uint64_t)size >> 32), (DWORD)size, name);
+	if(!mapping)
+		return 0;
+	return MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+}
+
+static void *openSharedMemory(const char *name){
+	HANDLE mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+	if(!mapping)
+		return 0;
+	return MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+}
+#else
+static void *createSharedMemory(const char *name, size_t size){
+	int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+	if(fd < 0)
+		return 0;
+	void *memory = ftruncate(fd, size) == 0 ? mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	return memory == MAP_FAILED ? 0 : memory;
+}
+
+static void *openSharedMemory(const char *name){
+	int fd = shm_open(name, O_RDWR, 0600);
+	if(fd < 0)
+		return 0;
+	struct stat st;
+	void *memory = fstat(fd, &st) == 0 ? mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	return memory == MAP_FAILED ? 0 : memory;
+}
+#endif
+
+void EventStream::remove(const char *name){
+#ifndef _WIN32
+	shm_unlink(name);
+#endif
+}
+
+EventStream::EventStream(void *memory) : disconnected(false){
+	header = (Header*)memory;
+	slots = (Slot*)(header + 1);
+	mask = header->capacity - 1;
+}
+
+EventStream *EventStream::create(const char *name, size_t capacity){
+	// Capacity must be a power of two.
+	size_t rounded = 1;
+	while(rounded < capacity)
+		rounded *= 2;
+
+	void *memory = createSharedMemory(name, sizeof(Header) + rounded*sizeof(Slot));
+	if(!memory)
+		return 0;
+
+	Header *header = new (memory) Header();
+	header->capacity = rounded;
+	header->head = 0;
+	header->tail = 0;
+	header->readerHeartbeat = 0;
+	header->exitAcknowledged = 0;
+	header->readCount = 0;
+	header->waitingWriters = 0;
+
+	// Each slot holds the position it is next free to be written at.
+	Slot *slots = (Slot*)(header + 1);
+	for(size_t i = 0; i < rounded; ++i)
+		slots[i].sequence.store(i, std::memory_order_relaxed);
+
+	return new EventStream(memory);
+}
+
+EventStream *EventStream::open(const char *name){
+	void *memory = openSharedMemory(name);
+	return memory ? new EventStream(memory) : 0;
+}
+
+// Sleep until the reader has freed up more slots since readCount, or for a while.
+void EventStream::waitForReader(uint32_t readCount){
+#ifdef _WIN32
+	// WaitOnAddress only works within a process, the launcher couldn't wake us.
+	(void)readCount;
+	Sleep(1);
+#else
+	// Not FUTEX_PRIVATE_FLAG, the reader is in another process.
+	timespec timeout = {0, 10*1000000};
+	syscall(SYS_futex, &header->readCount, FUTEX_WAIT, readCount, &timeout, 0, 0);
+#endif
+}
+
+bool EventStream::write(const StreamRecord &record){
+	if(disconnected.load(std::memory_order_relaxed))
+		return false;
+
+	// A slot is only claimed once it is free, so a writer which gives up on the reader
+	// never leaves one behind that the reader would stall on.
+	uint64_t heartbeat = header->readerHeartbeat.load(std::memory_order_relaxed);
+	auto lastAlive = std::chrono::steady_clock::now();
+	uint64_t pos = header->head.load(std::memory_order_relaxed);
+	for(unsigned spins = 0;; ++spins){
+		Slot &slot = slots[pos & mask];
+		int64_t lag = (int64_t)(slot.sequence.load(std::memory_order_acquire) - pos);
+		if(lag == 0){
+			if(header->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+				slot.record = record;
+				slot.sequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+			continue;
+		}
+		if(lag > 0){
+			// Another writer claimed it first.
+			pos = header->head.load(std::memory_order_relaxed);
+			continue;
+		}
+
+		// Full, the slot still holds a record from the last time round the ring.
+		if(spins < 64){
+			std::this_thread::yield();
+			continue;
+		}
+		header->waitingWriters.fetch_add(1);
+		uint32_t readCount = header->readCount.load();
+		if(slot.sequence.load(std::memory_order_acquire) == pos){
+			header->waitingWriters.fetch_sub(1, std::memory_order_relaxed);
+			continue;
+		}
+		waitForReader(readCount);
+		header->waitingWriters.fetch_sub(1, std::memory_order_relaxed);
+
+		uint64_t currentHeartbeat = header->readerHeartbeat.load(std::memory_order_relaxed);
+		auto now = std::chrono::steady_clock::now();
+		if(currentHeartbeat != heartbeat){
+			heartbeat = currentHeartbeat;
+			lastAlive = now;
+		}else if(now - lastAlive > std::chrono::milliseconds(readerTimeoutMs)){
+			// Nobody is reading any more, stop streaming rather than hang the process.
+			disconnected = true;
+			return false;
+		}
+		pos = header->head.load(std::memory_order_relaxed);
+	}
+}
+
+bool EventStream::read(StreamRecord &record){
+	uint64_t pos = header->tail.load(std::memory_order_relaxed);
+	Slot &slot = slots[pos & mask];
+	if(slot.sequence.load(std::memory_order_acquire) != pos + 1)
+		return false;
+
+	record = slot.record;
+	slot.sequence.store(pos + header->capacity, std::memory_order_release);
+	header->tail.store(pos + 1, std::memory_order_relaxed);
+	return true;
+}
+
+void EventStream::wakeWriters(){
+	// Writers count themselves as waiting before they read readCount, so either they
+	// see it change or we see them.
+	header->readCount.fetch_add(1);
+	if(header->waitingWriters.load()){
+#ifndef _WIN32
+		syscall(SYS_futex, &header->readCount, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+#endif
+	}
+}
+
+void EventStream::heartbeat(){
+	header->readerHeartbeat.fetch_add(1, std::memory_order_relaxed);
+}
+
+void EventStream::acknowledgeExit(){
+	header->exitAcknowledged.store(1, std::memory_order_release);
+}
+
+bool EventStream::waitForExitAcknowledged(unsigned timeoutMs){
+	auto start = std::chrono::steady_clock::now();
+	while(!header->exitAcknowledged.load(std::memory_order_acquire)){
+		if(disconnected || std::chrono::steady_clock::now() - start > std::chrono::milliseconds(timeoutMs))
+			return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+EventStreamWriter::EventStreamWriter(EventStream *stream) : stream(stream){
+}
+
+StackId EventStreamWriter::sendStack(const StackTrace &trace){
+	StackId id = stackTable.intern(trace);
+	stackState.reserve(id + 1);
+	std::atomic<uint8_t> &state = stackState[id];
+	if(state.load(std::memory_order_acquire) == 2)
+		return id;
+
+	uint8_t notSent = 0;
+	if(state.compare_exchange_strong(notSent, 1)){
+		StreamRecord record = {};
+		record.type = StreamRecord::Frames;
+		record.stack = id;
+		record.depth = (uint32_t)trace.depth;
+		size_t offset = 0;
+		do{
+			record.size = offset;
+			record.count = (uint32_t)(std::min)(trace.depth - offset, StreamRecord::framesPerRecord);
+			for(size_t i = 0; i < record.count; ++i)
+				record.frames[i] = (uint64_t)(size_t)trace.backtrace[offset + i];
+			stream->write(record);
+			offset += record.count;
+		}while(offset < trace.depth);
+		state.store(2, std::memory_order_release);
+	}else{
+		// Another thread is sending this stack, our records have to come after it.
+		while(state.load(std::memory_order_acquire) != 2)
+			std::this_thread::yield();
+	}
+	return id;
+}
+
+void EventStreamWriter::malloc(void *ptr, size_t size, const StackTrace &trace){
+	StreamRecord record = {};
+	record.type = StreamRecord::Malloc;
+	record.stack = sendStack(trace);
+	record.ptr = (uint64_t)(size_t)ptr;
+	record.size = size;
+	stream->write(record);
+}
+
+void EventStreamWriter::free(void *ptr){
+	StreamRecord record = {};
+	record.type = StreamRecord::Free;
+	record.ptr = (uint64_t)(size_t)ptr;
+	stream->write(record);
+}
+
+void EventStreamWriter::finish(unsigned timeoutMs){
+	StreamRecord record = {};
+	record.type = StreamRecord::Exit;
+	if(stream->write(record))
+		stream->waitForExitAcknowledged(timeoutMs);
+}
+
+EventStreamReader::EventStreamReader(EventStream *stream, HeapProfiler *profiler)
+	: stream(stream), profiler(profiler), exiting(false){
+}
+
+size_t EventStreamReader::drain(){
+	stream->heartbeat();
+
+	// Records come out in the order their slots were claimed. A free claims its slot
+	// before the memory is released and a malloc before the pointer is returned, so
+	// this is the real order for any one address.
+	size_t count = 0;
+	StreamRecord record;
+	StackTrace dummyTrace;
+	while(stream->read(record)){
+		++count;
+		switch(record.type){
+		case StreamRecord::Malloc:
+			if(record.stack < stacks.size())
+				profiler->malloc((void*)(size_t)record.ptr, (size_t)record.size, stacks[record.stack]);
+			break;
+		case StreamRecord::Free:
+			profiler->free((void*)(size_t)record.ptr, dummyTrace);
+			break;
+		case StreamRecord::Frames:{
+			if(record.stack >= stacks.size())
+				stacks.resize(record.stack + 1);
+			StackTrace &trace = stacks[record.stack];
+			trace.depth = (std::min)((size_t)record.depth, (size_t)backtraceSize);
+			for(size_t i = 0; i < record.count && record.size + i < trace.depth; ++i)
+				trace.backtrace[record.size + i] = (void*)(size_t)record.frames[i];
+			if(record.size + record.count >= trace.depth)
+				trace.computeHash();
+			break;
+		}
+		case StreamRecord::Exit:
+			exiting = true;
+			break;
+		}
+	}
+	if(count)
+		stream->wakeWriters();
+	return count;
+}
+
+bool EventStreamReader::exitRequested() const {
+	return exiting;
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+#include "StackTable.h"
+
+class HeapProfiler;
+
+// Fixed size record streamed from the profiled process to the Heapy launcher.
+struct StreamRecord{
+	enum Type{
+		Malloc = 1,
+		Free,
+		// Part of a stack trace: frames offset to offset + framesPerRecord of stack.
+		Frames,
+		// The profiled process is exiting and waits for the reader to acknowledge.
+		Exit
+	};
+	static const size_t framesPerRecord = 4;
+
+	uint32_t type;
+	StackId stack;
+	uint64_t ptr;
+	// Allocation size, or for Frames records the offset of the first frame.
+	uint64_t size;
+	// Frames records only. depth is the total number of frames in the stack.
+	uint32_t depth;
+	uint32_t count;
+	uint64_t frames[framesPerRecord];
+};
+
+// Multiple producer, single consumer ring of records in shared memory. The launcher
+// creates it before starting the target, which opens it by name.
+class EventStream{
+public:
+	static EventStream *create(const char *name, size_t capacity);
+	static EventStream *open(const char *name);
+	// Shared memory on Linux outlives its users until removed, once both sides have it open.
+	static void remove(const char *name);
+
+	// Producer side, safe to call from any thread. Blocks while the ring is full.
+	// Returns false if the reader has gone away.
+	bool write(const StreamRecord &record);
+
+	// Consumer side. Returns false if there is nothing to read right now.
+	bool read(StreamRecord &record);
+	// Let writers waiting for room know about the records read since the last call.
+	void wakeWriters();
+
+	// The reader calls this regularly so writers know it is still alive.
+	void heartbeat();
+
+	void acknowledgeExit();
+	bool waitForExitAcknowledged(unsigned timeoutMs);
+
+private:
+	struct Slot{
+		std::atomic<uint64_t> sequence;
+		StreamRecord record;
+	};
+	struct Header{
+		uint64_t capacity;
+		char pad0[56];
+		std::atomic<uint64_t> head;
+		char pad1[56];
+		std::atomic<uint64_t> tail;
+		std::atomic<uint64_t> readerHeartbeat;
+		std::atomic<uint32_t> exitAcknowledged;
+		// Bumped by the reader after freeing slots, writers waiting for room sleep on it.
+		std::atomic<uint32_t> readCount;
+		std::atomic<uint32_t> waitingWriters;
+	};
+
+	EventStream(void *memory);
+	void waitForReader(uint32_t readCount);
+
+	Header *header;
+	Slot *slots;
+	uint64_t mask;
+	std::atomic<bool> disconnected;
+};
+
+// Sends allocations into an EventStream from the profiled process. Stacks are interned
+// locally and their frames are sent once, before the first record which refers to them.
+class EventStreamWriter : public CacheAligned{
+public:
+	EventStreamWriter(EventStream *stream);
+
+	void malloc(void *ptr, size_t size, const StackTrace &trace);
+	void free(void *ptr);
+
+	// Tell the reader we are exiting and give it a chance to finish up with us.
+	void finish(unsigned timeoutMs);
+
+private:
+	StackId sendStack(const StackTrace &trace);
+
+	EventStream *stream;
+	StackTable stackTable;
+	// 0 not sent yet, 1 being sent, 2 sent.
+	ChunkedArray<std::atomic<uint8_t>> stackState;
+};
+
+// Applies records from an EventStream to a HeapProfiler in the launcher.
+class EventStreamReader{
+public:
+	EventStreamReader(EventStream *stream, HeapProfiler *profiler);
+
+	// Apply everything currently in the stream, returns the number of records read.
+	size_t drain();
+
+	// Whether the target has sent its Exit record.
+	bool exitRequested() const;
+
+private:
+	EventStream *stream;
+	HeapProfiler *profiler;
+	// Stacks as sent by the target, indexed by its stack ids.
+	std::vector<StackTrace> stacks;
+	bool exiting;
+};
@@ -0,0 +1,152 @@
+#include "GzipWriter.h"
+
+#include <algorithm>
+
+static const uint64_t noPosition = ~0ULL;
+
+static const uint16_t lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                          257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                          8193, 12289, 16385, 24577};
+static const uint8_t distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                          7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static uint32_t crcTable[256];
+
+static void initCrcTable(){
+	if(crcTable[1])
+		return;
+	for(uint32_t i = 0; i < 256; ++i){
+		uint32_t c = i;
+		for(int k = 0; k < 8; ++k)
+			c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crcTable[i] = c;
+	}
+}
+
+GzipWriter::GzipWriter(std::ostream &stream)
+	: stream(stream), crc(0xFFFFFFFF), inputSize(0), position(0), bufferStart(0),
+	  lastPosition((size_t)1 << hashBits, noPosition), bits(0), bitCount(0){
+	initCrcTable();
+
+	// Magic, deflate, no flags, no time, unknown OS.
+	const uint8_t header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255};
+	stream.write((const char*)header, sizeof(header));
+
+	// One block with the fixed codes holds everything, an empty final block ends it.
+	putBits(0, 1);
+	putBits(1, 2);
+}
+
+void GzipWriter::write(const void *data, size_t size){
+	const uint8_t *bytes = (const uint8_t*)data;
+	for(size_t i = 0; i < size; ++i)
+		crc = crcTable[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+	inputSize += (uint32_t)size;
+
+	buffer.insert(buffer.end(), bytes, bytes + size);
+	if(buffer.size() < 4*windowSize)
+		return;
+
+	// Leave enough input after the last position for a full length match.
+	compress(buffer.size() - maxMatch);
+
+	// Keep a window of history for the next matches to refer back into.
+	size_t discard = position - windowSize;
+	buffer.erase(buffer.begin(), buffer.begin() + discard);
+	position -= discard;
+	bufferStart += discard;
+}
+
+void GzipWriter::finish(){
+	compress(buffer.size());
+
+	// End the block, then an empty final block.
+	putLiteral(256);
+	putBits(1, 1);
+	putBits(1, 2);
+	putLiteral(256);
+	if(bitCount > 0)
+		putBits(0, 8 - bitCount);
+
+	uint32_t trailer[2] = {crc ^ 0xFFFFFFFF, inputSize};
+	for(int i = 0; i < 2; ++i){
+		for(int b = 0; b < 4; ++b)
+			stream.put((char)(trailer[i] >> (b*8)));
+	}
+	stream.flush();
+}
+
+void GzipWriter::compress(size_t limit){
+	while(position < limit){
+		if(position + 3 <= buffer.size()){
+			const uint8_t *p = &buffer[position];
+			uint32_t hash = ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761U) >> (32 - hashBits);
+			uint64_t candidate = lastPosition[hash];
+			uint64_t current = bufferStart + position;
+			lastPosition[hash] = current;
+
+			if(candidate != noPosition && candidate >= bufferStart && current - candidate <= windowSize){
+				const uint8_t *match = &buffer[(size_t)(candidate - bufferStart)];
+				size_t maxLength = (std::min)((size_t)maxMatch, buffer.size() - position);
+				size_t length = 0;
+				while(length < maxLength && match[length] == p[length])
+					++length;
+
+				if(length >= 3){
+					putMatch(length, (size_t)(current - candidate));
+					position += length;
+					continue;
+				}
+			}
+		}
+		putLiteral(buffer[position]);
+		++position;
+	}
+}
+
+void GzipWriter::putBits(uint32_t value, unsigned count){
+	bits |= (uint64_t)value << bitCount;
+	bitCount += count;
+	while(bitCount >= 8){
+		stream.put((char)(bits & 0xFF));
+		bits >>= 8;
+		bitCount -= 8;
+	}
+}
+
+void GzipWriter::putCode(uint32_t code, unsigned length){
+	// Huffman codes go most significant bit first.
+	uint32_t reversed = 0;
+	for(unsigned i = 0; i < length; ++i)
+		reversed |= ((code >> i) & 1) << (length - 1 - i);
+	putBits(reversed, length);
+}
+
+void GzipWriter::putLiteral(unsigned symbol){
+	if(symbol < 144)
+		putCode(0x30 + symbol, 8);
+	else if(symbol < 256)
+		putCode(0x190 + symbol - 144, 9);
+	else if(symbol < 280)
+		putCode(symbol - 256, 7);
+	else
+		putCode(0xC0 + symbol - 280, 8);
+}
+
+void GzipWriter::putMatch(size_t length, size_t distance){
+	int l = 28;
+	while(lengthBase[l] > length)
+		--l;
+	putLiteral(257 + l);
+	putBits((uint32_t)(length - lengthBase[l]), lengthExtra[l]);
+
+	int d = 29;
+	while(distanceBase[d] > distance)
+		--d;
+	putCode(d, 5);
+	putBits((uint32_t)(distance - distanceBase[d]), distanceExtra[d]);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <ostream>
+#include <vector>
+#include <stdint.h>
+
+// Streaming gzip compressor, so profiles can be written compressed without pulling
+// in zlib. Output is a single deflate stream using the fixed huffman codes and a
+// simple greedy LZ77 match finder: not as small as zlib would make it, but the long
+// runs of repeated ids and strings in a profile still compress well.
+class GzipWriter{
+public:
+	GzipWriter(std::ostream &stream);
+
+	void write(const void *data, size_t size);
+
+	// Flush everything and write the gzip trailer. Nothing can be written after.
+	void finish();
+
+private:
+	static const size_t windowSize = 32768;
+	static const size_t maxMatch = 258;
+	static const size_t hashBits = 15;
+
+	// Compress buffered input up to limit.
+	void compress(size_t limit);
+	void putBits(uint32_t value, unsigned count);
+	void putCode(uint32_t code, unsigned length);
+	void putLiteral(unsigned symbol);
+	void putMatch(size_t length, size_t distance);
+
+	std::ostream &stream;
+	uint32_t crc;
+	uint32_t inputSize;
+
+	// Input not yet compressed, preceded by up to windowSize bytes of history.
+	std::vector<uint8_t> buffer;
+	// Offset into buffer of the next byte to compress, and of buffer[0] in the input.
+	size_t position;
+	uint64_t bufferStart;
+	// Input offset of the last position with each hash of three bytes, or ~0.
+	std::vector<uint64_t> lastPosition;
+
+	uint64_t bits;
+	unsigned bitCount;
+};
@@ -1,105 +1,653 @@
 #include "HeapProfiler.h"
 
+#include <string.h>
+
+#ifdef _WIN32
 #include <Windows.h>
-#include <stdio.h>
-#include "dbghelp.h"
+#include <intrin.h>
+#else
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#endif
 
 #include <algorithm>
-#include <iomanip>
 
-StackTrace::StackTrace() : hash(0){
-	memset(backtrace, 0, sizeof(void*)*backtraceSize);
+size_t HeapProfiler::shardIndex(void *ptr){
+	// Allocations are aligned so the low bits carry no information, scramble
+	// the address with a fibonacci multiply and use the top bits.
+	const size_t MULT = sizeof(size_t) > 4 ? 11400714819323198485ULL : 2654435769U;
+	size_t h = ((size_t)ptr >> 4) * MULT;
+	return (h >> (sizeof(size_t)*8 - 16)) % numShards;
 }
 
-void StackTrace::trace(){
-	int framesCnt = CaptureStackBackTrace(0, backtraceSize, backtrace, 0);
-	// Compute simple polynomial hash of the stack trace.
-	// Note: CaptureStackBackTrace returns plain sum of all pointers as BackTraceHash.
-	const size_t BASE = sizeof(size_t) > 4 ? 11400714819323198485ULL : 2654435769U;
-	hash = 0;
-	for (int i = 0; i < framesCnt; i++)
-		hash = hash * BASE + (size_t)backtrace[i];
+// Buffered mode orders events from different threads by when they happened, read from
+// the time stamp counter. On the processors Heapy runs on it ticks at a constant rate
+// and is kept in step across cores, the OS clocks rely on that too. Reading it costs a
+// few cycles and, unlike a shared counter, no cache line bouncing between threads.
+static inline uint64_t readEventClock(){
+	return __rdtsc();
 }
 
-void StackTrace::print(std::ostream &stream) const {
-	HANDLE process = GetCurrentProcess();
+// Has every other thread of the process run a full memory barrier, so a drain sees any
+// store a pushing thread made before it read the clock without the push paying for a
+// fence of its own. False if the system can't, when the pushes fence instead.
+#ifdef _WIN32
+static bool registerRemoteFences(){
+	return true;
+}
 
-	const int MAXSYMBOLNAME = 128 - sizeof(IMAGEHLP_SYMBOL);
-	char symbol64_buf[sizeof(IMAGEHLP_SYMBOL) + MAXSYMBOLNAME] = {0};
-	IMAGEHLP_SYMBOL *symbol = reinterpret_cast<IMAGEHLP_SYMBOL*>(symbol64_buf);
-	symbol->SizeOfStruct = sizeof(IMAGEHLP_SYMBOL);
-	symbol->MaxNameLength = MAXSYMBOLNAME - 1;
+static void remoteFence(){
+	FlushProcessWriteBuffers();
+}
+#else
+static bool registerRemoteFences(){
+	return syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+}
 
-	// Print out stack trace. Skip the first frame (that's our hook function.)
-	for(size_t i = 1; i < backtraceSize; ++i){ 
-		if(backtrace[i]){
-			// Output stack frame symbols if available.
-			if(SymGetSymFromAddr(process, (DWORD64)backtrace[i], 0, symbol)){
+static void remoteFence(){
+	syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+}
+#endif
 
-				stream << "    " << symbol->Name;
+EventChunk::EventChunk() : head(0), tail(0), buffer(0){
+}
 
-				// Output filename + line info if available.
-				IMAGEHLP_LINE lineSymbol = {0};
-				lineSymbol.SizeOfStruct = sizeof(IMAGEHLP_LINE);
-				DWORD displacement;
-				if(SymGetLineFromAddr(process, (DWORD64)backtrace[i], &displacement, &lineSymbol)){
-					stream << "    " << lineSymbol.FileName << ":" << lineSymbol.LineNumber;
-				}
-				
+EventBuffer::EventBuffer() : pushingFrom(notPushing), lastTime(0), chunk(new EventChunk()), owned(true){
+	chunk.load()->buffer = this;
+	for(size_t i = 0; i < stackCacheSize; ++i){
+		knownStacks[i].hash = 0;
+		knownStacks[i].id = invalidStackId;
+	}
+}
 
-				stream << "    (" << std::setw(sizeof(void*)*2) << std::setfill('0') << backtrace[i] <<  ")\n";
-			}else{
-				stream << "    <no symbol> " << "    (" << std::setw(sizeof(void*)*2) << std::setfill('0') << backtrace[i] <<  ")\n";
-			}
-		}else{
-			break;
-		}
+HeapProfiler::HeapProfiler() : collectPass(0), remoteFences(registerRemoteFences()), preexistingCount(0), preexistingSize(0){
+	for(size_t i = 0; i < numShards; ++i)
+		untrackedFrees[i].count = 0;
+	for(size_t i = 0; i < numSiteDeltas; ++i){
+		siteDeltas[i].stack = invalidStackId;
+		siteDeltas[i].totalSize = siteDeltas[i].liveCount = siteDeltas[i].allocatedSize = siteDeltas[i].allocatedCount = 0;
 	}
 }
 
+HeapProfiler::~HeapProfiler(){
+	for(EventBuffer *buffer : eventBuffers){
+		delete buffer->chunk.load();
+		delete buffer;
+	}
+	for(EventChunk *chunk : fullChunks)
+		delete chunk;
+	for(EventChunk *chunk : spareChunks)
+		delete chunk;
+}
+
+// The stack each thread interned last, and into which profiler's table.
+struct LastInterned{
+	const HeapProfiler *profiler;
+	StackId id;
+};
+static __declspec( thread ) LastInterned lastInterned = {0, invalidStackId};
+
+StackId HeapProfiler::internStack(const StackTrace &trace){
+	// A thread allocating in a loop keeps capturing the stack it interned last, and can
+	// skip the table's lock for it. The frames still have to be checked, the stack may
+	// have been collected since, or the last trace not interned at all.
+	if(trace.repeated && lastInterned.profiler == this && lastInterned.id < stackTable.size() &&
+	   stackTable.matches(lastInterned.id, trace))
+		return lastInterned.id;
+
+	StackId id = stackTable.intern(trace);
+	lastInterned.profiler = this;
+	lastInterned.id = id;
+
+	// Make room for the site before anyone can report on it.
+	sites.reserve(id + 1);
+	sites.publish(id + 1);
+	return id;
+}
+
+bool HeapProfiler::needsFullStack(const StackTrace &shallowTrace, size_t threshold){
+	// Sites which have never allocated anything yet aren't interned.
+	StackId id = stackTable.find(shallowTrace);
+	if(id == invalidStackId || id >= sites.size())
+		return false;
+
+	// Once the total allocated crosses the threshold it stays there.
+	return sites[id].allocatedSize.load(std::memory_order_relaxed) >= threshold;
+}
+
 void HeapProfiler::malloc(void *ptr, size_t size, const StackTrace &trace){
-	std::lock_guard<std::mutex> lk(mutex);
+	// Locate or create this stacktrace in the allocations map and store
+	// this allocation against it.
+	trackedPages.add(ptr);
+	addPointer(ptr, size, internStack(trace));
+}
+
+void HeapProfiler::free(void *ptr, const StackTrace &trace){
+	if(!trackedPages.mayContain(ptr)){
+		countUntrackedFree(ptr);
+		return;
+	}
+	removePointer(ptr);
+}
 
-	if (ptrs.find(ptr) != ptrs.end())
+size_t HeapProfiler::getUntrackedFrees() const {
+	size_t total = 0;
+	for(size_t i = 0; i < numShards; ++i)
+		total += untrackedFrees[i].count.load(std::memory_order_relaxed);
+	return total;
+}
+
+void HeapProfiler::setPreexistingAllocations(size_t count, size_t size){
+	preexistingCount = count;
+	preexistingSize = size;
+}
+
+size_t HeapProfiler::getPreexistingCount() const {
+	return preexistingCount;
+}
+
+size_t HeapProfiler::getPreexistingSize() const {
+	return preexistingSize;
+}
+
+void HeapProfiler::countUntrackedFree(void *ptr){
+	if(ptr)
+		untrackedFrees[shardIndex(ptr)].count.fetch_add(1, std::memory_order_relaxed);
+}
+
+// The pointer table can't hold sizes past maxSize, count what it can hold so the site
+// totals still balance when the pointer is freed.
+static size_t trackableSize(size_t size){
+	return size > PointerTable::maxSize ? (size_t)PointerTable::maxSize : size;
+}
+
+void HeapProfiler::addPointer(void *ptr, size_t size, StackId stack){
+	size = trackableSize(size);
+
+	PointerShard &shard = pointerShards[shardIndex(ptr)];
+	std::lock_guard<std::mutex> lk(shard.mutex);
+	if(!shard.ptrs.insert(ptr, stack, size))
 		return;   //two buffers at same address!
 
-	// Locate or create this stacktrace in the allocations map.
-	if(stackTraces.find(trace.hash) == stackTraces.end()){
-		auto &stack = stackTraces[trace.hash];
-		stack.trace = trace;
-		stack.totalSize = 0;
+	// Add the size of this allocation to its site, the pointer table remembers the site.
+	SiteInfo &site = sites[stack];
+	site.totalSize += size;
+	site.liveCount++;
+	site.allocatedSize += size;
+	site.allocatedCount++;
+}
+
+void HeapProfiler::removePointer(void *ptr){
+	PointerShard &shard = pointerShards[shardIndex(ptr)];
+	std::lock_guard<std::mutex> lk(shard.mutex);
+
+	// On a free we remove the pointer from the pointer table and its
+	// size from the allocating site.
+	StackId stack;
+	size_t size;
+	if(shard.ptrs.remove(ptr, stack, size)){
+		SiteInfo &site = sites[stack];
+		site.totalSize -= size;
+		site.liveCount--;
+	}else{
+		countUntrackedFree(ptr);
 	}
+}
 
-	// Store the size for this allocation this stacktraces allocation map.
-	stackTraces[trace.hash].totalSize += size;
+StackId HeapProfiler::addSiteAllocation(size_t size, const StackTrace &trace){
+	StackId stack = internStack(trace);
+	SiteInfo &site = sites[stack];
+	site.totalSize += size;
+	site.liveCount++;
+	site.allocatedSize += size;
+	site.allocatedCount++;
+	return stack;
+}
 
-	// Store the stracktrace hash of this allocation in the pointers map.
-	auto &ptrInfo = ptrs[ptr];
-	ptrInfo.size = size;
-	ptrInfo.stack = trace.hash;
+void HeapProfiler::removeSiteAllocation(StackId stack, size_t size){
+	SiteInfo &site = sites[stack];
+	site.totalSize -= size;
+	site.liveCount--;
 }
 
-void HeapProfiler::free(void *ptr, const StackTrace &trace){
-	std::lock_guard<std::mutex> lk(mutex);
-
-	// On a free we remove the pointer from the ptrs map and the
-	// allocating stack traces map.
-	auto it = ptrs.find(ptr);
-	if(it != ptrs.end()){
-		const PointerInfo &info = it->second;
-		stackTraces[info.stack].totalSize -= info.size;
-		ptrs.erase(it);
+void HeapProfiler::getAllocationSiteReport(std::vector<std::pair<StackId, size_t>> &allocs){
+	allocs.clear();
+
+	// Sites are never removed so this doesn't need any locks.
+	size_t numSites = sites.size();
+	allocs.reserve(numSites);
+	for(size_t i = 0; i < numSites; ++i)
+		allocs.push_back(std::make_pair((StackId)i, sites[i].totalSize.load()));
+}
+
+size_t HeapProfiler::getTopAllocationSites(size_t count, std::vector<std::pair<StackId, size_t>> &top) const {
+	top.clear();
+	top.reserve(count);
+
+	// Keep the biggest sites seen so far in a min heap, so the one to evict is at the front.
+	auto biggerSite = [](const std::pair<StackId, size_t> &a, const std::pair<StackId, size_t> &b){
+		return a.second > b.second;
+	};
+
+	// Sites are never removed so this doesn't need any locks.
+	size_t totalSize = 0;
+	size_t numSites = sites.size();
+	for(size_t i = 0; i < numSites; ++i){
+		size_t size = sites[i].totalSize.load(std::memory_order_relaxed);
+		totalSize += size;
+		if(size == 0 || count == 0)
+			continue;
+
+		if(top.size() < count){
+			top.push_back(std::make_pair((StackId)i, size));
+			std::push_heap(top.begin(), top.end(), biggerSite);
+		}else if(size > top.front().second){
+			std::pop_heap(top.begin(), top.end(), biggerSite);
+			top.back() = std::make_pair((StackId)i, size);
+			std::push_heap(top.begin(), top.end(), biggerSite);
+		}
+	}
+
+	// Sorting the heap by biggerSite leaves the biggest first.
+	std::sort_heap(top.begin(), top.end(), biggerSite);
+	std::reverse(top.begin(), top.end());
+	return totalSize;
+}
+
+size_t HeapProfiler::collectDeadSites(uint32_t idlePasses){
+	// Make sure the counts are up to date with anything still sitting in thread buffers.
+	drainEventBuffers();
+
+	std::lock_guard<std::mutex> lk(collectMutex);
+	++collectPass;
+
+	// A thread which found a site just before it was unlinked can still allocate from it,
+	// so it's only released a pass later if it's still unused. Threads don't hold on to
+	// an id for anywhere near that long.
+	size_t numCollected = 0;
+	size_t numSites = sites.size();
+	for(size_t i = 0; i < numSites && i != StackTable::overflowId; ++i){
+		SiteInfo &site = sites[i];
+		if(site.state == siteReleased){
+			if(stackTable.isReleased((StackId)i))
+				continue;
+			// Reused by a new stack.
+			site.state = siteIndexed;
+			site.seenCount = 0;
+			site.lastActive = collectPass;
+		}
+
+		size_t allocatedCount = site.allocatedCount.load();
+		bool live = site.liveCount.load() != 0;
+		if(site.state == siteUnlinked){
+			if(allocatedCount == 0 && !live){
+				stackTable.release((StackId)i);
+				site.state = siteReleased;
+				continue;
+			}
+			site.state = siteOrphaned;
+		}
+
+		if(allocatedCount != site.seenCount){
+			site.seenCount = allocatedCount;
+			site.lastActive = collectPass;
+			continue;
+		}
+		if(live || collectPass - site.lastActive < idlePasses)
+			continue;
+
+		// Dead. Keep its totals against the function which allocated, the first frame
+		// outside the profiler.
+		void *caller = stackTable.depth((StackId)i) ? stackTable.frames((StackId)i)[0] : 0;
+		CollectedSite &collected = collectedSites[caller];
+		collected.caller = caller;
+		collected.allocatedSize += site.allocatedSize.exchange(0);
+		collected.allocatedCount += site.allocatedCount.exchange(0);
+		site.seenCount = 0;
+
+		if(site.state == siteIndexed)
+			stackTable.unlink((StackId)i);
+		site.state = siteUnlinked;
+		++numCollected;
+	}
+	return numCollected;
+}
+
+void HeapProfiler::getCollectedSites(std::vector<CollectedSite> &collected) const {
+	std::lock_guard<std::mutex> lk(collectMutex);
+	collected.clear();
+	collected.reserve(collectedSites.size());
+	for(auto it = collectedSites.begin(); it != collectedSites.end(); ++it)
+		collected.push_back(it->second);
+}
+
+size_t HeapProfiler::getNumSites() const {
+	return sites.size();
+}
+
+SiteStats HeapProfiler::getSiteStats(StackId stack) const {
+	const SiteInfo &site = sites[stack];
+	SiteStats stats;
+	stats.stack = stack;
+	stats.liveSize = site.totalSize.load(std::memory_order_relaxed);
+	stats.liveCount = site.liveCount.load(std::memory_order_relaxed);
+	stats.allocatedSize = site.allocatedSize.load(std::memory_order_relaxed);
+	stats.allocatedCount = site.allocatedCount.load(std::memory_order_relaxed);
+	return stats;
+}
+
+const StackTable &HeapProfiler::getStackTable() const {
+	return stackTable;
+}
+
+EventBuffer *HeapProfiler::acquireEventBuffer(){
+	std::lock_guard<std::mutex> lk(eventBuffersMutex);
+
+	// Reuse a buffer left behind by an exited thread. Any events still in it are
+	// drained as normal, the new owner just carries on appending.
+	for(size_t i = 0; i < eventBuffers.size(); ++i){
+		if(!eventBuffers[i]->owned){
+			eventBuffers[i]->owned = true;
+			return eventBuffers[i];
+		}
+	}
+
+	eventBuffers.push_back(new EventBuffer());
+	return eventBuffers.back();
+}
+
+void HeapProfiler::releaseEventBuffer(EventBuffer *buffer){
+	std::lock_guard<std::mutex> lk(eventBuffersMutex);
+	buffer->owned = false;
+}
+
+void HeapProfiler::bufferMalloc(EventBuffer *buffer, void *ptr, size_t size, const StackTrace &trace){
+	// Threads remember stacks they have already interned so the hot path can skip the lock.
+	// A matching hash isn't enough, the frames have to match too.
+	EventBuffer::KnownStack &known = buffer->knownStacks[trace.hash % EventBuffer::stackCacheSize];
+	if(known.id == invalidStackId || known.hash != trace.hash || !stackTable.matches(known.id, trace)){
+		known.id = internStack(trace);
+		known.hash = trace.hash;
+	}
+
+	// The free can come from another thread before this event is drained.
+	trackedPages.add(ptr);
+	pushEvent(buffer, ptr, size, known.id, false);
+}
+
+void HeapProfiler::bufferFree(EventBuffer *buffer, void *ptr){
+	if(!trackedPages.mayContain(ptr)){
+		countUntrackedFree(ptr);
+		return;
+	}
+	pushEvent(buffer, ptr, 0, 0, true);
+}
+
+void HeapProfiler::pushEvent(EventBuffer *buffer, void *ptr, size_t size, StackId stack, bool isFree){
+	EventChunk *chunk = buffer->chunk.load(std::memory_order_relaxed);
+	size_t head = chunk->head.load(std::memory_order_relaxed);
+	if(head == EventChunk::capacity){
+		chunk = swapFullChunk(buffer);
+		head = 0;
+	}
+
+	// Announce the push before reading the clock, see drainEventBuffers. Times only
+	// ever go up within a buffer, even if the thread moves to a core whose clock is
+	// a little behind, so its own events can't be reordered.
+	buffer->pushingFrom.store(buffer->lastTime, std::memory_order_relaxed);
+	if(remoteFences){
+		std::atomic_signal_fence(std::memory_order_seq_cst);
 	}else{
-		// Do anything with wild pointer frees?
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		_mm_lfence();
 	}
+	uint64_t time = (std::max)(readEventClock(), buffer->lastTime + 1);
+	buffer->lastTime = time;
+
+	AllocationEvent &event = chunk->events[head];
+	event.ptr = ptr;
+	event.size = size;
+	event.stack = stack;
+	event.time = (time << 1) | (isFree ? 1 : 0);
+	chunk->head.store(head + 1, std::memory_order_release);
+	buffer->pushingFrom.store(EventBuffer::notPushing, std::memory_order_release);
 }
 
-void HeapProfiler::getAllocationSiteReport(std::vector<std::pair<StackTrace, size_t>> &allocs){
-	std::lock_guard<std::mutex> lk(mutex);
-	allocs.clear();
+EventChunk *HeapProfiler::swapFullChunk(EventBuffer *buffer){
+	EventChunk *chunk;
+	size_t backlog;
+	{
+		std::lock_guard<std::mutex> lk(eventBuffersMutex);
+		fullChunks.push_back(buffer->chunk.load(std::memory_order_relaxed));
+		backlog = fullChunks.size();
+		if(spareChunks.empty()){
+			chunk = new EventChunk();
+		}else{
+			chunk = spareChunks.back();
+			spareChunks.pop_back();
+		}
+		chunk->buffer = buffer;
+		buffer->chunk.store(chunk, std::memory_order_relaxed);
+	}
+
+	// Only help once the drains have fallen well behind, so the chunks waiting can't
+	// take up ever more memory.
+	if(backlog > maxFullChunks)
+		drainEventBuffers();
+	return chunk;
+}
+
+void HeapProfiler::drainEventBuffers(){
+	// Events from different threads have to be applied in the order they happened:
+	// a free is recorded before the memory is released and a malloc before the pointer
+	// is returned, so time order is the real order for any one address. Only events
+	// before a watermark are applied, which every push still in flight is at or after.
+	// Pushes announced after the watermark was read get a later time, and those
+	// announced before it lower it to before theirs, so nothing here ever waits on
+	// the threads pushing. The rest of their events are left for the next drain.
+	//
+	// A push whose clock read went before the remote fence has its announcement
+	// flushed by the fence, and one whose read went after it reads a later time than
+	// the watermark. Without remote fences the pushes fence between the two instead,
+	// the lfences keep the clock reads from moving past the fences.
+	std::lock_guard<std::mutex> lk(drainMutex);
+	uint64_t watermark = readEventClock();
+	_mm_lfence();
+	if(remoteFences)
+		remoteFence();
+	else
+		std::atomic_thread_fence(std::memory_order_seq_cst);
 
-	for(auto it = stackTraces.begin(); it != stackTraces.end(); it++){
-		const auto &info = it->second;
-		allocs.push_back(std::make_pair(info.trace, info.totalSize));
+	{
+		std::lock_guard<std::mutex> lk(eventBuffersMutex);
+		drainBuffers = eventBuffers;
+		drainChunks = fullChunks;
+		for(EventBuffer *buffer : eventBuffers)
+			drainChunks.push_back(buffer->chunk.load(std::memory_order_relaxed));
 	}
-}
\ No newline at end of file
+	// Each buffer's chunks together, oldest first, so their events make one run.
+	std::stable_sort(drainChunks.begin(), drainChunks.end(),
+		[](const EventChunk *a, const EventChunk *b){
+			return a->buffer < b->buffer;
+		}
+	);
+
+	for(EventBuffer *buffer : drainBuffers)
+		watermark = (std::min)(watermark, buffer->pushingFrom.load());
+
+	// Each buffer's events are already in order, so they only need merging. Once one
+	// of its chunks reaches the watermark all its later chunks are past it too.
+	drainBatch.clear();
+	drainRuns.clear();
+	for(size_t i = 0; i < drainChunks.size(); ++i){
+		EventChunk *chunk = drainChunks[i];
+		size_t tail = chunk->tail;
+		size_t head = chunk->head.load(std::memory_order_acquire);
+		if(i == 0 || chunk->buffer != drainChunks[i - 1]->buffer)
+			drainRuns.push_back(drainBatch.size());
+		for(; tail != head; ++tail){
+			const AllocationEvent &event = chunk->events[tail];
+			if((event.time >> 1) >= watermark)
+				break;
+			drainBatch.push_back(event);
+		}
+		chunk->tail = tail;
+	}
+	drainRuns.push_back(drainBatch.size());
+
+	// Give back full chunks which have been drained.
+	{
+		std::lock_guard<std::mutex> lk(eventBuffersMutex);
+		size_t kept = 0;
+		for(EventChunk *chunk : fullChunks){
+			if(chunk->tail == EventChunk::capacity){
+				chunk->head.store(0, std::memory_order_relaxed);
+				chunk->tail = 0;
+				spareChunks.push_back(chunk);
+			}else{
+				fullChunks[kept++] = chunk;
+			}
+		}
+		fullChunks.resize(kept);
+	}
+
+	// Merge neighbouring runs in pairs until there's one.
+	auto earlier = [](const AllocationEvent &a, const AllocationEvent &b){
+		return a.time < b.time;
+	};
+	drainMerged.resize(drainBatch.size());
+	while(drainRuns.size() > 2){
+		size_t numRuns = drainRuns.size() - 1;
+		size_t merged = 0;
+		for(size_t i = 0; i < numRuns; i += 2){
+			size_t begin = drainRuns[i];
+			size_t middle = drainRuns[i + 1];
+			size_t end = i + 2 <= numRuns ? drainRuns[i + 2] : middle;
+			std::merge(drainBatch.begin() + begin, drainBatch.begin() + middle,
+				drainBatch.begin() + middle, drainBatch.begin() + end,
+				drainMerged.begin() + begin, earlier);
+			drainRuns[merged++] = begin;
+		}
+		drainRuns[merged++] = drainBatch.size();
+		drainRuns.resize(merged);
+		drainBatch.swap(drainMerged);
+	}
+
+	// Most blocks are freed soon after they are allocated, often within the same batch.
+	// Those never need to go in the pointer table, only count towards what their site
+	// has allocated. Match frees to the batch's mallocs with a table of its own, sized
+	// so that it never fills up even though freed slots aren't reused.
+	size_t pendingCapacity = 16;
+	while(pendingCapacity < drainBatch.size()*2)
+		pendingCapacity *= 2;
+	PendingMalloc empty = {0, 0};
+	drainPending.assign(pendingCapacity, empty);
+	size_t mask = pendingCapacity - 1;
+	drainMerged.clear();
+	for(size_t i = 0; i < drainBatch.size(); ++i){
+		const AllocationEvent &event = drainBatch[i];
+		size_t slot = PointerTable::hashPointer(event.ptr) & mask;
+		while(drainPending[slot].ptr && (drainPending[slot].ptr != event.ptr || drainPending[slot].event == freedMalloc))
+			slot = (slot + 1) & mask;
+		PendingMalloc &pending = drainPending[slot];
+
+		if(event.time & 1){
+			// Frees of blocks allocated before this batch are applied after.
+			if(!pending.ptr){
+				drainMerged.push_back(event);
+				continue;
+			}
+			const AllocationEvent &allocation = drainBatch[pending.event];
+			SiteDelta &delta = getSiteDelta(allocation.stack);
+			delta.allocatedSize += trackableSize(allocation.size);
+			delta.allocatedCount++;
+			pending.event = freedMalloc;
+		}else if(!pending.ptr){
+			pending.ptr = event.ptr;
+			pending.event = i;
+		}
+		// Otherwise two buffers at the same address, the first is kept as addPointer does.
+	}
+	// Each address's free before its malloc.
+	for(const PendingMalloc &pending : drainPending){
+		if(pending.ptr && pending.event != freedMalloc)
+			drainMerged.push_back(drainBatch[pending.event]);
+	}
+
+	// Only events for the same address have to stay in order, and those share a shard.
+	// Group the events by shard, keeping their order, so each shard is locked once.
+	size_t shardStarts[numShards + 1] = {};
+	for(const AllocationEvent &event : drainMerged)
+		++shardStarts[shardIndex(event.ptr) + 1];
+	for(size_t i = 0; i < numShards; ++i)
+		shardStarts[i + 1] += shardStarts[i];
+	size_t shardEnds[numShards];
+	memcpy(shardEnds, shardStarts, sizeof(shardEnds));
+	drainBatch.resize(drainMerged.size());
+	for(const AllocationEvent &event : drainMerged)
+		drainBatch[shardEnds[shardIndex(event.ptr)]++] = event;
+
+	for(size_t i = 0; i < numShards; ++i){
+		if(shardStarts[i] == shardStarts[i + 1])
+			continue;
+		PointerShard &shard = pointerShards[i];
+		std::lock_guard<std::mutex> lk(shard.mutex);
+		for(size_t j = shardStarts[i]; j != shardStarts[i + 1]; ++j){
+			const AllocationEvent &event = drainBatch[j];
+			StackId stack;
+			size_t size;
+			if(event.time & 1){
+				if(shard.ptrs.remove(event.ptr, stack, size)){
+					SiteDelta &delta = getSiteDelta(stack);
+					delta.totalSize -= size;
+					delta.liveCount--;
+				}else{
+					countUntrackedFree(event.ptr);
+				}
+			}else{
+				size = trackableSize(event.size);
+				if(shard.ptrs.insert(event.ptr, event.stack, size)){
+					SiteDelta &delta = getSiteDelta(event.stack);
+					delta.totalSize += size;
+					delta.liveCount++;
+					delta.allocatedSize += size;
+					delta.allocatedCount++;
+				}
+			}
+		}
+	}
+	flushSiteDeltas();
+}
+
+HeapProfiler::SiteDelta &HeapProfiler::getSiteDelta(StackId stack){
+	SiteDelta &delta = siteDeltas[stack % numSiteDeltas];
+	if(delta.stack != stack){
+		flushSiteDelta(delta);
+		delta.stack = stack;
+	}
+	return delta;
+}
+
+void HeapProfiler::flushSiteDelta(SiteDelta &delta){
+	if(delta.stack == invalidStackId)
+		return;
+	// Negative changes wrap around, as they would added one at a time.
+	SiteInfo &site = sites[delta.stack];
+	if(delta.totalSize)
+		site.totalSize += delta.totalSize;
+	if(delta.liveCount)
+		site.liveCount += delta.liveCount;
+	if(delta.allocatedSize)
+		site.allocatedSize += delta.allocatedSize;
+	if(delta.allocatedCount)
+		site.allocatedCount += delta.allocatedCount;
+	delta.stack = invalidStackId;
+	delta.totalSize = delta.liveCount = delta.allocatedSize = delta.allocatedCount = 0;
+}
+
+void HeapProfiler::flushSiteDeltas(){
+	for(size_t i = 0; i < numSiteDeltas; ++i)
+		flushSiteDelta(siteDeltas[i]);
+}
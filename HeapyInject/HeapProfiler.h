@@ -4,39 +4,253 @@
 #include <unordered_map>
 #include <set>
 #include <mutex>
+#include <atomic>
+#include <stdint.h>
 
-const int backtraceSize = 64;
-typedef size_t StackHash;
+#include "Platform.h"
+#include "Arena.h"
+#include "StackTable.h"
+#include "PointerTable.h"
+#include "PointerFilter.h"
 
-struct StackTrace{
-	void *backtrace[backtraceSize];
-	StackHash hash;
+// A compact record of a malloc or free, used when allocations are buffered per
+// thread and aggregated in the background.
+struct AllocationEvent{
+	void *ptr;
+	size_t size;
+	// When the event happened, see readEventClock. The low bit is set for frees.
+	uint64_t time;
+	StackId stack;
+};
+
+class EventBuffer;
+
+// A block of events filled by one thread. Full chunks are handed to the profiler for
+// drainEventBuffers to apply and the thread carries on in an empty one.
+struct EventChunk{
+	EventChunk();
 
-	StackTrace();
-	void trace(); 
-	void print(std::ostream &stream) const;
+	static const size_t capacity = 4096;
+
+	// Events written, published by the filling thread.
+	std::atomic<size_t> head;
+	// Events applied, only touched while holding HeapProfiler::drainMutex.
+	size_t tail;
+	// The buffer filling it, or which filled it.
+	EventBuffer *buffer;
+	AllocationEvent events[capacity];
 };
 
-class HeapProfiler{
+// A thread's events, in the order it recorded them. Pushed to by a single producer,
+// the thread which currently owns it, and read by whoever holds HeapProfiler::drainMutex.
+class EventBuffer{
 public:
+	EventBuffer();
+private:
+	friend class HeapProfiler;
+	static const size_t stackCacheSize = 256;
+
+	static const uint64_t notPushing = ~(uint64_t)0;
+
+	// While the owner is pushing, a time no later than the one its event gets,
+	// otherwise notPushing. See drainEventBuffers.
+	std::atomic<uint64_t> pushingFrom;
+	// Time of the last event pushed, each event is given a later one.
+	uint64_t lastTime;
+	// Changed only by the owner while holding HeapProfiler::eventBuffersMutex.
+	std::atomic<EventChunk*> chunk;
+	std::atomic<bool> owned;
+
+	// Stacks the owning thread has already interned.
+	struct KnownStack{
+		StackHash hash;
+		StackId id;
+	};
+	KnownStack knownStacks[stackCacheSize];
+};
+
+// Totals for one allocation site.
+struct SiteStats{
+	StackId stack;
+	// Memory the site has allocated which is still live.
+	size_t liveSize;
+	size_t liveCount;
+	// Everything the site has ever allocated.
+	size_t allocatedSize;
+	size_t allocatedCount;
+};
+
+// Cumulative totals of dead sites which have been collected, folded together by the
+// function they were allocated from.
+struct CollectedSite{
+	void *caller;
+	size_t allocatedSize;
+	size_t allocatedCount;
+};
+
+class HeapProfiler : public CacheAligned{
+public:
+	HeapProfiler();
+	~HeapProfiler();
+
 	void malloc(void *ptr, size_t size, const StackTrace &trace);
 	void free(void *ptr, const StackTrace &trace);
 
 	// Return a list of allocation sites (a particular stack trace) and the amount
 	// of memory currently allocated by each site.
-	void getAllocationSiteReport(std::vector<std::pair<StackTrace, size_t>> &allocs);
+	void getAllocationSiteReport(std::vector<std::pair<StackId, size_t>> &allocs);
+
+	// Just the count sites with the most memory allocated, smallest first. Selected in
+	// one pass over the site table without copying or sorting all of it. Returns the
+	// amount of memory allocated by all sites.
+	size_t getTopAllocationSites(size_t count, std::vector<std::pair<StackId, size_t>> &top) const;
+
+	// Per site totals without copying every site out first. Sites are numbered from
+	// zero to getNumSites() - 1, the same as their stack ids.
+	size_t getNumSites() const;
+	SiteStats getSiteStats(StackId stack) const;
+
+	// Stack traces of the sites returned in reports.
+	const StackTable &getStackTable() const;
+
+	// Adaptive depth mode. Whether allocations from the site with this shallow stack have
+	// added up to enough that it's worth capturing their full stacks from now on.
+	bool needsFullStack(const StackTrace &shallowTrace, size_t threshold);
+
+	// Collect sites which have nothing live and haven't allocated anything in the last
+	// idlePasses calls, so long running processes don't accumulate every stack they have
+	// ever seen. Their stacks are freed and their ids reused, only their cumulative
+	// totals are kept, by caller. Call periodically from one thread at a time, the
+	// reporting thread. Returns the number of sites collected.
+	size_t collectDeadSites(uint32_t idlePasses);
+	void getCollectedSites(std::vector<CollectedSite> &collected) const;
+
+	// Frees of pointers which weren't being tracked: allocated before Heapy was injected,
+	// by an allocator it doesn't hook, or not sampled.
+	size_t getUntrackedFrees() const;
+	void countUntrackedFree(void *ptr);
+
+	// Attach mode. Blocks which were already allocated when Heapy attached, so were never
+	// seen being allocated. Only their totals are known.
+	void setPreexistingAllocations(size_t count, size_t size);
+	size_t getPreexistingCount() const;
+	size_t getPreexistingSize() const;
+
+	// Header mode. Allocations carry their site and size in a header in front of the block,
+	// so only the site totals are kept here. Returns the site the allocation was added to.
+	StackId addSiteAllocation(size_t size, const StackTrace &trace);
+	void removeSiteAllocation(StackId stack, size_t size);
+
+	// Buffered mode. Each thread records events into its own EventBuffer instead of
+	// updating the tables directly, drainEventBuffers applies them in batches in the
+	// order they happened. Recording never waits for a drain unless the drains have
+	// fallen maxFullChunks behind.
+	EventBuffer *acquireEventBuffer();
+	void releaseEventBuffer(EventBuffer *buffer);
+	void bufferMalloc(EventBuffer *buffer, void *ptr, size_t size, const StackTrace &trace);
+	void bufferFree(EventBuffer *buffer, void *ptr);
+	void drainEventBuffers();
 private:
-	std::mutex mutex;
-	struct CallStackInfo {
-		StackTrace trace;
+	// The pointer table is split into shards, each with its own lock, so that
+	// threads allocating different pointers almost never contend.
+	static const size_t numShards = 64;
+
+	enum SiteState{
+		siteIndexed,
+		// Unlinked by the last collection, released by the next unless it has been used since.
+		siteUnlinked,
+		// Used by a thread which found it just before it was unlinked, it carries on as
+		// a normal site until it is collected again.
+		siteOrphaned,
+		siteReleased
+	};
+
+	// Per site totals, indexed by stack id.
+	struct SiteInfo {
+		std::atomic<size_t> totalSize;
+		std::atomic<size_t> liveCount;
+		std::atomic<size_t> allocatedSize;
+		std::atomic<size_t> allocatedCount;
+
+		// Only used by collectDeadSites.
+		size_t seenCount;
+		uint32_t lastActive;
+		uint32_t state;
+	};
+	// Aligned to a cache line so neighbouring shard locks don't false share.
+	struct __declspec(align(64)) PointerShard {
+		std::mutex mutex;
+		PointerTable ptrs;
+	};
+	// Kept apart from the shards so that counting frees which skip the lock doesn't
+	// touch the lock's cache line.
+	struct __declspec(align(64)) FreeCounter {
+		std::atomic<size_t> count;
+	};
+
+	// Full chunks waiting to be drained before recording threads help drain them, 8Mb
+	// of events.
+	static const size_t maxFullChunks = 64;
+
+	static size_t shardIndex(void *ptr);
+
+	StackId internStack(const StackTrace &trace);
+	void pushEvent(EventBuffer *buffer, void *ptr, size_t size, StackId stack, bool isFree);
+	EventChunk *swapFullChunk(EventBuffer *buffer);
+	void addPointer(void *ptr, size_t size, StackId stack);
+	void removePointer(void *ptr);
+
+	// Changes a drain makes to a site's totals, added to the site when another site
+	// needs the slot or the drain finishes, so hot sites aren't updated once per event.
+	struct SiteDelta{
+		StackId stack;
 		size_t totalSize;
+		size_t liveCount;
+		size_t allocatedSize;
+		size_t allocatedCount;
 	};
-	struct PointerInfo {
-		StackHash stack;
-		size_t size;
+	static const size_t numSiteDeltas = 1024;
+
+	// A malloc from the batch being drained which hasn't been freed in it, by its index.
+	struct PendingMalloc{
+		void *ptr;
+		size_t event;
 	};
+	// Left in place of a malloc freed in the same batch.
+	static const size_t freedMalloc = ~(size_t)0;
+	SiteDelta &getSiteDelta(StackId stack);
+	void flushSiteDelta(SiteDelta &delta);
+	void flushSiteDeltas();
+
+	StackTable stackTable;
+	ChunkedArray<SiteInfo> sites;
+	PointerShard pointerShards[numShards];
+	// Every pointer which has been tracked, checked before a free takes a shard lock.
+	PointerFilter trackedPages;
+	FreeCounter untrackedFrees[numShards];
+
+	mutable std::mutex collectMutex;
+	uint32_t collectPass;
+	std::unordered_map<void*, CollectedSite> collectedSites;
+
+	// Whether drains can fence the pushing threads, see drainEventBuffers.
+	bool remoteFences;
+	std::mutex eventBuffersMutex;
+	std::vector<EventBuffer*> eventBuffers;
+	// Chunks swapped out when they filled, oldest first, and empty ones to swap in.
+	std::vector<EventChunk*> fullChunks;
+	std::vector<EventChunk*> spareChunks;
 
-	std::unordered_map<StackHash, CallStackInfo> stackTraces;
-	std::unordered_map<void*, PointerInfo> ptrs;
+	// Only used by drainEventBuffers, kept to save allocating them on every drain.
+	std::mutex drainMutex;
+	std::vector<EventBuffer*> drainBuffers;
+	std::vector<EventChunk*> drainChunks;
+	std::vector<size_t> drainRuns;
+	std::vector<AllocationEvent> drainBatch;
+	std::vector<AllocationEvent> drainMerged;
+	std::vector<PendingMalloc> drainPending;
+	SiteDelta siteDeltas[numSiteDeltas];
 
+	size_t preexistingCount;
+	size_t preexistingSize;
 };
\ No newline at end of file
@@ -1,4 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
 #include <mutex>
 #include <vector>
 #include <memory>
@@ -6,16 +10,49 @@
 #include <thread>
 #include <fstream>
 #include <iomanip>
+#include <string>
 #include <algorithm>
+#include <chrono>
 
+#include "Platform.h"
 #include "HeapProfiler.h"
-
+#include "EventStream.h"
+#include "Report.h"
+#include "ProfileDump.h"
+#include "PprofExport.h"
+#include "Unwinder.h"
+#include "AllocationCounters.h"
+#include "Attach.h"
+#include "ImportTable.h"
 #include "MinHook.h"
+
+#ifdef _WIN32
 #include "dbghelp.h"
 #include <tlhelp32.h>
+#else
+#include "ElfSymbols.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <condition_variable>
+#endif
 
 typedef void * (__cdecl *PtrMalloc)(size_t);
 typedef void (__cdecl *PtrFree)(void *);
+typedef void * (__cdecl *PtrCalloc)(size_t, size_t);
+typedef void * (__cdecl *PtrRealloc)(void *, size_t);
+typedef void * (__cdecl *PtrRecalloc)(void *, size_t, size_t);
+typedef size_t (__cdecl *PtrMsize)(void *);
+typedef void * (__cdecl *PtrAlignedMalloc)(size_t, size_t);
+typedef void * (__cdecl *PtrAlignedRealloc)(void *, size_t, size_t);
+typedef void * (__cdecl *PtrAlignedRecalloc)(void *, size_t, size_t, size_t);
+typedef size_t (__cdecl *PtrAlignedMsize)(void *, size_t, size_t);
 
 
 // Hook tables. (Lot's of static data, but it's the only way to do this.)
@@ -27,10 +64,94 @@ PtrMalloc mallocHooks[numHooks];
 PtrFree freeHooks[numHooks];
 PtrMalloc originalMallocs[numHooks];
 PtrFree originalFrees[numHooks];
+void *mallocTargets[numHooks];
+void *freeTargets[numHooks];
 // TODO?: Special case for debug build malloc/frees?
 
+// The rest of the allocator family, only hooked in header mode.
+template <typename Ptr>
+struct HookTable{
+	Ptr hooks[numHooks];
+	Ptr originals[numHooks];
+	void *targets[numHooks];
+	int nUsed;
+};
+HookTable<PtrCalloc> callocHooks;
+HookTable<PtrRealloc> reallocHooks;
+HookTable<PtrRecalloc> recallocHooks;
+HookTable<PtrRealloc> expandHooks;
+HookTable<PtrMsize> msizeHooks;
+HookTable<PtrAlignedMalloc> alignedMallocHooks;
+HookTable<PtrAlignedRealloc> alignedReallocHooks;
+HookTable<PtrAlignedRecalloc> alignedRecallocHooks;
+HookTable<PtrAlignedMsize> alignedMsizeHooks;
+HookTable<PtrFree> alignedFreeHooks;
+
 HeapProfiler *heapProfiler;
 
+// Out of process mode, allocations are streamed to the Heapy launcher which does all
+// of the aggregation and reporting.
+EventStreamWriter *eventStream = 0;
+
+// Record allocations into per thread event buffers which a background thread aggregates.
+bool bufferedMode = false;
+static __declspec( thread ) EventBuffer *threadEventBuffer = 0;
+static __declspec( thread ) bool threadDetached = false;
+
+// Adaptive depth mode. Stacks are captured shallow until their site has allocated
+// this many bytes, after which that site's allocations get full stacks.
+size_t fullStackThreshold = 0;
+
+// Header mode. Recorded allocations carry their site and size in a header in front of
+// the block, so frees find them without any lookup or shared state.
+bool headerMode = false;
+
+// Cleared while profiling is paused from HeapyPauseProfiling. Allocations aren't recorded
+// then but frees still are, so that the allocations from before stay balanced.
+std::atomic<bool> profilingEnabled(true);
+
+// Counter mode. Until full profiling is switched on, by the launcher setting
+// fullProfileEvent or sending SIGUSR1, the malloc and free hooks only bump their
+// thread's counters.
+AllocationCounters *allocationCounters = 0;
+std::atomic<bool> countingOnly(false);
+#ifdef _WIN32
+HANDLE fullProfileEvent = 0;
+#else
+std::atomic<bool> fullProfileRequested(false);
+#endif
+static __declspec( thread ) AllocationCounters::ThreadCounters *threadCounters = 0;
+
+// Attach mode. Heapy was injected into a running process, which it can detach from again
+// with HeapyDetach. Options come from the launcher's mapping rather than the environment.
+bool attached = false;
+char *attachOptions = 0;
+// Set while detaching, stops the report and aggregate threads.
+std::atomic<bool> detaching(false);
+#ifdef _WIN32
+HANDLE detachEvent = 0;
+HANDLE reportThread = 0;
+HANDLE aggregateThread = 0;
+#else
+// Stands in for detachEvent.
+std::mutex detachMutex;
+std::condition_variable detachCondition;
+pthread_t reportThread = 0;
+pthread_t aggregateThread = 0;
+#endif
+// Bumped each time Heapy detaches. A thread's buffer and counters from before then went
+// with the profiler, so it has to forget them.
+std::atomic<uint32_t> attachment(0);
+static __declspec( thread ) uint32_t threadAttachment = 0;
+
+// Write compact binary snapshots for offline symbolisation instead of text reports.
+bool binaryMode = false;
+uint32_t reportInterval = 10000;
+// Collect sites which have been dead for this many reports, 0 to keep every site.
+uint32_t collectIdlePasses = 0;
+// Also keep the latest profile in pprof's format.
+bool pprofMode = false;
+
 // Mechanism to stop us profiling ourself.
 static __declspec( thread ) int _depthCount = 0; // use thread local count
 
@@ -43,43 +164,608 @@ struct PreventSelfProfile{
 	}
 
 	inline bool shouldProfile(){
-		return _depthCount <= 1;
+		return _depthCount <= 1 && profilingEnabled.load(std::memory_order_relaxed) && !countingOnly.load(std::memory_order_relaxed);
+	}
+
+	inline bool shouldRecordFree(){
+		return _depthCount <= 1 && !countingOnly.load(std::memory_order_relaxed);
+	}
+
+	inline bool shouldCount(){
+		return _depthCount <= 1 && profilingEnabled.load(std::memory_order_relaxed);
 	}
 private:
 	PreventSelfProfile(const PreventSelfProfile&){}
-	PreventSelfProfile& operator=(const PreventSelfProfile&){}
+	PreventSelfProfile& operator=(const PreventSelfProfile&){ return *this; }
 };
 
 void PreventEverProfilingThisThread(){
 	_depthCount++;
 }
 
-// Malloc hook function. Templated so we can hook many mallocs.
-template <int N>
-void * __cdecl mallocHook(size_t size){
+// Attach mode. Threads inside a hook are counted so that HeapyDetach can wait until none
+// are left before it frees what the hooks use. Hooks entered once detaching has started
+// leave the profiler alone and just call the real function. The counts are spread over
+// cache lines so that threads allocating at the same time don't all write the same one.
+const int numHookCounts = 16;
+struct __declspec(align(64)) HookCount{
+	std::atomic<int> count;
+};
+HookCount hookCounts[numHookCounts];
+std::atomic<int> nextHookCount(0);
+static __declspec( thread ) HookCount *threadHookCount = 0;
+static __declspec( thread ) int threadHookDepth = 0;
+
+struct InsideHook{
+	InsideHook() : hookCount(0){
+		if(!attached)
+			return;
+		if(!threadHookCount)
+			threadHookCount = &hookCounts[nextHookCount++ % numHookCounts];
+		hookCount = threadHookCount;
+		// Sequentially consistent, so either HeapyDetach sees this count or the hook
+		// sees detaching.
+		hookCount->count++;
+		threadHookDepth++;
+	}
+	~InsideHook(){
+		if(hookCount){
+			threadHookDepth--;
+			hookCount->count--;
+		}
+	}
+
+	// False once detaching, the profiler may be gone by the time it would be used.
+	inline bool canUseProfiler(){
+		return !hookCount || !detaching;
+	}
+private:
+	HookCount *hookCount;
+	InsideHook(const InsideHook&){}
+	InsideHook& operator=(const InsideHook&){ return *this; }
+};
+
+// Wait for every thread to have left the hooks.
+void waitForHooks(){
+	for(HookCount &hookCount : hookCounts){
+		while(hookCount.count)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+// Sampling mode. Rather than recording every allocation we record roughly one in every
+// sampleInterval bytes, with sample points spread as a poisson process over the bytes
+// each thread allocates.
+size_t sampleInterval = 0;
+static __declspec( thread ) int64_t bytesUntilSample = 0;
+static __declspec( thread ) uint64_t sampleRandomState = 0;
+
+// Draw the number of bytes until the next sample from an exponential distribution.
+int64_t nextSampleInterval(){
+	if(!sampleRandomState)
+		sampleRandomState = ((uint64_t)(size_t)&sampleRandomState * 0x9E3779B97F4A7C15ULL) | 1;
+
+	// xorshift64*
+	sampleRandomState ^= sampleRandomState >> 12;
+	sampleRandomState ^= sampleRandomState << 25;
+	sampleRandomState ^= sampleRandomState >> 27;
+	uint64_t r = sampleRandomState * 2685821657736338717ULL;
+
+	double u = ((r >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+	return (int64_t)(-log(u) * sampleInterval) + 1;
+}
+
+// Called once bytesUntilSample has run out. Returns the number of bytes this allocation
+// stands for, or 0 if it should not be recorded after all.
+size_t takeSample(size_t size){
+	if(!sampleRandomState){
+		// First allocation on this thread, start counting from here.
+		bytesUntilSample = nextSampleInterval() - (int64_t)size;
+		if(bytesUntilSample > 0)
+			return 0;
+	}
+	bytesUntilSample = nextSampleInterval();
+
+	// An allocation of this size gets sampled with probability 1 - e^(-size/interval),
+	// scaling by that makes the reported totals unbiased.
+	double probability = 1.0 - exp(-(double)size / sampleInterval);
+	return probability > 0 ? (size_t)(size / probability + 0.5) : 0;
+}
+
+// Whether an allocation of size should be recorded, and how many bytes to record it as.
+bool shouldRecord(size_t size, size_t &recordSize){
+	recordSize = size;
+	if(sampleInterval){
+		// When sampling most allocations just count down to the next sample.
+		if((bytesUntilSample -= size) > 0)
+			return false;
+		recordSize = takeSample(size);
+		if(!recordSize)
+			return false;
+	}
+	return true;
+}
+
+void traceAllocation(StackTrace &trace){
+	if(fullStackThreshold){
+		trace.trace(shallowBacktraceSize);
+		if(heapProfiler->needsFullStack(trace, fullStackThreshold))
+			trace.trace();
+	}else{
+		trace.trace();
+	}
+}
+
+inline void checkThreadAttachment(){
+	uint32_t current = attachment.load(std::memory_order_relaxed);
+	if(threadAttachment != current){
+		threadEventBuffer = 0;
+		threadCounters = 0;
+		threadDetached = false;
+		threadAttachment = current;
+	}
+}
+
+// Hand this thread's event buffer and counters back so a new thread can reuse them.
+void detachThread(){
+	InsideHook insideHook;
+	if(!insideHook.canUseProfiler())
+		return;
+	checkThreadAttachment();
+	if(threadEventBuffer)
+		heapProfiler->releaseEventBuffer(threadEventBuffer);
+	threadEventBuffer = 0;
+	if(threadCounters)
+		allocationCounters->release(threadCounters);
+	threadCounters = 0;
+	threadDetached = true;
+}
+
+#ifndef _WIN32
+// There's no DLL_THREAD_DETACH, instead a thread specific value is set on threads which
+// take a buffer or counters and its destructor detaches them.
+static pthread_key_t threadExitKey;
+
+static void threadExit(void *){
+	detachThread();
+}
+#endif
+
+void watchThreadExit(){
+#ifndef _WIN32
+	pthread_setspecific(threadExitKey, (void*)1);
+#endif
+}
+
+// Returns null once the thread has detached, the buffer has been handed back by then.
+EventBuffer *getThreadEventBuffer(){
+	checkThreadAttachment();
+	if(!threadEventBuffer && !threadDetached){
+		threadEventBuffer = heapProfiler->acquireEventBuffer();
+		watchThreadExit();
+	}
+	return threadEventBuffer;
+}
+
+// Returns null once the thread has detached, like getThreadEventBuffer.
+AllocationCounters::ThreadCounters *getThreadCounters(){
+	checkThreadAttachment();
+	if(!threadCounters && !threadDetached){
+		threadCounters = allocationCounters->acquire();
+		watchThreadExit();
+	}
+	return threadCounters;
+}
+
+// Header mode's header, directly in front of the pointer handed to the program. Blocks
+// allocated before we hooked, or by allocator paths we don't see, have no header, the
+// cookie tells them apart. It depends on the address and is cleared whenever the block
+// is released, so neither the heap's own block headers nor stale copies in freed memory
+// can pass for one. Blocks which aren't recorded, when sampling, don't get a header.
+struct AllocationHeader{
+	// Stack id and recorded size packed as in PointerTable.
+	uint64_t value;
+	uint64_t cookie;
+};
+const size_t headerSize = sizeof(AllocationHeader);
+const uint64_t headerMagic = 0x5244485950414548ULL;
+// A block which keeps its header without being recorded, after an unsampled realloc.
+const uint64_t unrecordedValue = ~0ULL;
+const size_t pageSize = 4096;
+
+inline uint64_t headerCookie(void *p){
+	return headerMagic ^ (uint64_t)(size_t)p;
+}
+
+// The header is on the same page as p unless p is near the start of one. Then the page
+// before might not be mapped, for blocks straight from VirtualAlloc, so read it carefully.
+bool readHeaderCookie(AllocationHeader *header, uint64_t &cookie){
+#ifdef _WIN32
+	__try{
+		cookie = header->cookie;
+		return true;
+	}__except(EXCEPTION_EXECUTE_HANDLER){
+		return false;
+	}
+#else
+	// Header mode is Windows only, see setupHeapProfiling.
+	return false;
+#endif
+}
+
+// The header in front of p, or null if p doesn't have one.
+AllocationHeader *getHeader(void *p){
+	if(!p)
+		return 0;
+
+	AllocationHeader *header = (AllocationHeader*)p - 1;
+	uint64_t cookie;
+	if((size_t)p % pageSize >= headerSize)
+		cookie = header->cookie;
+	else if(!readHeaderCookie(header, cookie))
+		return 0;
+	return cookie == headerCookie(p) ? header : 0;
+}
+
+// Write the header in front of p, recording the allocation first if record is set.
+void attachHeader(void *p, bool record, size_t recordSize){
+	AllocationHeader *header = (AllocationHeader*)p - 1;
+	header->value = unrecordedValue;
+	if(record){
+		if(recordSize > PointerTable::maxSize)
+			recordSize = (size_t)PointerTable::maxSize;
+
+		StackTrace trace;
+		traceAllocation(trace);
+		StackId stack = heapProfiler->addSiteAllocation(recordSize, trace);
+		header->value = (uint64_t)stack << 36 | (uint64_t)recordSize;
+	}
+	header->cookie = headerCookie(p);
+}
+
+void unrecordHeader(uint64_t value){
+	if(value != unrecordedValue)
+		heapProfiler->removeSiteAllocation((StackId)(value >> 36), (size_t)(value & PointerTable::maxSize));
+}
+
+// Take the allocation out of its site before the block is released.
+void detachHeader(AllocationHeader *header){
+	unrecordHeader(header->value);
+	header->cookie = 0;
+}
+
+// Allocate size bytes with allocate, which is given the full size to allocate. Recorded
+// allocations get offset bytes in front for their header.
+template <typename Allocate>
+void *headerAllocate(size_t size, size_t offset, bool profile, Allocate allocate){
+	size_t recordSize;
+	if(!profile || size > (size_t)-1 - offset || !shouldRecord(size, recordSize))
+		return allocate(size);
+
+	char *block = (char*)allocate(size + offset);
+	if(!block)
+		return 0;
+	attachHeader(block + offset, true, recordSize);
+	return block + offset;
+}
+
+// Resize a block with a header to size bytes with resize, which is given the start of the
+// block and its new full size. Counted as a free then a malloc, so the block is recorded
+// again against the current stack if it gets sampled, or keeps an unrecorded header.
+template <typename Resize>
+void *headerResize(AllocationHeader *header, size_t size, size_t offset, bool profile, Resize resize){
+	if(size > (size_t)-1 - offset)
+		return 0;
+
+	// Clear the cookie first, if the block moves the old copy is left behind in freed memory.
+	void *p = header + 1;
+	uint64_t value = header->value;
+	header->cookie = 0;
+	char *block = (char*)resize((char*)p - offset, size + offset);
+	if(!block){
+		// Failed, the old block is untouched.
+		header->cookie = headerCookie(p);
+		return 0;
+	}
+
+	unrecordHeader(value);
+	size_t recordSize;
+	bool record = profile && shouldRecord(size, recordSize);
+	attachHeader(block + offset, record, record ? recordSize : 0);
+	return block + offset;
+}
+
+template <typename Free>
+void headerFree(Free original, void *p, bool profile){
+	AllocationHeader *header = getHeader(p);
+	if(header){
+		detachHeader(header);
+		original(header);
+	}else{
+		original(p);
+		if(profile)
+			heapProfiler->countUntrackedFree(p);
+	}
+}
+
+// Aligned blocks need the header's offset to stay a multiple of the alignment, and keep it
+// in front of the header since _aligned_free isn't told the alignment.
+size_t alignedHeaderOffset(size_t alignment){
+	return alignment > 2*headerSize ? alignment : 2*headerSize;
+}
+
+size_t &alignedHeaderOffset(AllocationHeader *header){
+	return ((size_t*)header)[-1];
+}
+
+// headerAllocate for aligned blocks, allocate is given the full size to allocate.
+template <typename Allocate>
+void *alignedHeaderAllocate(size_t size, size_t alignment, bool profile, Allocate allocate){
+	size_t offset = alignedHeaderOffset(alignment);
+	size_t recordSize;
+	if(!profile || size > (size_t)-1 - offset || !shouldRecord(size, recordSize))
+		return allocate(size);
+
+	char *block = (char*)allocate(size + offset);
+	if(!block)
+		return 0;
+	attachHeader(block + offset, true, recordSize);
+	alignedHeaderOffset((AllocationHeader*)(block + offset) - 1) = offset;
+	return block + offset;
+}
+
+// Everything a hook which allocates a new block does. allocate is given the size to
+// allocate, module is the hook number counter mode counts against.
+template <typename Allocate>
+void *hookAllocation(size_t module, size_t size, Allocate allocate){
+	InsideHook insideHook;
+	if(!insideHook.canUseProfiler() || !profilingEnabled.load(std::memory_order_relaxed))
+		return allocate(size);
+
 	PreventSelfProfile preventSelfProfile;
 
-	void * p = originalMallocs[N](size);
+	if(countingOnly.load(std::memory_order_relaxed)){
+		void *p = allocate(size);
+		AllocationCounters::ThreadCounters *counters = preventSelfProfile.shouldCount() ? getThreadCounters() : 0;
+		if(counters)
+			AllocationCounters::countMalloc(counters, module, size);
+		return p;
+	}
+
+	if(headerMode)
+		return headerAllocate(size, headerSize, preventSelfProfile.shouldProfile(), allocate);
+
+	void * p = allocate(size);
 	if(preventSelfProfile.shouldProfile()){
+		size_t recordSize;
+		if(!shouldRecord(size, recordSize))
+			return p;
+
 		StackTrace trace;
-		trace.trace();
-		heapProfiler->malloc(p, size, trace);
+		traceAllocation(trace);
+		EventBuffer *buffer = bufferedMode ? getThreadEventBuffer() : 0;
+		if(eventStream)
+			eventStream->malloc(p, recordSize, trace);
+		else if(buffer)
+			heapProfiler->bufferMalloc(buffer, p, recordSize, trace);
+		else
+			heapProfiler->malloc(p, recordSize, trace);
 	}
 
 	return p;
 }
 
-// Free hook function.
-template <int N>
-void  __cdecl freeHook(void * p){
+// Everything a hook which frees a block does, free releases it.
+template <typename Free>
+void hookFree(size_t module, void *p, Free free){
+	// Header mode isn't used when attaching, so nothing needs its header taken off.
+	InsideHook insideHook;
+	if(!insideHook.canUseProfiler()){
+		free(p);
+		return;
+	}
+
 	PreventSelfProfile preventSelfProfile;
 
-	originalFrees[N](p);
-	if(preventSelfProfile.shouldProfile()){
+	if(countingOnly.load(std::memory_order_relaxed)){
+		AllocationCounters::ThreadCounters *counters = p && preventSelfProfile.shouldCount() ? getThreadCounters() : 0;
+		if(counters)
+			AllocationCounters::countFree(counters, module);
+		if(headerMode)
+			headerFree(free, p, false);
+		else
+			free(p);
+		return;
+	}
+
+	// Headers are checked whatever the depth, a block with one always has to be freed from its start.
+	if(headerMode){
+		headerFree(free, p, preventSelfProfile.shouldProfile());
+		return;
+	}
+
+	// Record frees before the memory can be handed out again, so that they are always
+	// ordered before any malloc which reuses the address.
+	if(eventStream && p && preventSelfProfile.shouldRecordFree()){
+		eventStream->free(p);
+		free(p);
+		return;
+	}
+
+	EventBuffer *buffer = bufferedMode && p && preventSelfProfile.shouldRecordFree() ? getThreadEventBuffer() : 0;
+	if(buffer){
+		heapProfiler->bufferFree(buffer, p);
+		free(p);
+		return;
+	}
+
+	if(preventSelfProfile.shouldRecordFree()){
 		StackTrace trace;
 		//trace.trace();
 		heapProfiler->free(p, trace);
 	}
+	free(p);
+}
+
+// Malloc hook function. Templated so we can hook many mallocs.
+template <int N>
+void * __cdecl mallocHook(size_t size){
+	return hookAllocation(N, size, originalMallocs[N]);
+}
+
+// Free hook function.
+template <int N>
+void  __cdecl freeHook(void * p){
+	hookFree(N, p, originalFrees[N]);
+}
+
+// Header mode hooks for the rest of the allocator family. Every function which can be
+// handed a block from malloc has to know about headers.
+template <int N>
+void * __cdecl callocHook(size_t count, size_t size){
+	PreventSelfProfile preventSelfProfile;
+	PtrCalloc original = callocHooks.originals[N];
+	if(count && size > (size_t)-1 / count)
+		return original(count, size);
+	return headerAllocate(count*size, headerSize, preventSelfProfile.shouldProfile(),
+		[=](size_t n){ return original(1, n); });
+}
+
+template <int N>
+void * __cdecl reallocHook(void *p, size_t size){
+	PreventSelfProfile preventSelfProfile;
+	PtrRealloc original = reallocHooks.originals[N];
+	AllocationHeader *header = getHeader(p);
+	if(!p)
+		return headerAllocate(size, headerSize, preventSelfProfile.shouldProfile(),
+			[=](size_t n){ return original(0, n); });
+	if(!header)
+		return original(p, size);
+
+	// Reallocating to nothing frees the block.
+	if(size == 0){
+		detachHeader(header);
+		return original(header, 0);
+	}
+	return headerResize(header, size, headerSize, preventSelfProfile.shouldProfile(),
+		[=](void *block, size_t n){ return original(block, n); });
+}
+
+template <int N>
+void * __cdecl recallocHook(void *p, size_t count, size_t size){
+	PreventSelfProfile preventSelfProfile;
+	PtrRecalloc original = recallocHooks.originals[N];
+	AllocationHeader *header = getHeader(p);
+	if(!header && p)
+		return original(p, count, size);
+	if(count && size > (size_t)-1 / count)
+		return original(p, count, size);
+	if(!p)
+		return headerAllocate(count*size, headerSize, preventSelfProfile.shouldProfile(),
+			[=](size_t n){ return original(0, 1, n); });
+
+	if(count*size == 0){
+		detachHeader(header);
+		return original(header, 0, 0);
+	}
+	// The bytes zeroed are those past the old block, header included, so this lines up.
+	return headerResize(header, count*size, headerSize, preventSelfProfile.shouldProfile(),
+		[=](void *block, size_t n){ return original(block, 1, n); });
+}
+
+template <int N>
+void * __cdecl expandHook(void *p, size_t size){
+	PtrRealloc original = expandHooks.originals[N];
+	AllocationHeader *header = getHeader(p);
+	if(!header)
+		return original(p, size);
+
+	// Resized in place, the block stays recorded at its original size.
+	if(size > (size_t)-1 - headerSize)
+		return 0;
+	return original(header, size + headerSize) ? p : 0;
+}
+
+template <int N>
+size_t __cdecl msizeHook(void *p){
+	PtrMsize original = msizeHooks.originals[N];
+	AllocationHeader *header = getHeader(p);
+	return header ? original(header) - headerSize : original(p);
+}
+
+template <int N>
+void * __cdecl alignedMallocHook(size_t size, size_t alignment){
+	PreventSelfProfile preventSelfProfile;
+	PtrAlignedMalloc original = alignedMallocHooks.originals[N];
+	return alignedHeaderAllocate(size, alignment, preventSelfProfile.shouldProfile(),
+		[=](size_t n){ return original(n, alignment); });
+}
+
+template <int N>
+void * __cdecl alignedReallocHook(void *p, size_t size, size_t alignment){
+	PreventSelfProfile preventSelfProfile;
+	PtrAlignedRealloc original = alignedReallocHooks.originals[N];
+	AllocationHeader *header = getHeader(p);
+	if(!p)
+		return alignedHeaderAllocate(size, alignment, preventSelfProfile.shouldProfile(),
+			[=](size_t n){ return original(0, n, alignment); });
+	if(!header)
+		return original(p, size, alignment);
+
+	// Changing a block's alignment isn't allowed, so its header offset stays the same. The
+	// offset is moved along with the rest of the block.
+	size_t offset = alignedHeaderOffset(header);
+	if(size == 0){
+		detachHeader(header);
+		return original((char*)p - offset, 0, alignment);
+	}
+	return headerResize(header, size, offset, preventSelfProfile.shouldProfile(),
+		[=](void *block, size_t n){ return original(block, n, alignment); });
+}
+
+template <int N>
+void * __cdecl alignedRecallocHook(void *p, size_t count, size_t size, size_t alignment){
+	PreventSelfProfile preventSelfProfile;
+	PtrAlignedRecalloc original = alignedRecallocHooks.originals[N];
+	AllocationHeader *header = getHeader(p);
+	if(!header && p)
+		return original(p, count, size, alignment);
+	if(count && size > (size_t)-1 / count)
+		return original(p, count, size, alignment);
+	if(!p)
+		return alignedHeaderAllocate(count*size, alignment, preventSelfProfile.shouldProfile(),
+			[=](size_t n){ return original(0, 1, n, alignment); });
+
+	size_t offset = alignedHeaderOffset(header);
+	if(count*size == 0){
+		detachHeader(header);
+		return original((char*)p - offset, 0, 0, alignment);
+	}
+	return headerResize(header, count*size, offset, preventSelfProfile.shouldProfile(),
+		[=](void *block, size_t n){ return original(block, 1, n, alignment); });
+}
+
+template <int N>
+size_t __cdecl alignedMsizeHook(void *p, size_t alignment, size_t offset){
+	PtrAlignedMsize original = alignedMsizeHooks.originals[N];
+	AllocationHeader *header = getHeader(p);
+	if(!header)
+		return original(p, alignment, offset);
+	size_t headerOffset = alignedHeaderOffset(header);
+	return original((char*)p - headerOffset, alignment, offset) - headerOffset;
+}
+
+template <int N>
+void __cdecl alignedFreeHook(void *p){
+	PtrFree original = alignedFreeHooks.originals[N];
+	AllocationHeader *header = getHeader(p);
+	if(!header){
+		original(p);
+		return;
+	}
+	size_t offset = alignedHeaderOffset(header);
+	detachHeader(header);
+	original((char*)p - offset);
 }
 
 // Template recursion to init a hook table.
@@ -89,6 +775,19 @@ template<int N> struct InitNHooks{
 
 		mallocHooks[N-1] = &mallocHook<N-1>;
 		freeHooks[N-1] = &freeHook<N-1>;
+#ifdef _WIN32
+		// Header mode is Windows only.
+		callocHooks.hooks[N-1] = &callocHook<N-1>;
+		reallocHooks.hooks[N-1] = &reallocHook<N-1>;
+		recallocHooks.hooks[N-1] = &recallocHook<N-1>;
+		expandHooks.hooks[N-1] = &expandHook<N-1>;
+		msizeHooks.hooks[N-1] = &msizeHook<N-1>;
+		alignedMallocHooks.hooks[N-1] = &alignedMallocHook<N-1>;
+		alignedReallocHooks.hooks[N-1] = &alignedReallocHook<N-1>;
+		alignedRecallocHooks.hooks[N-1] = &alignedRecallocHook<N-1>;
+		alignedMsizeHooks.hooks[N-1] = &alignedMsizeHook<N-1>;
+		alignedFreeHooks.hooks[N-1] = &alignedFreeHook<N-1>;
+#endif
     }
 };
  
@@ -98,49 +797,126 @@ template<> struct InitNHooks<0>{
     }
 };
 
-// Callback which recieves addresses for mallocs/frees which we hook.
-BOOL CALLBACK enumSymbolsCallback(PSYMBOL_INFO symbolInfo, ULONG symbolSize, PVOID userContext){
-	std::lock_guard<std::mutex> lk(hookTableMutex);
-	PreventSelfProfile preventSelfProfile;
-
-	PCSTR moduleName = (PCSTR)userContext;
-	
-	// Hook mallocs.
-	if(strcmp(symbolInfo->Name, "malloc") == 0){
-		if(nUsedMallocHooks >= numHooks){
-			printf("All malloc hooks used up!\n");
-			return true;
-		}
-		printf("Hooking malloc from module %s into malloc hook num %d.\n", moduleName, nUsedMallocHooks);
-		if(MH_CreateHook((void*)symbolInfo->Address, mallocHooks[nUsedMallocHooks],  (void **)&originalMallocs[nUsedMallocHooks]) != MH_OK){
-			printf("Create hook malloc failed!\n");
-		}
+// Import hook mode. Rather than detouring each allocator, the import table slots which
+// other modules call it through are pointed at its hooks, see ImportTable.h. No code is
+// patched and no threads suspended, and calls go straight to the hook and from there to
+// the real function. Calls which don't go through an import are missed, like those from
+// inside the allocator's own module or from a copy of it linked in statically.
+bool importHooks = false;
 
-		if(MH_EnableHook((void*)symbolInfo->Address) != MH_OK){
-			printf("Enable malloc hook failed!\n");
-		}
+struct ImportHook{
+	void **slot;
+	void *original;
+	void *hook;
+	// A malloc rather than a free, only these are unpatched when pausing with unhook.
+	bool allocates;
+};
+std::vector<ImportHook> importHookSlots;
+// Cleared while paused with unhook or detached, when newly found slots are left alone.
+bool allocationHooksEnabled = true;
 
-		nUsedMallocHooks++;
+// The number of the hook for the function at address, or of the next unused hook if it
+// hasn't been hooked. Hooks stay created when Heapy detaches, attaching again reuses them.
+int findHook(void *address, void *const *targets, int nUsed){
+	for(int i = 0; i < nUsed; ++i){
+		if(targets[i] == address)
+			return i;
 	}
+	return nUsed;
+}
 
-	// Hook frees.
-	if(strcmp(symbolInfo->Name, "free") == 0){
-		if(nUsedFreeHooks >= numHooks){
-			printf("All free hooks used up!\n");
-			return true;
-		}
-		printf("Hooking free from module %s into free hook num %d.\n", moduleName, nUsedFreeHooks);
-		if(MH_CreateHook((void*)symbolInfo->Address, freeHooks[nUsedFreeHooks],  (void **)&originalFrees[nUsedFreeHooks]) != MH_OK){
-			printf("Create hook free failed!\n");
+// Hook the function called name at address with the next unused hook from hooks, or
+// enable its hook again if it has one from before detaching.
+template <typename Ptr>
+void createHook(const char *name, void *address, const char *moduleName, Ptr *hooks, Ptr *originals, void **targets, int &nUsed){
+	int hook = findHook(address, targets, nUsed);
+	if(hook < nUsed){
+		printf("Enabling %s hook num %d from module %s again.\n", name, hook, moduleName);
+		// Import hooks are patched again by patchImports. A hook which was an import
+		// hook last time has no detour yet.
+		if(importHooks)
+			return;
+		MH_STATUS status = MH_CreateHook(address, (void*)hooks[hook], (void **)&originals[hook]);
+		if((status != MH_OK && status != MH_ERROR_ALREADY_CREATED) || MH_EnableHook(address) != MH_OK)
+			printf("Enable %s hook failed!\n", name);
+		return;
+	}
+	if(nUsed >= numHooks){
+		printf("All %s hooks used up!\n", name);
+		return;
+	}
+	printf("Hooking %s from module %s into %s hook num %d.\n", name, moduleName, name, nUsed);
+	if(importHooks){
+		// Calls are redirected by patchImports once every target is known.
+		originals[nUsed] = (Ptr)address;
+	}else{
+		if(MH_CreateHook(address, (void*)hooks[nUsed],  (void **)&originals[nUsed]) != MH_OK){
+			printf("Create hook %s failed!\n", name);
 		}
 
-		if(MH_EnableHook((void*)symbolInfo->Address) != MH_OK){
-			printf("Enable free failed!\n");
+		if(MH_EnableHook(address) != MH_OK){
+			printf("Enable %s hook failed!\n", name);
 		}
+	}
 
-		nUsedFreeHooks++;
+	targets[nUsed] = address;
+	nUsed++;
+}
+
+template <typename Ptr>
+void createHook(const char *name, void *address, const char *moduleName, HookTable<Ptr> &table){
+	createHook(name, address, moduleName, table.hooks, table.originals, table.targets, table.nUsed);
+}
+
+// The allocator family hooked in header mode as well as malloc and free.
+const char *headerModeFunctions[] = {"calloc", "realloc", "_recalloc", "_expand", "_msize",
+	"_aligned_malloc", "_aligned_realloc", "_aligned_recalloc", "_aligned_msize", "_aligned_free"};
+
+// Hook a malloc or free, or in header mode one of the rest of the family, found in moduleName.
+void hookSymbol(const char *name, void *address, const char *moduleName){
+	std::lock_guard<std::mutex> lk(hookTableMutex);
+	PreventSelfProfile preventSelfProfile;
+
+	// Counters are kept per hook, name them after the module they were hooked in.
+	if(strcmp(name, "malloc") == 0){
+		int hook = findHook(address, mallocTargets, nUsedMallocHooks);
+		if(allocationCounters && hook < numHooks)
+			allocationCounters->setMallocModule(hook, moduleName);
+		createHook(name, address, moduleName, mallocHooks, originalMallocs, mallocTargets, nUsedMallocHooks);
+	}else if(strcmp(name, "free") == 0){
+		int hook = findHook(address, freeTargets, nUsedFreeHooks);
+		if(allocationCounters && hook < numHooks)
+			allocationCounters->setFreeModule(hook, moduleName);
+		createHook(name, address, moduleName, freeHooks, originalFrees, freeTargets, nUsedFreeHooks);
 	}
+	else if(!headerMode)
+		return;
+	else if(strcmp(name, "calloc") == 0)
+		createHook(name, address, moduleName, callocHooks);
+	else if(strcmp(name, "realloc") == 0)
+		createHook(name, address, moduleName, reallocHooks);
+	else if(strcmp(name, "_recalloc") == 0)
+		createHook(name, address, moduleName, recallocHooks);
+	else if(strcmp(name, "_expand") == 0)
+		createHook(name, address, moduleName, expandHooks);
+	else if(strcmp(name, "_msize") == 0)
+		createHook(name, address, moduleName, msizeHooks);
+	else if(strcmp(name, "_aligned_malloc") == 0)
+		createHook(name, address, moduleName, alignedMallocHooks);
+	else if(strcmp(name, "_aligned_realloc") == 0)
+		createHook(name, address, moduleName, alignedReallocHooks);
+	else if(strcmp(name, "_aligned_recalloc") == 0)
+		createHook(name, address, moduleName, alignedRecallocHooks);
+	else if(strcmp(name, "_aligned_msize") == 0)
+		createHook(name, address, moduleName, alignedMsizeHooks);
+	else if(strcmp(name, "_aligned_free") == 0)
+		createHook(name, address, moduleName, alignedFreeHooks);
+}
 
+#ifdef _WIN32
+// Callback which recieves addresses for mallocs/frees which we hook.
+BOOL CALLBACK enumSymbolsCallback(PSYMBOL_INFO symbolInfo, ULONG symbolSize, PVOID userContext){
+	hookSymbol(symbolInfo->Name, (void*)symbolInfo->Address, (PCSTR)userContext);
 	return true;
 }
 
@@ -152,52 +928,120 @@ BOOL CALLBACK enumModulesCallback(PCSTR ModuleName, DWORD_PTR BaseOfDll, PVOID U
 
 	SymEnumSymbols(GetCurrentProcess(), BaseOfDll, "malloc", enumSymbolsCallback, (void*)ModuleName);
 	SymEnumSymbols(GetCurrentProcess(), BaseOfDll, "free", enumSymbolsCallback, (void*)ModuleName);
+	if(headerMode){
+		for(const char *name : headerModeFunctions)
+			SymEnumSymbols(GetCurrentProcess(), BaseOfDll, name, enumSymbolsCallback, (void*)ModuleName);
+	}
 	return true;
 }
+#else
+// Inline hook mode. An allocator linked statically into the program or another library
+// is called directly rather than through the interposed malloc, so any other malloc and
+// free are detoured with MinHook as on Windows. Hook 0 stays the interposer's.
+//
+// In import hook mode the same functions are found, but only the GOT slots bound to them
+// are patched, along with those bound straight to libc's which bypass the interposer,
+// as in libraries opened with RTLD_DEEPBIND.
+bool inlineHooks = false;
+// The interposer already sees libc's, and our own would be hooking ourself.
+static void *ownModule = 0;
+static void *libcModule = 0;
 
-void printTopAllocationReport(int numToPrint){
+bool enumSymbolsCallback(const char *name, void *address, void *context){
+	Dl_info module;
+	if(dladdr(address, &module) && (module.dli_fbase == ownModule || module.dli_fbase == libcModule))
+		return true;
+	hookSymbol(name, address, (const char*)context);
+	return true;
+}
 
-	std::vector<std::pair<StackTrace, size_t>> allocsSortedBySize;
-	heapProfiler->getAllocationSiteReport(allocsSortedBySize);
+bool enumModulesCallback(const char *moduleName, const char *path, uintptr_t base, void *){
+	enumerateElfSymbols(path, base, "malloc", enumSymbolsCallback, (void*)moduleName);
+	enumerateElfSymbols(path, base, "free", enumSymbolsCallback, (void*)moduleName);
+	return true;
+}
+#endif
 
-	// Sort retured allocation sites by size of memory allocated, descending.
-	std::sort(allocsSortedBySize.begin(), allocsSortedBySize.end(), 
-		[](const std::pair<StackTrace, size_t> &a, const std::pair<StackTrace, size_t> &b){
-			return a.second < b.second;
-		}
-	);
-	
-
-	std::ofstream stream("Heapy_Profile.txt",  std::ios::out | std::ios::app);
-	stream << "=======================================\n\n";
-	stream << "Printing top allocation points.\n\n";
-	// Print top allocations sites in ascending order.
-	auto precision = std::setprecision(5);
-	size_t totalPrintedAllocSize = 0;
-	size_t numPrintedAllocations = 0;
-	double bytesInAMegaByte = 1024*1024;
-	for(size_t i = (size_t)(std::max)(int64_t(allocsSortedBySize.size())-numToPrint, int64_t(0)); i < allocsSortedBySize.size(); ++i){
-
-		if(allocsSortedBySize[i].second == 0)
+// Import hook mode, find the slots bound to a hooked malloc or free.
+template <typename Ptr>
+bool findImportHook(const char *name, const char *moduleName, void **slot, void *const *targets, Ptr *hooks, int nUsed, bool allocates){
+	for(int i = 0; i < nUsed; ++i){
+		if(!targets[i] || *slot != targets[i])
 			continue;
+		printf("Patching %s import of module %s into %s hook num %d.\n", name, moduleName, name, i);
+		ImportHook importHook = {slot, targets[i], (void*)hooks[i], allocates};
+		if(!replaceImportSlot(slot, importHook.original, importHook.hook)){
+			printf("Patching %s import of module %s failed!\n", name, moduleName);
+			return true;
+		}
+		// A module loaded where an unloaded one was can reuse the slot's address.
+		auto existing = std::find_if(importHookSlots.begin(), importHookSlots.end(),
+			[=](const ImportHook &other){ return other.slot == slot; });
+		if(existing != importHookSlots.end())
+			*existing = importHook;
+		else
+			importHookSlots.push_back(importHook);
+		return true;
+	}
+	return false;
+}
 
-		stream << "Alloc size " << precision << allocsSortedBySize[i].second/bytesInAMegaByte << "Mb, stack trace: \n";
-		allocsSortedBySize[i].first.print(stream);
-		stream << "\n";
+bool findImportHooksCallback(const char *moduleName, void **slot, void *){
+	if(!findImportHook("malloc", moduleName, slot, mallocTargets, mallocHooks, nUsedMallocHooks, true))
+		findImportHook("free", moduleName, slot, freeTargets, freeHooks, nUsedFreeHooks, false);
+	return true;
+}
 
-		totalPrintedAllocSize += allocsSortedBySize[i].second;
-		numPrintedAllocations++;
-	}
+// Point every loaded module's imports of the hooked mallocs and frees at their hooks.
+// Slots already patched no longer hold a target, so this is repeated with each report
+// to pick up modules loaded since.
+void patchImports(){
+	std::lock_guard<std::mutex> lk(hookTableMutex);
+	PreventSelfProfile preventSelfProfile;
+	if(allocationHooksEnabled)
+		enumerateImportSlots(findImportHooksCallback, NULL);
+}
 
-	size_t totalAlloctaions = std::accumulate(allocsSortedBySize.begin(), allocsSortedBySize.end(), size_t(0),
-		[](size_t a,  const std::pair<StackTrace, size_t> &b){
-			return a + b.second;
+// Patch or unpatch the functions which only allocate. Everything which can be handed an
+// existing block stays hooked, so frees are still recorded and headers still found.
+void setAllocationHooksEnabled(bool enabled){
+	std::lock_guard<std::mutex> lk(hookTableMutex);
+	if(importHooks){
+		for(const ImportHook &importHook : importHookSlots){
+			// Slots of modules unloaded since are skipped.
+			if(importHook.allocates && enabled)
+				replaceImportSlot(importHook.slot, importHook.original, importHook.hook);
+			else if(importHook.allocates)
+				replaceImportSlot(importHook.slot, importHook.hook, importHook.original);
 		}
-	);
+		allocationHooksEnabled = enabled;
+		return;
+	}
+	auto queue = [=](void *const *targets, int nUsed){
+		for(int i = 0; i < nUsed; ++i){
+			// The interposer's hook on Linux has no target to patch.
+			if(!targets[i])
+				continue;
+			if(enabled)
+				MH_QueueEnableHook(targets[i]);
+			else
+				MH_QueueDisableHook(targets[i]);
+		}
+	};
+	queue(mallocTargets, nUsedMallocHooks);
+	queue(callocHooks.targets, callocHooks.nUsed);
+	queue(alignedMallocHooks.targets, alignedMallocHooks.nUsed);
+	// Suspends the other threads once for the whole batch.
+	if(MH_ApplyQueued() != MH_OK)
+		printf("Could not %s the allocation hooks.\n", enabled ? "enable" : "disable");
+}
 
-	stream << "Top " << numPrintedAllocations << " allocations: " << precision <<  totalPrintedAllocSize/bytesInAMegaByte << "Mb\n";
-	stream << "Total allocations: " << precision << totalAlloctaions/bytesInAMegaByte << "Mb" << 
-		" (difference between total and top " << numPrintedAllocations << " allocations : " << (totalAlloctaions - totalPrintedAllocSize)/bytesInAMegaByte << "Mb)\n\n";
+unsigned long currentProcessId(){
+#ifdef _WIN32
+	return GetCurrentProcessId();
+#else
+	return (unsigned long)getpid();
+#endif
 }
 
 // Do an allocation report on exit.
@@ -213,30 +1057,379 @@ void printTopAllocationReport(int numToPrint){
 // Also: The end game will be send malloc/free information to a different
 // process instead of doing reports the same process - then shutdown issues go away.
 // But for now it's more fun to work inside the injected process.
+void writeReport(){
+	if(countingOnly){
+		// Give the file a buffer from the arena, as printTopAllocationReport does.
+		std::vector<char> buffer(64*1024);
+		std::ofstream stream("Heapy_Profile.txt", std::ios::out | std::ios::app);
+		stream.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+		allocationCounters->writeReport(stream);
+		return;
+	}
+
+	if(binaryMode)
+		writeProfileDump(heapProfiler, sampleInterval, currentProcessId(), "Heapy_Profile.bin");
+	else
+		printTopAllocationReport(heapProfiler, sampleInterval, 25);
+
+	if(pprofMode)
+		writePprofProfile(heapProfiler, sampleInterval, currentProcessId(), "Heapy_Profile.pb.gz");
+}
+
 struct CatchExit{
 	~CatchExit(){
 		PreventSelfProfile p;
-		printTopAllocationReport(25);
+		// Loaded to attach but never attached, or detached again.
+		if(!heapProfiler)
+			return;
+		if(eventStream)
+			eventStream->finish(10000);
+		else
+			writeReport();
 	}
 };
 CatchExit catchExit;
 
+// Wait up to ms before the next report, less if Heapy is detaching.
+void waitForReport(uint32_t ms){
+#ifdef _WIN32
+	WaitForSingleObject(detachEvent, ms);
+#else
+	std::unique_lock<std::mutex> lk(detachMutex);
+	detachCondition.wait_for(lk, std::chrono::milliseconds(ms), []{ return detaching.load(); });
+#endif
+}
+
+// Wait up to ms for the launcher to ask for full profiling.
+bool waitForFullProfile(uint32_t ms){
+#ifdef _WIN32
+	HANDLE events[] = {fullProfileEvent, detachEvent};
+	return WaitForMultipleObjects(2, events, FALSE, ms) == WAIT_OBJECT_0;
+#else
+	// Requested from a signal handler, which can't wake the condition, so it's checked after.
+	waitForReport(ms);
+	return fullProfileRequested;
+#endif
+}
+
 int heapProfileReportThread(){
 	PreventEverProfilingThisThread();
 	while(true){
-		Sleep(10000); 
-		printTopAllocationReport(25);
+		if(countingOnly){
+			if(waitForFullProfile(reportInterval)){
+				printf("Switching from counters to full profiling.\n");
+				countingOnly = false;
+			}
+		}else{
+			waitForReport(reportInterval);
+		}
+		// HeapyDetach writes the last report itself.
+		if(detaching)
+			return 0;
+		if(collectIdlePasses)
+			heapProfiler->collectDeadSites(collectIdlePasses);
+		if(importHooks)
+			patchImports();
+		writeReport();
+	}
+}
+
+int heapProfileAggregateThread(){
+	PreventEverProfilingThisThread();
+	while(!detaching){
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		heapProfiler->drainEventBuffers();
+	}
+	return 0;
+}
+
+// Options are passed from the Heapy launcher through environment variables.
+// Copies the variable into value, false if it isn't set or doesn't fit.
+bool getEnvironmentString(const char *name, char *value, size_t size){
+	if(attached){
+		size_t nameLength = strlen(name);
+		for(const char *option = attachOptions; option && *option; option += strlen(option) + 1){
+			if(strncmp(option, name, nameLength) == 0 && option[nameLength] == '='){
+				const char *optionValue = option + nameLength + 1;
+				if(!*optionValue || strlen(optionValue) >= size)
+					return false;
+				strcpy(value, optionValue);
+				return true;
+			}
+		}
+		return false;
+	}
+#ifdef _WIN32
+	DWORD len = GetEnvironmentVariableA(name, value, (DWORD)size);
+	return len > 0 && len < size;
+#else
+	const char *env = getenv(name);
+	if(!env || !*env || strlen(env) >= size)
+		return false;
+	strcpy(value, env);
+	return true;
+#endif
+}
+
+bool getEnvironmentFlag(const char *name){
+	char value[32];
+	return getEnvironmentString(name, value, sizeof(value)) && strcmp(value, "0") != 0;
+}
+
+size_t getEnvironmentValue(const char *name, size_t defaultValue){
+	char value[32];
+	if(!getEnvironmentString(name, value, sizeof(value)))
+		return defaultValue;
+	return (size_t)strtoull(value, 0, 10);
+}
+
+#ifndef _WIN32
+// On Linux the library is preloaded and its malloc and friends interpose libc's. Until
+// setup has finished they go straight through to libc, found with dlsym.
+std::atomic<bool> hooksInstalled(false);
+
+typedef int (*PtrPosixMemalign)(void **, size_t, size_t);
+PtrPosixMemalign originalPosixMemalign;
+PtrAlignedMalloc originalAlignedAlloc;
+PtrAlignedMalloc originalMemalign;
+PtrMalloc originalValloc;
+
+// dlsym can allocate before it has found malloc, those allocations come from here and
+// are never freed.
+static char bootstrapBuffer[64*1024] __attribute__((aligned(64)));
+static std::atomic<size_t> bootstrapUsed(0);
+static bool resolvingOriginals = false;
+
+static void *bootstrapAllocate(size_t size){
+	size = (size + 63) & ~(size_t)63;
+	size_t offset = bootstrapUsed.fetch_add(size);
+	if(size > sizeof(bootstrapBuffer) || offset > sizeof(bootstrapBuffer) - size)
+		return 0;
+	return bootstrapBuffer + offset;
+}
+
+static bool isBootstrapBlock(void *p){
+	return p >= bootstrapBuffer && p < bootstrapBuffer + sizeof(bootstrapBuffer);
+}
+
+// Look up libc's functions, false while the lookup itself is allocating.
+static bool resolveOriginals(){
+	if(originalMallocs[0])
+		return true;
+	if(resolvingOriginals)
+		return false;
+	resolvingOriginals = true;
+	originalFrees[0] = (PtrFree)dlsym(RTLD_NEXT, "free");
+	callocHooks.originals[0] = (PtrCalloc)dlsym(RTLD_NEXT, "calloc");
+	reallocHooks.originals[0] = (PtrRealloc)dlsym(RTLD_NEXT, "realloc");
+	originalPosixMemalign = (PtrPosixMemalign)dlsym(RTLD_NEXT, "posix_memalign");
+	originalAlignedAlloc = (PtrAlignedMalloc)dlsym(RTLD_NEXT, "aligned_alloc");
+	originalMemalign = (PtrAlignedMalloc)dlsym(RTLD_NEXT, "memalign");
+	originalValloc = (PtrMalloc)dlsym(RTLD_NEXT, "valloc");
+	// Set last, the rest are known to be there once it is.
+	originalMallocs[0] = (PtrMalloc)dlsym(RTLD_NEXT, "malloc");
+	resolvingOriginals = false;
+	return originalMallocs[0] != 0;
+}
+
+static void requestFullProfile(int){
+	fullProfileRequested = true;
+}
+
+// Only the launched program is profiled, as on Windows, so take the library back out of
+// the LD_PRELOAD its children inherit. The variable is edited in place since programs can
+// hold on to the environment main was given.
+static void removeFromPreload(){
+	char *preload = getenv("LD_PRELOAD");
+	if(!preload)
+		return;
+
+	std::string kept;
+	std::string list = preload;
+	size_t start = 0;
+	while(start < list.size()){
+		size_t end = (std::min)(list.find_first_of(": ", start), list.size());
+		std::string entry = list.substr(start, end - start);
+		size_t slash = entry.rfind('/');
+		if(!entry.empty() && entry.compare(slash == std::string::npos ? 0 : slash + 1, std::string::npos, "libheapy.so") != 0)
+			kept += (kept.empty() ? "" : ":") + entry;
+		start = end + 1;
+	}
+	strcpy(preload, kept.c_str());
+}
+#endif
+
+#ifdef _WIN32
+// Attach mode. Total up the blocks already allocated from the process's heaps, Heapy
+// never sees those being allocated.
+void countPreexistingAllocations(size_t &count, size_t &size){
+	count = 0;
+	size = 0;
+	HANDLE heaps[256];
+	DWORD numHeaps = (std::min)(GetProcessHeaps(256, heaps), (DWORD)256);
+	for(DWORD i = 0; i < numHeaps; ++i){
+		if(!HeapLock(heaps[i]))
+			continue;
+		PROCESS_HEAP_ENTRY entry;
+		entry.lpData = NULL;
+		while(HeapWalk(heaps[i], &entry)){
+			if(entry.wFlags & PROCESS_HEAP_ENTRY_BUSY){
+				++count;
+				size += entry.cbData;
+			}
+		}
+		HeapUnlock(heaps[i]);
+	}
+}
+
+// Whether the launcher is attaching to this process, rather than having launched it.
+bool isAttaching(){
+	HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, getAttachOptionsName(GetCurrentProcessId()).c_str());
+	if(mapping)
+		CloseHandle(mapping);
+	return mapping != 0;
+}
+
+// Attach mode. Copy the options the launcher left for us, false if it didn't.
+bool readAttachOptions(){
+	HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, getAttachOptionsName(GetCurrentProcessId()).c_str());
+	if(!mapping)
+		return false;
+	const char *view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if(view){
+		size_t length = 0;
+		while(view[length] || view[length + 1])
+			++length;
+		attachOptions = new char[length + 2];
+		memcpy(attachOptions, view, length + 2);
+		UnmapViewOfFile(view);
 	}
+	CloseHandle(mapping);
+	return view != 0;
+}
+#else
+// The launcher leaves the options in shared memory rather than a file mapping.
+bool isAttaching(){
+	int fd = shm_open(getAttachOptionsName(getpid()).c_str(), O_RDONLY, 0);
+	if(fd >= 0)
+		close(fd);
+	return fd >= 0;
+}
+
+bool readAttachOptions(){
+	int fd = shm_open(getAttachOptionsName(getpid()).c_str(), O_RDONLY, 0);
+	if(fd < 0)
+		return false;
+	struct stat info;
+	void *view = fstat(fd, &info) == 0 && info.st_size >= 2 ? mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if(view == MAP_FAILED)
+		return false;
+	attachOptions = new char[info.st_size];
+	memcpy(attachOptions, view, info.st_size);
+	attachOptions[info.st_size - 2] = attachOptions[info.st_size - 1] = 0;
+	munmap(view, info.st_size);
+	return true;
 }
+#endif
 
 void setupHeapProfiling(){
 	// We use printfs thoughout injection becasue it's just safer/less troublesome
 	// than iostreams for this sort of low-level/hacky/threaded work.
 	printf("Injecting library...\n");
 
-	nUsedMallocHooks = 0;
-	nUsedFreeHooks = 0;
+	bufferedMode = getEnvironmentFlag("HEAPY_BUFFERED");
+	sampleInterval = getEnvironmentValue("HEAPY_SAMPLE_RATE", 0);
+	binaryMode = getEnvironmentFlag("HEAPY_BINARY");
+	reportInterval = (uint32_t)getEnvironmentValue("HEAPY_REPORT_INTERVAL", 10000);
+	size_t collectAfter = getEnvironmentValue("HEAPY_COLLECT_SITES", 0);
+	if(collectAfter)
+		collectIdlePasses = (uint32_t)(std::max)((collectAfter + reportInterval - 1)/(reportInterval ? reportInterval : 1), (size_t)1);
+	pprofMode = getEnvironmentFlag("HEAPY_PPROF");
+	fullStackThreshold = getEnvironmentValue("HEAPY_ADAPTIVE_DEPTH", 0);
+	headerMode = getEnvironmentFlag("HEAPY_HEADERS");
+	importHooks = getEnvironmentFlag("HEAPY_IMPORT_HOOKS");
+	allocationHooksEnabled = true;
+	profilingEnabled = !getEnvironmentFlag("HEAPY_START_PAUSED");
+	bool countersMode = getEnvironmentFlag("HEAPY_COUNTERS");
+
+	setProfilerModule((void*)&setupHeapProfiling);
+	char unwinderName[32];
+	if(getEnvironmentString("HEAPY_UNWINDER", unwinderName, sizeof(unwinderName))){
+		UnwinderKind unwinder;
+		if(!parseUnwinder(unwinderName, unwinder))
+			printf("Unknown unwinder %s, using the default.\n", unwinderName);
+		else if(!setUnwinder(unwinder))
+			printf("The %s unwinder is not supported here, using the default.\n", unwinderName);
+	}
+
+	char streamName[260];
+	if(getEnvironmentString("HEAPY_STREAM", streamName, sizeof(streamName))){
+		EventStream *stream = EventStream::open(streamName);
+		if(stream)
+			eventStream = new EventStreamWriter(stream);
+		else
+			printf("Could not open event stream %s, profiling in process.\n", streamName);
+	}
 
+	// When streaming the site totals are in the launcher, there's nothing to adapt on here.
+	if(eventStream && fullStackThreshold){
+		printf("Adaptive stack depth is not supported out of process, capturing full stacks.\n");
+		fullStackThreshold = 0;
+	}
+
+	// Headers only work with the site totals in this process, and without a pointer table
+	// there's little left for buffering to save.
+#ifndef _WIN32
+	// Telling a block with a header from one without relies on catching faults.
+	if(headerMode){
+		printf("Header mode is only supported on Windows.\n");
+		headerMode = false;
+	}
+#endif
+	// Blocks allocated inside the CRT, which import hooks don't see, would lack a header.
+	if(headerMode && importHooks){
+		printf("Header mode needs inline hooks, not using import hooks.\n");
+		importHooks = false;
+	}
+	// Blocks with headers couldn't be freed once the hooks are gone.
+	if(headerMode && attached){
+		printf("Header mode is not supported when attaching.\n");
+		headerMode = false;
+	}
+	if(headerMode && eventStream){
+		printf("Header mode is not supported out of process.\n");
+		headerMode = false;
+	}
+	if(countersMode && eventStream){
+		printf("Counter mode is not supported out of process.\n");
+		countersMode = false;
+	}
+	if(countersMode){
+		// Created before any hooks so every hooked module gets a name.
+#ifdef _WIN32
+		fullProfileEvent = CreateEventA(NULL, TRUE, FALSE, getFullProfileEventName(GetCurrentProcessId()).c_str());
+		if(fullProfileEvent){
+			allocationCounters = new AllocationCounters();
+			countingOnly = true;
+		}else{
+			printf("Could not create the full profile event, profiling from the start.\n");
+		}
+#else
+		// The launcher asks for full profiling with SIGUSR1 instead of an event.
+		allocationCounters = new AllocationCounters();
+		allocationCounters->setMallocModule(0, "libc");
+		allocationCounters->setFreeModule(0, "libc");
+		signal(SIGUSR1, requestFullProfile);
+		countingOnly = true;
+#endif
+	}
+	if(headerMode && bufferedMode){
+		printf("Header mode records allocations directly, not buffering them.\n");
+		bufferedMode = false;
+	}
+
+#ifdef _WIN32
 	PreventEverProfilingThisThread();
 
 	// Create our hook pointer tables using template meta programming fu.
@@ -250,13 +1443,23 @@ void setupHeapProfiling(){
 		printf("SymInitialize failed\n");
 
 	// Yes this leaks - cleauing it up at application exit has zero real benefit.
-	// Might be able to clean it up on CatchExit but I don't see the point.
+	// Only HeapyDetach, when the process carries on without us, frees it.
 	heapProfiler = new HeapProfiler(); 
 
+	if(attached){
+		size_t count, size;
+		countPreexistingAllocations(count, size);
+		heapProfiler->setPreexistingAllocations(count, size);
+	}
+	// Hooks left from attaching before start using the new profiler once enabled again.
+	detaching = false;
+
 	// Trawl though loaded modules and hook any mallocs and frees we find.
 	SymEnumerateModules(GetCurrentProcess(), enumModulesCallback, NULL);
+	if(importHooks)
+		patchImports();
 
-	// Spawn and a new thread which prints allocation report every 10 seconds.
+	// Spawn and a new thread which prints allocation report every 10 seconds (by default.)
 	//
 	// We can't use std::thread here because of deadlock issues which can happen 
 	// when creating a thread in dllmain.
@@ -269,19 +1472,228 @@ void setupHeapProfiling(){
 	// TODO: Could we signal a different way, or awake the main thread from the dll thread
 	// and do the reports from the injeted thread. This was what EasyHook was doing.
 	// I feel like that might have some benefits (more stable?)
-	CreateThread(0, 0, (LPTHREAD_START_ROUTINE)&heapProfileReportThread, NULL, 0, NULL);
+	//
+	// When streaming, the launcher does the reports instead.
+	detachEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if(!eventStream)
+		reportThread = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)&heapProfileReportThread, NULL, 0, NULL);
+
+	// In buffered mode a sibling thread applies the per thread event buffers.
+	if(bufferedMode && !eventStream)
+		aggregateThread = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)&heapProfileAggregateThread, NULL, 0, NULL);
+#else
+	// Setup runs on the program's main thread here, which should still be profiled after.
+	PreventSelfProfile preventSelfProfile;
+
+	// When attaching the library was loaded with dlopen, which doesn't interpose anything.
+	if(!attached){
+		removeFromPreload();
+		if(!resolveOriginals()){
+			printf("Could not find malloc in libc, not profiling.\n");
+			return;
+		}
+	}
+	// Attaching again reuses the key.
+	static bool threadExitKeyCreated = false;
+	if(!threadExitKeyCreated)
+		pthread_key_create(&threadExitKey, threadExit);
+	threadExitKeyCreated = true;
+
+	heapProfiler = new HeapProfiler();
+	detaching = false;
+
+	// backtrace loads libgcc on its first call, which mustn't happen inside a hook.
+	void *warmup[1];
+	backtrace(warmup, 1);
+
+	inlineHooks = getEnvironmentFlag("HEAPY_INLINE_HOOKS");
+	if(inlineHooks && importHooks){
+		printf("Inline and import hooks can't be used together, using inline hooks.\n");
+		importHooks = false;
+	}
+	// Without the interposer libc's malloc and free have to be hooked like any other.
+	if(attached && !importHooks)
+		inlineHooks = true;
+	if(inlineHooks || importHooks){
+		Dl_info module;
+		if(dladdr((void*)&setupHeapProfiling, &module))
+			ownModule = module.dli_fbase;
+		if(!attached && dladdr((void*)originalMallocs[0], &module))
+			libcModule = module.dli_fbase;
+
+		InitNHooks<numHooks>::initHook();
+		if(inlineHooks)
+			MH_Initialize();
+		// Hook 0 is the interposer's. Attaching again finds the hooks from before.
+		if(!attached){
+			nUsedMallocHooks = 1;
+			nUsedFreeHooks = 1;
+		}
+		if(importHooks && !attached){
+			mallocTargets[0] = (void*)originalMallocs[0];
+			freeTargets[0] = (void*)originalFrees[0];
+		}
+		enumerateElfModules(enumModulesCallback, NULL);
+		if(importHooks)
+			patchImports();
+	}
+
+	if(!eventStream)
+		pthread_create(&reportThread, 0, [](void *) -> void* { heapProfileReportThread(); return 0; }, 0);
+	if(bufferedMode && !eventStream)
+		pthread_create(&aggregateThread, 0, [](void *) -> void* { heapProfileAggregateThread(); return 0; }, 0);
+
+	// Everything the hooks use is ready, start recording.
+	hooksInstalled = true;
+#endif
+}
+
+// Attach mode, set up once the launcher has loaded the library. False if Heapy is
+// already profiling or the launcher left no options.
+bool attachHeapProfiling(){
+	if(heapProfiler || !readAttachOptions())
+		return false;
+	attached = true;
+	setupHeapProfiling();
+	return true;
+}
+
+// Attach mode. Removes the hooks, waits for every thread to have left them, writes a last
+// report and frees everything the profiler holds. The library stays loaded with its hooks
+// created but disabled, as a thread can still be on its way into one, and attaching again
+// enables them. False if Heapy isn't attached, or if called from inside a hook, which the
+// launcher can do on Linux where it borrows one of the program's threads.
+bool detachHeapProfiling(){
+	PreventSelfProfile preventSelfProfile;
+	if(!attached || !heapProfiler || threadHookDepth)
+		return false;
+
+	// New calls go straight to the real allocators from here.
+	{
+		// Also stops the report thread patching any more.
+		std::lock_guard<std::mutex> lk(hookTableMutex);
+		for(const ImportHook &importHook : importHookSlots)
+			replaceImportSlot(importHook.slot, importHook.hook, importHook.original);
+		importHookSlots.clear();
+		allocationHooksEnabled = false;
+	}
+	MH_DisableHook(MH_ALL_HOOKS);
+
+	// Calls already on their way into a hook leave the profiler alone from here, wait for
+	// those which are using it. Stops the report and aggregate threads too.
+	detaching = true;
+	waitForHooks();
+#ifdef _WIN32
+	SetEvent(detachEvent);
+	for(HANDLE thread : {reportThread, aggregateThread}){
+		if(thread){
+			WaitForSingleObject(thread, INFINITE);
+			CloseHandle(thread);
+		}
+	}
+	reportThread = aggregateThread = 0;
+#else
+	{
+		std::lock_guard<std::mutex> lk(detachMutex);
+		detachCondition.notify_all();
+	}
+	for(pthread_t thread : {reportThread, aggregateThread}){
+		if(thread)
+			pthread_join(thread, 0);
+	}
+	reportThread = aggregateThread = 0;
+#endif
+	writeReport();
+
+#ifdef _WIN32
+	SymCleanup(GetCurrentProcess());
+	// Forgets the symbols looked up too, the modules may have changed by the next attach.
+	setSymbolProcess(GetCurrentProcess());
+#else
+	setSymbolProcess(0);
+#endif
+
+	// Threads still holding a buffer or counters drop them from here on.
+	attachment++;
+	delete heapProfiler;
+	heapProfiler = 0;
+	delete allocationCounters;
+	allocationCounters = 0;
+	countingOnly = false;
+#ifdef _WIN32
+	if(fullProfileEvent)
+		CloseHandle(fullProfileEvent);
+	fullProfileEvent = 0;
+	CloseHandle(detachEvent);
+	detachEvent = 0;
+#endif
+	delete [] attachOptions;
+	attachOptions = 0;
+	// Left set, and detaching too, as hooks can still be called until attaching again.
+	printf("Heapy detached.\n");
+	return true;
 }
 
 extern "C"{
 
+// Control over profiling from the profiled program, which can find these with
+// GetProcAddress on the HeapyInject dll. While paused allocations aren't recorded, but
+// frees are so the live totals stay right. With unhook non zero the allocation
+// functions are unpatched as well, so allocating costs nothing at all until resumed.
+// On Linux the interposed functions can't be unpatched, so unhook only applies to inline
+// and import hooks.
+__declspec(dllexport) void __cdecl HeapyPauseProfiling(int unhook){
+	PreventSelfProfile preventSelfProfile;
+	profilingEnabled = false;
+#ifdef _WIN32
+	if(unhook)
+#else
+	if(unhook && (inlineHooks || importHooks))
+#endif
+		setAllocationHooksEnabled(false);
+}
+
+__declspec(dllexport) void __cdecl HeapyResumeProfiling(){
+	PreventSelfProfile preventSelfProfile;
+	// Enabling hooks which are already enabled is harmless.
+#ifdef _WIN32
+	setAllocationHooksEnabled(true);
+#else
+	if(inlineHooks || importHooks)
+		setAllocationHooksEnabled(true);
+#endif
+	profilingEnabled = true;
+}
+
+#ifdef _WIN32
+#ifdef _M_IX86
+// The launcher looks these up by their plain names, which stdcall decorates on x86.
+#pragma comment(linker, "/EXPORT:HeapyAttach=_HeapyAttach@4")
+#pragma comment(linker, "/EXPORT:HeapyDetach=_HeapyDetach@4")
+#endif
+
+// Attach mode, called by the launcher on a thread of its own once the dll is loaded.
+__declspec(dllexport) DWORD WINAPI HeapyAttach(LPVOID){
+	return attachHeapProfiling();
+}
+
+// Attach mode, called by the launcher on a thread of its own to end profiling.
+__declspec(dllexport) DWORD WINAPI HeapyDetach(LPVOID){
+	PreventEverProfilingThisThread();
+	return detachHeapProfiling();
+}
+
 BOOL APIENTRY DllMain(HANDLE hModule, DWORD reasonForCall, LPVOID lpReserved){
 	switch (reasonForCall){
 		case DLL_PROCESS_ATTACH:
-			setupHeapProfiling();
+			// When attaching the launcher calls HeapyAttach instead, outside the loader lock.
+			if(!isAttaching())
+				setupHeapProfiling();
 		break;
 		case DLL_THREAD_ATTACH:
 		break;
 		case DLL_THREAD_DETACH:
+			detachThread();
 		break;
 		case DLL_PROCESS_DETACH:
 		break;
@@ -289,5 +1701,110 @@ BOOL APIENTRY DllMain(HANDLE hModule, DWORD reasonForCall, LPVOID lpReserved){
 
 	return TRUE;
 }
+#else
+void *malloc(size_t size){
+	if(!hooksInstalled.load(std::memory_order_acquire))
+		return resolveOriginals() ? originalMallocs[0](size) : bootstrapAllocate(size);
+	return mallocHook<0>(size);
+}
+
+void free(void *p){
+	if(isBootstrapBlock(p))
+		return;
+	if(!hooksInstalled.load(std::memory_order_acquire)){
+		if(resolveOriginals())
+			originalFrees[0](p);
+		return;
+	}
+	freeHook<0>(p);
+}
+
+void *calloc(size_t count, size_t size){
+	if(count && size > (size_t)-1 / count){
+		errno = ENOMEM;
+		return 0;
+	}
+	// The bootstrap buffer starts out zeroed.
+	if(!hooksInstalled.load(std::memory_order_acquire))
+		return resolveOriginals() ? callocHooks.originals[0](count, size) : bootstrapAllocate(count*size);
+	PtrCalloc original = callocHooks.originals[0];
+	return hookAllocation(0, count*size, [=](size_t n){ return original(1, n); });
+}
+
+void *realloc(void *p, size_t size){
+	if(isBootstrapBlock(p)){
+		void *block = malloc(size);
+		if(block)
+			memcpy(block, p, (std::min)(size, (size_t)(bootstrapBuffer + sizeof(bootstrapBuffer) - (char*)p)));
+		return block;
+	}
+	if(!hooksInstalled.load(std::memory_order_acquire))
+		return resolveOriginals() ? reallocHooks.originals[0](p, size) : bootstrapAllocate(size);
+
+	// The old block is recorded as freed before it can be handed out again. If the
+	// reallocation fails it stays allocated, untracked.
+	PtrRealloc original = reallocHooks.originals[0];
+	if(p && size == 0){
+		hookFree(0, p, [=](void *block){ original(block, 0); });
+		return 0;
+	}
+	if(p)
+		hookFree(0, p, [](void *){});
+	return hookAllocation(0, size, [=](size_t n){ return original(p, n); });
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size){
+	if(!hooksInstalled.load(std::memory_order_acquire))
+		return resolveOriginals() ? originalPosixMemalign(out, alignment, size) : ENOMEM;
+	PtrPosixMemalign original = originalPosixMemalign;
+	int result = 0;
+	void *p = hookAllocation(0, size, [&](size_t n){
+		void *block = 0;
+		result = original(&block, alignment, n);
+		return block;
+	});
+	if(result == 0)
+		*out = p;
+	return result;
+}
+
+void *aligned_alloc(size_t alignment, size_t size){
+	if(!hooksInstalled.load(std::memory_order_acquire))
+		return resolveOriginals() ? originalAlignedAlloc(alignment, size) : 0;
+	PtrAlignedMalloc original = originalAlignedAlloc;
+	return hookAllocation(0, size, [=](size_t n){ return original(alignment, n); });
+}
+
+void *memalign(size_t alignment, size_t size){
+	if(!hooksInstalled.load(std::memory_order_acquire))
+		return resolveOriginals() ? originalMemalign(alignment, size) : 0;
+	PtrAlignedMalloc original = originalMemalign;
+	return hookAllocation(0, size, [=](size_t n){ return original(alignment, n); });
+}
+
+void *valloc(size_t size){
+	if(!hooksInstalled.load(std::memory_order_acquire))
+		return resolveOriginals() ? originalValloc(size) : 0;
+	PtrMalloc original = originalValloc;
+	return hookAllocation(0, size, original);
+}
+
+// Attach mode. The launcher stops one of the program's threads with ptrace and has it
+// call these, so they return rather than run on a thread of their own. 1 on success.
+__declspec(dllexport) int HeapyAttach(){
+	return attachHeapProfiling();
+}
+
+// Also 0 when the thread was stopped inside a hook, the launcher tries again later.
+__declspec(dllexport) int HeapyDetach(){
+	return detachHeapProfiling();
+}
+
+__attribute__((constructor)) static void preloadHeapProfiling(){
+	// When attaching the launcher calls HeapyAttach once dlopen has returned.
+	if(!isAttaching())
+		setupHeapProfiling();
+}
+#endif
 
 }
\ No newline at end of file
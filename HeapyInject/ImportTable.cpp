@@ -0,0 +1,202 @@
+#include "ImportTable.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <tlhelp32.h>
+#else
+#include <elf.h>
+#include <errno.h>
+#include <link.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <stdint.h>
+
+#ifdef _WIN32
+static bool enumerateModuleImports(const char *moduleName, uint8_t *imageBase, ImportSlotCallback callback, void *context){
+	IMAGE_DOS_HEADER *dosHeader = (IMAGE_DOS_HEADER*)imageBase;
+	if(dosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+		return true;
+	IMAGE_NT_HEADERS *ntHeaders = (IMAGE_NT_HEADERS*)(imageBase + dosHeader->e_lfanew);
+	if(ntHeaders->Signature != IMAGE_NT_SIGNATURE || ntHeaders->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR_MAGIC)
+		return true;
+
+	const IMAGE_DATA_DIRECTORY &directory = ntHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+	if(!directory.VirtualAddress)
+		return true;
+	const IMAGE_IMPORT_DESCRIPTOR *descriptor = (const IMAGE_IMPORT_DESCRIPTOR*)(imageBase + directory.VirtualAddress);
+	for(; descriptor->Name; ++descriptor){
+		// FirstThunk is the copy the loader fills in with addresses, the other keeps the names.
+		IMAGE_THUNK_DATA *thunk = (IMAGE_THUNK_DATA*)(imageBase + descriptor->FirstThunk);
+		for(; thunk->u1.Function; ++thunk){
+			if(!callback(moduleName, (void**)&thunk->u1.Function, context))
+				return false;
+		}
+	}
+	return true;
+}
+
+void enumerateImportSlots(ImportSlotCallback callback, void *context){
+	HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, GetCurrentProcessId());
+	if(snapshot == INVALID_HANDLE_VALUE)
+		return;
+
+	MODULEENTRY32W entry;
+	entry.dwSize = sizeof(entry);
+	for(BOOL more = Module32FirstW(snapshot, &entry); more; more = Module32NextW(snapshot, &entry)){
+		char moduleName[MAX_PATH];
+		if(!WideCharToMultiByte(CP_ACP, 0, entry.szModule, -1, moduleName, sizeof(moduleName), NULL, NULL))
+			continue;
+		// Keeps the module loaded while its table is walked, which may be after the snapshot.
+		HMODULE module;
+		if(!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)entry.modBaseAddr, &module))
+			continue;
+		bool carryOn = enumerateModuleImports(moduleName, entry.modBaseAddr, callback, context);
+		FreeLibrary(module);
+		if(!carryOn)
+			break;
+	}
+	CloseHandle(snapshot);
+}
+
+bool replaceImportSlot(void **slot, void *expected, void *value){
+	MEMORY_BASIC_INFORMATION memoryInfo;
+	if(!VirtualQuery(slot, &memoryInfo, sizeof(memoryInfo)) || memoryInfo.State != MEM_COMMIT || memoryInfo.Type != MEM_IMAGE)
+		return false;
+	// Some linkers merge the IAT into an executable section, which has to stay executable.
+	const DWORD executable = PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY;
+	DWORD writable = (memoryInfo.Protect & executable) ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE;
+
+	DWORD oldProtect;
+	if(!VirtualProtect(slot, sizeof(void*), writable, &oldProtect))
+		return false;
+	bool replaced = InterlockedCompareExchangePointer(slot, value, expected) == expected;
+	VirtualProtect(slot, sizeof(void*), oldProtect, &oldProtect);
+	return replaced;
+}
+#else
+// The relocations which bind a GOT slot to a function in another object.
+#if defined __x86_64__
+static const uint32_t jumpSlotRelocation = R_X86_64_JUMP_SLOT;
+static const uint32_t globalDataRelocation = R_X86_64_GLOB_DAT;
+#elif defined __aarch64__
+static const uint32_t jumpSlotRelocation = R_AARCH64_JUMP_SLOT;
+static const uint32_t globalDataRelocation = R_AARCH64_GLOB_DAT;
+#else
+#define NO_IMPORT_SLOTS
+#endif
+
+struct ImportEnumeration{
+	ImportSlotCallback callback;
+	void *context;
+	bool first;
+};
+
+#ifndef NO_IMPORT_SLOTS
+static bool enumerateRelocationSlots(const char *moduleName, uintptr_t base, const ElfW(Rela) *relocation, size_t size, ImportEnumeration *enumeration){
+	const ElfW(Rela) *end = (const ElfW(Rela)*)((const char*)relocation + size);
+	for(; relocation < end; ++relocation){
+		uint32_t type = ELF64_R_TYPE(relocation->r_info);
+		if(type != jumpSlotRelocation && type != globalDataRelocation)
+			continue;
+		if(!enumeration->callback(moduleName, (void**)(base + relocation->r_offset), enumeration->context))
+			return false;
+	}
+	return true;
+}
+#endif
+
+static int enumerateImportsCallback(dl_phdr_info *info, size_t, void *data){
+	ImportEnumeration *enumeration = (ImportEnumeration*)data;
+
+	// The program comes first, without a name.
+	const char *moduleName = program_invocation_short_name;
+	if(!enumeration->first)
+		moduleName = strrchr(info->dlpi_name, '/') ? strrchr(info->dlpi_name, '/') + 1 : info->dlpi_name;
+	enumeration->first = false;
+
+#ifndef NO_IMPORT_SLOTS
+	const ElfW(Dyn) *dynamic = 0;
+	for(int i = 0; i < info->dlpi_phnum; ++i){
+		if(info->dlpi_phdr[i].p_type == PT_DYNAMIC)
+			dynamic = (const ElfW(Dyn)*)(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+	}
+	if(!dynamic)
+		return 0;
+
+	uintptr_t relocations = 0, relocationsSize = 0, pltRelocations = 0, pltRelocationsSize = 0, pltRelocationType = 0;
+	for(; dynamic->d_tag != DT_NULL; ++dynamic){
+		switch(dynamic->d_tag){
+			case DT_RELA: relocations = dynamic->d_un.d_ptr; break;
+			case DT_RELASZ: relocationsSize = dynamic->d_un.d_val; break;
+			case DT_JMPREL: pltRelocations = dynamic->d_un.d_ptr; break;
+			case DT_PLTRELSZ: pltRelocationsSize = dynamic->d_un.d_val; break;
+			case DT_PLTREL: pltRelocationType = dynamic->d_un.d_val; break;
+		}
+	}
+
+	// glibc relocates these addresses in place, except where the dynamic section is read
+	// only as in the vdso.
+	uintptr_t base = info->dlpi_addr;
+	if(relocations && relocations < base)
+		relocations += base;
+	if(pltRelocations && pltRelocations < base)
+		pltRelocations += base;
+
+	if(relocations && !enumerateRelocationSlots(moduleName, base, (const ElfW(Rela)*)relocations, relocationsSize, enumeration))
+		return 1;
+	if(pltRelocations && pltRelocationType == DT_RELA &&
+	   !enumerateRelocationSlots(moduleName, base, (const ElfW(Rela)*)pltRelocations, pltRelocationsSize, enumeration))
+		return 1;
+#endif
+	return 0;
+}
+
+void enumerateImportSlots(ImportSlotCallback callback, void *context){
+	ImportEnumeration enumeration = {callback, context, true};
+	dl_iterate_phdr(enumerateImportsCallback, &enumeration);
+}
+
+struct SlotReplacement{
+	void **slot;
+	void *expected;
+	void *value;
+	bool replaced;
+};
+
+// Runs with the dynamic linker's lock held, so the object can't be unloaded under it.
+static int replaceSlotCallback(dl_phdr_info *info, size_t, void *data){
+	SlotReplacement *replacement = (SlotReplacement*)data;
+	uintptr_t address = (uintptr_t)replacement->slot;
+	bool loaded = false, readOnly = false;
+	uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+	for(int i = 0; i < info->dlpi_phnum; ++i){
+		const ElfW(Phdr) &header = info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + header.p_vaddr;
+		if(header.p_type == PT_LOAD && start <= address && address < start + header.p_memsz)
+			loaded = true;
+		// RELRO makes the GOT read only once bound. Only whole pages are protected, the
+		// same rounding the dynamic linker uses.
+		if(header.p_type == PT_GNU_RELRO && (start & ~(pageSize - 1)) <= address && address < ((start + header.p_memsz) & ~(pageSize - 1)))
+			readOnly = true;
+	}
+	if(!loaded)
+		return 0;
+
+	void *page = (void*)(address & ~(pageSize - 1));
+	if(readOnly && mprotect(page, pageSize, PROT_READ | PROT_WRITE) != 0)
+		return 1;
+	replacement->replaced = __atomic_compare_exchange_n(replacement->slot, &replacement->expected, replacement->value,
+		false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	if(readOnly)
+		mprotect(page, pageSize, PROT_READ);
+	return 1;
+}
+
+bool replaceImportSlot(void **slot, void *expected, void *value){
+	SlotReplacement replacement = {slot, expected, value, false};
+	dl_iterate_phdr(replaceSlotCallback, &replacement);
+	return replacement.replaced;
+}
+#endif
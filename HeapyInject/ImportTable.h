@@ -0,0 +1,20 @@
+#pragma once
+
+// The import tables of the loaded modules: the IAT on Windows, the GOT on Linux. Calls
+// to a function in another module jump through a slot in the caller's table holding its
+// address, so pointing the slot somewhere else redirects those calls without patching
+// any code. Calls from inside the function's own module don't use a slot.
+
+// Called with each slot and the file name of the module calling through it. The slot
+// holds the address the loader bound it to. Return false to stop the enumeration.
+typedef bool (*ImportSlotCallback)(const char *moduleName, void **slot, void *context);
+
+// Calls callback for every import slot of every module currently loaded. On Linux only
+// slots the dynamic linker has already bound are useful, which with lazy binding means
+// ones which have been called at least once, unless LD_BIND_NOW is set.
+void enumerateImportSlots(ImportSlotCallback callback, void *context);
+
+// Atomically replace expected in slot with value, making its page writable for the
+// duration if needs be. Fails if the slot holds anything else, or its module has since
+// been unloaded, so a slot remembered from an earlier enumeration is safe to pass.
+bool replaceImportSlot(void **slot, void *expected, void *value);
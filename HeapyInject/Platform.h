@@ -0,0 +1,14 @@
+#pragma once
+
+// Heapy is written for MSVC. Elsewhere the few declaration specifiers it uses are
+// spelled as the matching attributes, so the shared code builds unchanged.
+#ifndef _MSC_VER
+#define __declspec(x) __declspec_##x
+#define __declspec_thread __thread
+#define __declspec_noinline __attribute__((noinline))
+#define __declspec_dllexport __attribute__((visibility("default")))
+#define __declspec_align(n) __attribute__((aligned(n)))
+#ifndef __cdecl
+#define __cdecl
+#endif
+#endif
@@ -0,0 +1,30 @@
+#include "PointerFilter.h"
+#include "Arena.h"
+
+PointerFilter::PointerFilter() : lowest(~(size_t)0), highest(0){
+	// Fresh pages from the arena are already zero and only committed as they are touched.
+	words = (std::atomic<uint64_t>*)arenaAllocateZeroed(sizeof(uint64_t) << wordBits);
+}
+
+PointerFilter::~PointerFilter(){
+	arenaFree(words);
+}
+
+void PointerFilter::add(void *ptr){
+	// Callers add a pointer before handing it out, and whatever passes it to the thread
+	// which frees it orders the add before that free, so relaxed is enough here.
+	uint64_t mask;
+	size_t word = locate(ptr, mask);
+	// Most pages are already in, only write when something changes so the words aren't
+	// bounced between cores.
+	if((words[word].load(std::memory_order_relaxed) & mask) != mask)
+		words[word].fetch_or(mask, std::memory_order_relaxed);
+
+	size_t address = (size_t)ptr;
+	size_t low = lowest.load(std::memory_order_relaxed);
+	while(address < low && !lowest.compare_exchange_weak(low, address, std::memory_order_relaxed)){
+	}
+	size_t high = highest.load(std::memory_order_relaxed);
+	while(address > high && !highest.compare_exchange_weak(high, address, std::memory_order_relaxed)){
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Lock free filter over the pages which have ever held a tracked allocation, so frees
+// of pointers Heapy never saw, allocated before it was injected or by a runtime it
+// doesn't hook, can be turned away without locking a shard of the pointer table.
+// A blocked bloom filter: each page sets two bits in one 64 bit word, so a lookup is
+// a range check and a single load. Pages are never removed, a false positive just
+// takes the slow path.
+class PointerFilter{
+public:
+	PointerFilter();
+	~PointerFilter();
+
+	void add(void *ptr);
+
+	// False if no pointer in the same page has ever been added.
+	bool mayContain(void *ptr) const{
+		size_t address = (size_t)ptr;
+		if(address < lowest.load(std::memory_order_relaxed) || address > highest.load(std::memory_order_relaxed))
+			return false;
+		uint64_t mask;
+		size_t word = locate(ptr, mask);
+		return (words[word].load(std::memory_order_relaxed) & mask) == mask;
+	}
+
+private:
+	static const size_t pageBits = 12;
+	// 2^16 words, 512KB, keeps false positives to a few percent for a few hundred
+	// thousand pages, a gigabyte or so of heap.
+	static const size_t wordBits = 16;
+
+	static size_t locate(void *ptr, uint64_t &mask){
+		uint64_t h = ((uint64_t)(size_t)ptr >> pageBits) * 0x9E3779B97F4A7C15ULL;
+		mask = (1ULL << (h & 63)) | (1ULL << ((h >> 6) & 63));
+		return (size_t)(h >> (64 - wordBits));
+	}
+
+	std::atomic<size_t> lowest;
+	std::atomic<size_t> highest;
+	std::atomic<uint64_t> *words;
+
+	PointerFilter(const PointerFilter&);
+	PointerFilter& operator=(const PointerFilter&);
+};
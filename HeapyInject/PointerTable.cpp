@@ -0,0 +1,173 @@
+#include "PointerTable.h"
+#include "Arena.h"
+
+PointerTable::PointerTable()
+	: entries(0), capacity(0), count(0), oldEntries(0), oldCapacity(0), oldCount(0), migrateStart(0), migrated(0){
+}
+
+PointerTable::~PointerTable(){
+	arenaFree(entries);
+	arenaFree(oldEntries);
+}
+
+size_t PointerTable::hashPointer(void *ptr){
+	// Allocations are aligned and clustered, which identity hashing handles badly.
+	// Drop the alignment bits and mix the rest with the murmur3 finaliser so every
+	// bit of the address affects the slot.
+	uint64_t h = (uint64_t)(size_t)ptr >> 4;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return (size_t)h;
+}
+
+size_t PointerTable::findSlot(const Entry *table, size_t capacity, void *ptr, size_t start){
+	size_t mask = capacity - 1;
+	for(size_t i = start; table[i].ptr; i = (i + 1) & mask){
+		if(table[i].ptr == ptr)
+			return i;
+	}
+	return notFound;
+}
+
+size_t PointerTable::find(void *ptr) const {
+	return capacity ? findSlot(entries, capacity, ptr, hashPointer(ptr) & (capacity - 1)) : notFound;
+}
+
+void PointerTable::place(Entry *table, size_t capacity, void *ptr, uint64_t value){
+	size_t mask = capacity - 1;
+	size_t i = hashPointer(ptr) & mask;
+	while(table[i].ptr)
+		i = (i + 1) & mask;
+	table[i].ptr = ptr;
+	table[i].value = value;
+}
+
+void PointerTable::eraseSlot(Entry *table, size_t capacity, size_t slot){
+	// Pull later entries of the run back into the hole wherever that doesn't move
+	// them before their home slot, so lookups never have to step over deleted slots.
+	// In the old table runs stop short of the migrated slots, which are all empty.
+	size_t mask = capacity - 1;
+	size_t hole = slot;
+	for(size_t i = (slot + 1) & mask; table[i].ptr; i = (i + 1) & mask){
+		size_t home = hashPointer(table[i].ptr) & mask;
+		if(((i - home) & mask) >= ((i - hole) & mask)){
+			table[hole] = table[i];
+			hole = i;
+		}
+	}
+	table[hole].ptr = 0;
+}
+
+void PointerTable::grow(){
+	// At migrateStep slots per operation the last resize is done long before the
+	// table fills up again, but make sure of it.
+	if(oldEntries)
+		migrate(oldCapacity);
+
+	oldEntries = entries;
+	oldCapacity = capacity;
+	oldCount = count;
+
+	// Start migrating from an empty slot so no run wraps around past the cursor.
+	migrateStart = 0;
+	while(oldCapacity && oldEntries[migrateStart].ptr)
+		++migrateStart;
+	migrated = 0;
+
+	// Large tables come straight from fresh zeroed pages, which aren't touched
+	// until entries land in them.
+	capacity = capacity ? capacity*2 : minCapacity;
+	entries = (Entry*)arenaAllocateZeroed(capacity*sizeof(Entry));
+	count = 0;
+}
+
+void PointerTable::migrate(size_t slots){
+	if(!oldEntries)
+		return;
+
+	// Slots are emptied in order from migrateStart without shifting anything back,
+	// so the old table stays valid as long as lookups skip the migrated slots, see
+	// findOld. Runs are moved across from their start so none is ever split.
+	size_t mask = oldCapacity - 1;
+	for(size_t n = 0; n < slots && migrated < oldCapacity; ++n, ++migrated){
+		Entry &entry = oldEntries[(migrateStart + migrated) & mask];
+		if(entry.ptr){
+			place(entries, capacity, entry.ptr, entry.value);
+			++count;
+			entry.ptr = 0;
+			--oldCount;
+		}
+	}
+
+	if(oldCount == 0){
+		arenaFree(oldEntries);
+		oldEntries = 0;
+		oldCapacity = 0;
+	}
+}
+
+size_t PointerTable::findOld(void *ptr) const {
+	if(!oldEntries)
+		return notFound;
+
+	// A pointer whose home slot has been migrated can only still be in the old table
+	// further along the same run, past the migrated slots.
+	size_t mask = oldCapacity - 1;
+	size_t home = hashPointer(ptr) & mask;
+	if(((home - migrateStart) & mask) < migrated)
+		home = (migrateStart + migrated) & mask;
+	return findSlot(oldEntries, oldCapacity, ptr, home);
+}
+
+bool PointerTable::insert(void *ptr, StackId stack, size_t size){
+	if(!ptr)
+		return false;
+
+	migrate(migrateStep);
+	if(find(ptr) != notFound || findOld(ptr) != notFound)
+		return false;
+
+	// Keep the load under three quarters so runs stay short.
+	if((count + 1)*4 > capacity*3)
+		grow();
+
+	place(entries, capacity, ptr, (uint64_t)stack << 36 | (uint64_t)size);
+	++count;
+	return true;
+}
+
+bool PointerTable::remove(void *ptr, StackId &stack, size_t &size){
+	migrate(migrateStep);
+
+	Entry *table = entries;
+	size_t tableCapacity = capacity;
+	size_t slot = find(ptr);
+	if(slot == notFound){
+		table = oldEntries;
+		tableCapacity = oldCapacity;
+		slot = findOld(ptr);
+		if(slot == notFound)
+			return false;
+	}
+
+	uint64_t value = table[slot].value;
+	stack = (StackId)(value >> 36);
+	size = (size_t)(value & maxSize);
+	eraseSlot(table, tableCapacity, slot);
+	if(table == entries)
+		--count;
+	else
+		--oldCount;
+	return true;
+}
+
+size_t PointerTable::size() const {
+	return count + oldCount;
+}
+
+size_t PointerTable::memoryUsage() const {
+	return (capacity + oldCapacity)*sizeof(Entry);
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "StackTable.h"
+
+// Hash table from live pointers to the site which allocated them and their size.
+// Slots are 16 bytes stored inline, rather than a heap node per pointer as in
+// std::unordered_map. The table is a power of two kept between 3/8 and 3/4 full, so
+// each live pointer costs 21 to 43 bytes, plus the old table's while growing.
+// Linear probing with backward shift deletion so there are no tombstones, and growing
+// is incremental: after a resize the old entries are moved across a few at a time by
+// later operations, so no one malloc pays for the whole rehash. Not thread safe,
+// HeapProfiler keeps one per shard under the shard's lock.
+class PointerTable{
+public:
+	// Sizes are packed into 36 bits next to a 28 bit stack id, enough for every site
+	// the site table can hold. Bigger allocations have to be recorded as maxSize.
+	static const uint64_t maxSize = (1ULL << 36) - 1;
+
+	PointerTable();
+	~PointerTable();
+
+	// Returns false if ptr is already in the table, or is null.
+	bool insert(void *ptr, StackId stack, size_t size);
+
+	// Returns false if ptr isn't in the table.
+	bool remove(void *ptr, StackId &stack, size_t &size);
+
+	size_t size() const;
+
+	// Bytes allocated for the table itself.
+	size_t memoryUsage() const;
+
+	// Spreads clustered, aligned addresses over every bit.
+	static size_t hashPointer(void *ptr);
+
+private:
+	struct Entry{
+		void *ptr;
+		uint64_t value;
+	};
+
+	static const size_t minCapacity = 16;
+	// Slots of the old table moved across by each operation while growing.
+	static const size_t migrateStep = 4;
+	static const size_t notFound = ~(size_t)0;
+
+	static size_t findSlot(const Entry *table, size_t capacity, void *ptr, size_t start);
+	static void place(Entry *table, size_t capacity, void *ptr, uint64_t value);
+	static void eraseSlot(Entry *table, size_t capacity, size_t slot);
+
+	size_t find(void *ptr) const;
+	size_t findOld(void *ptr) const;
+	void grow();
+	void migrate(size_t slots);
+
+	Entry *entries;
+	size_t capacity;
+	size_t count;
+
+	// Table being emptied into entries after a resize. The migrated slots from
+	// migrateStart onwards are already empty.
+	Entry *oldEntries;
+	size_t oldCapacity;
+	size_t oldCount;
+	size_t migrateStart;
+	size_t migrated;
+
+	PointerTable(const PointerTable&);
+	PointerTable& operator=(const PointerTable&);
+};
@@ -0,0 +1,252 @@
+#include "PprofExport.h"
+#include "HeapProfiler.h"
+#include "ProfileDump.h"
+#include "GzipWriter.h"
+
+#include <time.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <algorithm>
+
+// Field numbers from profile.proto. Repeated fields can come in any order, which is
+// what lets samples be written before the locations and strings they refer to.
+namespace Field{
+	enum Profile{
+		sampleType = 1, sample = 2, mapping = 3, location = 4, function = 5, stringTable = 6,
+		timeNanos = 9, periodType = 11, period = 12, defaultSampleType = 14
+	};
+	enum ValueType{ valueType = 1, valueUnit = 2 };
+	enum Sample{ sampleLocationId = 1, sampleValue = 2 };
+	enum Mapping{
+		mappingId = 1, memoryStart = 2, memoryLimit = 3, mappingFilename = 5,
+		hasFunctions = 7, hasFilenames = 8, hasLineNumbers = 9
+	};
+	enum Location{ locationId = 1, locationMappingId = 2, address = 3, line = 4 };
+	enum Line{ lineFunctionId = 1, lineNumber = 2 };
+	enum Function{ functionId = 1, functionName = 2, systemName = 3, functionFilename = 4 };
+}
+
+static void putVarint(std::string &out, uint64_t value){
+	while(value >= 0x80){
+		out.push_back((char)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((char)value);
+}
+
+// Zero is the default for every field so it is left out.
+static void putUint(std::string &out, int field, uint64_t value){
+	if(!value)
+		return;
+	putVarint(out, (uint64_t)field << 3);
+	putVarint(out, value);
+}
+
+static void putBytes(std::string &out, int field, const std::string &bytes){
+	putVarint(out, (uint64_t)field << 3 | 2);
+	putVarint(out, bytes.size());
+	out += bytes;
+}
+
+// Writes top level fields of a Profile message into a gzip stream, and numbers the
+// strings and locations the messages refer to.
+class PprofWriter{
+public:
+	PprofWriter(std::ostream &stream) : gzip(stream){
+		// String zero is always the empty string.
+		stringId("");
+	}
+
+	uint64_t stringId(const std::string &s){
+		auto it = stringIds.find(s);
+		if(it != stringIds.end())
+			return it->second;
+		strings.push_back(s);
+		return stringIds[s] = strings.size() - 1;
+	}
+
+	// Location ids start from one.
+	uint64_t locationId(void *address){
+		auto it = locationIds.find(address);
+		if(it != locationIds.end())
+			return it->second;
+		locations.push_back(address);
+		return locationIds[address] = locations.size();
+	}
+
+	const std::vector<void*> &getLocations() const {
+		return locations;
+	}
+
+	void putMessage(int field, const std::string &message){
+		scratch.clear();
+		putBytes(scratch, field, message);
+		gzip.write(scratch.data(), scratch.size());
+	}
+
+	void putField(int field, uint64_t value){
+		scratch.clear();
+		putUint(scratch, field, value);
+		gzip.write(scratch.data(), scratch.size());
+	}
+
+	// Write out the string table and finish the stream, every string is known by now.
+	void finish(){
+		for(const std::string &s : strings)
+			putMessage(Field::stringTable, s);
+		gzip.finish();
+	}
+
+private:
+	GzipWriter gzip;
+	std::string scratch;
+	std::vector<std::string> strings;
+	std::unordered_map<std::string, uint64_t> stringIds;
+	std::vector<void*> locations;
+	std::unordered_map<void*, uint64_t> locationIds;
+};
+
+bool writePprofProfile(HeapProfiler *heapProfiler, size_t sampleInterval, unsigned long processId, const char *path){
+	// Make sure anything still sitting in thread buffers is included.
+	heapProfiler->drainEventBuffers();
+
+	std::vector<ProfileDump::Module> modules;
+	getProcessModules(processId, modules);
+	std::sort(modules.begin(), modules.end(),
+		[](const ProfileDump::Module &a, const ProfileDump::Module &b){
+			return a.base < b.base;
+		}
+	);
+
+	std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	if(!file)
+		return false;
+	PprofWriter writer(file);
+	std::string message;
+
+	const char *sampleTypes[4][2] = {
+		{"alloc_objects", "count"}, {"alloc_space", "bytes"}, {"inuse_objects", "count"}, {"inuse_space", "bytes"}
+	};
+	for(int i = 0; i < 4; ++i){
+		message.clear();
+		putUint(message, Field::valueType, writer.stringId(sampleTypes[i][0]));
+		putUint(message, Field::valueUnit, writer.stringId(sampleTypes[i][1]));
+		writer.putMessage(Field::sampleType, message);
+	}
+
+	// One sample per site, in the same order as the sample types.
+	const StackTable &stackTable = heapProfiler->getStackTable();
+	size_t numSites = heapProfiler->getNumSites();
+	std::string locationIds, values;
+	for(size_t i = 0; i < numSites; ++i){
+		SiteStats stats = heapProfiler->getSiteStats((StackId)i);
+		if(!stats.allocatedCount)
+			continue;
+
+		void *const *frames = stackTable.frames((StackId)i);
+		size_t depth = stackTable.depth((StackId)i);
+		locationIds.clear();
+		for(size_t f = 0; f < depth && frames[f]; ++f)
+			putVarint(locationIds, writer.locationId(frames[f]));
+
+		values.clear();
+		putVarint(values, stats.allocatedCount);
+		putVarint(values, stats.allocatedSize);
+		putVarint(values, stats.liveCount);
+		putVarint(values, stats.liveSize);
+
+		message.clear();
+		putBytes(message, Field::sampleLocationId, locationIds);
+		putBytes(message, Field::sampleValue, values);
+		writer.putMessage(Field::sample, message);
+	}
+
+	// Sites which have been collected only have their allocation totals left, by caller.
+	std::vector<CollectedSite> collected;
+	heapProfiler->getCollectedSites(collected);
+	for(const CollectedSite &site : collected){
+		locationIds.clear();
+		if(site.caller)
+			putVarint(locationIds, writer.locationId(site.caller));
+
+		values.clear();
+		putVarint(values, site.allocatedCount);
+		putVarint(values, site.allocatedSize);
+		putVarint(values, 0);
+		putVarint(values, 0);
+
+		message.clear();
+		putBytes(message, Field::sampleLocationId, locationIds);
+		putBytes(message, Field::sampleValue, values);
+		writer.putMessage(Field::sample, message);
+	}
+
+	for(size_t m = 0; m < modules.size(); ++m){
+		message.clear();
+		putUint(message, Field::mappingId, m + 1);
+		putUint(message, Field::memoryStart, modules[m].base);
+		putUint(message, Field::memoryLimit, modules[m].base + modules[m].size);
+		putUint(message, Field::mappingFilename, writer.stringId(modules[m].path));
+		putUint(message, Field::hasFunctions, 1);
+		putUint(message, Field::hasFilenames, 1);
+		putUint(message, Field::hasLineNumbers, 1);
+		writer.putMessage(Field::mapping, message);
+	}
+
+	// Symbolise every address in one batch, then write a location for each of them and
+	// a function for each symbol the first time it comes up.
+	const std::vector<void*> &locations = writer.getLocations();
+	resolveSymbols(locations);
+	std::unordered_map<std::string, uint64_t> functionIds;
+	std::string line;
+	for(size_t l = 0; l < locations.size(); ++l){
+		uint64_t address = (uint64_t)(size_t)locations[l];
+		auto module = std::upper_bound(modules.begin(), modules.end(), address,
+			[](uint64_t a, const ProfileDump::Module &m){
+				return a < m.base;
+			}
+		);
+		uint64_t mappingId = 0;
+		if(module != modules.begin() && address < (module - 1)->base + (module - 1)->size)
+			mappingId = (module - modules.begin());
+
+		message.clear();
+		putUint(message, Field::locationId, l + 1);
+		putUint(message, Field::locationMappingId, mappingId);
+		putUint(message, Field::address, address);
+
+		SymbolInfo symbol;
+		if(getSymbol(locations[l], symbol)){
+			uint64_t &functionId = functionIds[symbol.name + '\0' + symbol.file];
+			if(!functionId){
+				functionId = functionIds.size();
+				std::string function;
+				putUint(function, Field::functionId, functionId);
+				putUint(function, Field::functionName, writer.stringId(symbol.name));
+				putUint(function, Field::systemName, writer.stringId(symbol.name));
+				putUint(function, Field::functionFilename, writer.stringId(symbol.file));
+				writer.putMessage(Field::function, function);
+			}
+
+			line.clear();
+			putUint(line, Field::lineFunctionId, functionId);
+			putUint(line, Field::lineNumber, symbol.line);
+			putBytes(message, Field::line, line);
+		}
+		writer.putMessage(Field::location, message);
+	}
+
+	message.clear();
+	putUint(message, Field::valueType, writer.stringId("space"));
+	putUint(message, Field::valueUnit, writer.stringId("bytes"));
+	writer.putMessage(Field::periodType, message);
+	writer.putField(Field::period, sampleInterval);
+	writer.putField(Field::timeNanos, (uint64_t)time(0) * 1000000000ULL);
+	writer.putField(Field::defaultSampleType, writer.stringId("inuse_space"));
+
+	writer.finish();
+	return (bool)file;
+}
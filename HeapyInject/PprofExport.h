@@ -0,0 +1,9 @@
+#pragma once
+#include <stddef.h>
+
+class HeapProfiler;
+
+// Write the profiler's sites to path as a gzipped pprof profile.proto with alloc_objects,
+// alloc_space, inuse_objects and inuse_space sample types. Samples are encoded straight
+// from the profiler's tables as they are read. Mappings are the modules of processId.
+bool writePprofProfile(HeapProfiler *heapProfiler, size_t sampleInterval, unsigned long processId, const char *path);
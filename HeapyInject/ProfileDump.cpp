@@ -0,0 +1,177 @@
+#include "ProfileDump.h"
+#include "HeapProfiler.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <tlhelp32.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <fstream>
+
+static const char dumpMagic[8] = {'H', 'E', 'A', 'P', 'Y', 'D', 'M', 'P'};
+// 2 leaves out the profiler's own frames, which 1 started every stack with.
+static const uint32_t dumpVersion = 2;
+
+template <typename T>
+static void writeValue(std::ostream &stream, T value){
+	stream.write((const char*)&value, sizeof(T));
+}
+
+template <typename T>
+static bool readValue(std::istream &stream, T &value){
+	return (bool)stream.read((char*)&value, sizeof(T));
+}
+
+#ifdef _WIN32
+void getProcessModules(unsigned long processId, std::vector<ProfileDump::Module> &modules){
+	modules.clear();
+	HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE | TH32CS_SNAPMODULE32, processId);
+	if(snapshot == INVALID_HANDLE_VALUE)
+		return;
+
+	MODULEENTRY32W entry;
+	entry.dwSize = sizeof(entry);
+	for(BOOL more = Module32FirstW(snapshot, &entry); more; more = Module32NextW(snapshot, &entry)){
+		// dbghelp wants narrow paths when we load the modules back in.
+		char path[MAX_PATH];
+		if(!WideCharToMultiByte(CP_ACP, 0, entry.szExePath, -1, path, sizeof(path), NULL, NULL))
+			continue;
+
+		ProfileDump::Module module;
+		module.base = (uint64_t)(size_t)entry.modBaseAddr;
+		module.size = entry.modBaseSize;
+		module.path = path;
+		modules.push_back(module);
+	}
+	CloseHandle(snapshot);
+}
+#else
+void getProcessModules(unsigned long processId, std::vector<ProfileDump::Module> &modules){
+	modules.clear();
+	std::ifstream maps("/proc/" + std::to_string(processId) + "/maps");
+
+	// Each line is: start-end perms offset device inode path
+	std::string line;
+	while(std::getline(maps, line)){
+		unsigned long long start, end, offset;
+		int pathStart = 0;
+		if(sscanf(line.c_str(), "%llx-%llx %*s %llx %*s %*s %n", &start, &end, &offset, &pathStart) < 3 ||
+		   !pathStart || line[pathStart] != '/')
+			continue;
+
+		// A module is mapped in consecutive pieces, starting from the beginning of its file.
+		std::string path = line.substr(pathStart);
+		if(!modules.empty() && modules.back().path == path){
+			modules.back().size = end - modules.back().base;
+			continue;
+		}
+		if(offset != 0)
+			continue;
+
+		ProfileDump::Module module;
+		module.base = start;
+		module.size = end - start;
+		module.path = path;
+		modules.push_back(module);
+	}
+}
+#endif
+
+bool writeProfileDump(HeapProfiler *heapProfiler, size_t sampleInterval, unsigned long processId, const char *path){
+	// Make sure anything still sitting in thread buffers is included.
+	heapProfiler->drainEventBuffers();
+
+	std::vector<ProfileDump::Module> modules;
+	getProcessModules(processId, modules);
+
+	std::ofstream stream(path, std::ios::out | std::ios::binary | std::ios::app);
+	if(!stream)
+		return false;
+
+	// Every site's stack is already in the stack table by the time the site exists.
+	const StackTable &stackTable = heapProfiler->getStackTable();
+	size_t numSites = heapProfiler->getNumSites();
+	std::vector<CollectedSite> collected;
+	heapProfiler->getCollectedSites(collected);
+
+	stream.write(dumpMagic, sizeof(dumpMagic));
+	writeValue<uint32_t>(stream, dumpVersion);
+	writeValue<uint32_t>(stream, sizeof(void*));
+	writeValue<uint64_t>(stream, (uint64_t)time(0));
+	writeValue<uint64_t>(stream, sampleInterval);
+	writeValue<uint32_t>(stream, (uint32_t)modules.size());
+	writeValue<uint32_t>(stream, (uint32_t)(numSites + collected.size()));
+
+	for(const ProfileDump::Module &module : modules){
+		writeValue<uint64_t>(stream, module.base);
+		writeValue<uint64_t>(stream, module.size);
+		writeValue<uint32_t>(stream, (uint32_t)module.path.size());
+		stream.write(module.path.data(), module.path.size());
+	}
+
+	for(size_t i = 0; i < numSites; ++i){
+		SiteStats stats = heapProfiler->getSiteStats((StackId)i);
+		size_t depth = stackTable.depth((StackId)i);
+		void *const *frames = stackTable.frames((StackId)i);
+
+		writeValue<uint32_t>(stream, (uint32_t)depth);
+		writeValue<uint64_t>(stream, stats.liveSize);
+		writeValue<uint64_t>(stream, stats.liveCount);
+		writeValue<uint64_t>(stream, stats.allocatedSize);
+		writeValue<uint64_t>(stream, stats.allocatedCount);
+		for(size_t f = 0; f < depth; ++f)
+			writeValue<uint64_t>(stream, (uint64_t)(size_t)frames[f]);
+	}
+
+	// Sites which have been collected follow as a stack of just the caller.
+	for(const CollectedSite &site : collected){
+		writeValue<uint32_t>(stream, site.caller ? 1 : 0);
+		writeValue<uint64_t>(stream, 0);
+		writeValue<uint64_t>(stream, 0);
+		writeValue<uint64_t>(stream, site.allocatedSize);
+		writeValue<uint64_t>(stream, site.allocatedCount);
+		if(site.caller)
+			writeValue<uint64_t>(stream, (uint64_t)(size_t)site.caller);
+	}
+
+	return (bool)stream;
+}
+
+bool readProfileDump(std::istream &stream, ProfileDump &dump){
+	char magic[sizeof(dumpMagic)];
+	uint32_t version;
+	if(!stream.read(magic, sizeof(magic)) || memcmp(magic, dumpMagic, sizeof(magic)) != 0)
+		return false;
+	if(!readValue(stream, version) || version != dumpVersion)
+		return false;
+
+	uint32_t numModules, numSites;
+	if(!readValue(stream, dump.pointerSize) || !readValue(stream, dump.timestamp) || !readValue(stream, dump.sampleInterval) ||
+	   !readValue(stream, numModules) || !readValue(stream, numSites))
+		return false;
+
+	dump.modules.resize(numModules);
+	for(ProfileDump::Module &module : dump.modules){
+		uint32_t pathLength;
+		if(!readValue(stream, module.base) || !readValue(stream, module.size) || !readValue(stream, pathLength))
+			return false;
+		module.path.resize(pathLength);
+		if(pathLength && !stream.read(&module.path[0], pathLength))
+			return false;
+	}
+
+	dump.sites.resize(numSites);
+	for(ProfileDump::Site &site : dump.sites){
+		uint32_t depth;
+		if(!readValue(stream, depth) || !readValue(stream, site.liveSize) || !readValue(stream, site.liveCount) ||
+		   !readValue(stream, site.allocatedSize) || !readValue(stream, site.allocatedCount))
+			return false;
+		site.frames.resize(depth);
+		if(depth && !stream.read((char*)&site.frames[0], depth*sizeof(uint64_t)))
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <istream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+class HeapProfiler;
+
+// Compact binary snapshot of a profile. Stacks are kept as raw addresses which, along
+// with the modules loaded at the time, are enough to symbolise them later and elsewhere.
+//
+// A dump file is a sequence of snapshots, each one is:
+//   header:  "HEAPYDMP", version, pointer size, timestamp, sample interval,
+//            number of modules, number of sites
+//   modules: base, size, path length, path
+//   sites:   depth, live size, live count, allocated size, allocated count, frames
+// Sites collected by HeapProfiler::collectDeadSites come last, with just their caller.
+// All numbers are little endian, frames and sizes are 64 bit whatever the process.
+struct ProfileDump{
+	struct Module{
+		uint64_t base;
+		uint64_t size;
+		std::string path;
+	};
+	struct Site{
+		uint64_t liveSize;
+		uint64_t liveCount;
+		uint64_t allocatedSize;
+		uint64_t allocatedCount;
+		std::vector<uint64_t> frames;
+	};
+
+	uint32_t pointerSize;
+	// Seconds since 1970.
+	uint64_t timestamp;
+	uint64_t sampleInterval;
+	std::vector<Module> modules;
+	// Indexed by stack id, followed by any collected sites.
+	std::vector<Site> sites;
+};
+
+// Modules currently loaded in the process with processId.
+void getProcessModules(unsigned long processId, std::vector<ProfileDump::Module> &modules);
+
+// Append a snapshot of the profiler's sites to the dump file at path, streamed straight
+// from the profiler's tables. The module map is taken from the process with processId.
+bool writeProfileDump(HeapProfiler *heapProfiler, size_t sampleInterval, unsigned long processId, const char *path);
+
+// Read the next snapshot from a dump file. Returns false at the end of the file or if
+// the file is not a dump.
+bool readProfileDump(std::istream &stream, ProfileDump &dump);
@@ -0,0 +1,105 @@
+#include "Report.h"
+#include "HeapProfiler.h"
+#include "Arena.h"
+
+#include <stdint.h>
+#include <vector>
+#include <numeric>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+
+static const size_t reportBufferSize = 64*1024;
+
+void printTopAllocationReport(HeapProfiler *heapProfiler, size_t sampleInterval, int numToPrint){
+	// Make sure anything still sitting in thread buffers is included.
+	heapProfiler->drainEventBuffers();
+
+	std::vector<std::pair<StackId, size_t>> topAllocs;
+	size_t totalSize = heapProfiler->getTopAllocationSites(numToPrint, topAllocs);
+
+	// Hand the file a buffer from the arena before the first write, otherwise the
+	// runtime allocates one from the heap being profiled.
+	std::vector<char> buffer(reportBufferSize);
+	std::ofstream stream("Heapy_Profile.txt",  std::ios::out | std::ios::app);
+	stream.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+	writeTopAllocationReport(stream, heapProfiler->getStackTable(), topAllocs, totalSize, sampleInterval);
+
+	ArenaUsage usage = getArenaUsage();
+	double bytesInAMegaByte = 1024*1024;
+	stream << "Memory used by Heapy itself: " << std::setprecision(5) << usage.used/bytesInAMegaByte << "Mb" <<
+		" (" << usage.committed/bytesInAMegaByte << "Mb committed)\n";
+	if(heapProfiler->getPreexistingCount()){
+		stream << "Allocated before Heapy attached, untracked: " << heapProfiler->getPreexistingCount() << " blocks, " <<
+			heapProfiler->getPreexistingSize()/bytesInAMegaByte << "Mb\n";
+	}
+	stream << "Frees of untracked pointers: " << heapProfiler->getUntrackedFrees() <<
+		(sampleInterval ? " (including allocations which weren't sampled)" : "") << "\n\n";
+}
+
+size_t selectTopAllocationSites(std::vector<std::pair<StackId, size_t>> &allocs, size_t count){
+	size_t totalSize = std::accumulate(allocs.begin(), allocs.end(), size_t(0),
+		[](size_t a,  const std::pair<StackId, size_t> &b){
+			return a + b.second;
+		}
+	);
+
+	// Move the biggest sites to the front, then only sort those.
+	auto biggerSite = [](const std::pair<StackId, size_t> &a, const std::pair<StackId, size_t> &b){
+		return a.second > b.second;
+	};
+	if(allocs.size() > count){
+		std::nth_element(allocs.begin(), allocs.begin() + count, allocs.end(), biggerSite);
+		allocs.resize(count);
+	}
+	allocs.erase(std::remove_if(allocs.begin(), allocs.end(),
+		[](const std::pair<StackId, size_t> &a){
+			return a.second == 0;
+		}
+	), allocs.end());
+	std::sort(allocs.begin(), allocs.end(),
+		[](const std::pair<StackId, size_t> &a, const std::pair<StackId, size_t> &b){
+			return a.second < b.second;
+		}
+	);
+	return totalSize;
+}
+
+void writeTopAllocationReport(std::ostream &stream, const StackTable &stackTable,
+                              const std::vector<std::pair<StackId, size_t>> &topAllocs, size_t totalSize, size_t sampleInterval){
+	stream << "=======================================\n\n";
+	stream << "Printing top allocation points.\n\n";
+	if(sampleInterval)
+		stream << "Sizes are estimated from sampling roughly one allocation every " << sampleInterval << " bytes.\n\n";
+
+	// Resolve the symbols of every frame we are about to print in one go, most will
+	// already be cached from earlier reports.
+	std::vector<void*> frames;
+	for(size_t i = 0; i < topAllocs.size(); ++i){
+		void *const *stackFrames = stackTable.frames(topAllocs[i].first);
+		frames.insert(frames.end(), stackFrames, stackFrames + stackTable.depth(topAllocs[i].first));
+	}
+	resolveSymbols(frames);
+
+	// Print top allocations sites in ascending order.
+	auto precision = std::setprecision(5);
+	size_t totalPrintedAllocSize = 0;
+	size_t numPrintedAllocations = 0;
+	double bytesInAMegaByte = 1024*1024;
+	for(size_t i = 0; i < topAllocs.size(); ++i){
+
+		if(topAllocs[i].second == 0)
+			continue;
+
+		stream << "Alloc size " << precision << topAllocs[i].second/bytesInAMegaByte << "Mb, stack trace: \n";
+		stackTable.print(topAllocs[i].first, stream);
+		stream << "\n";
+
+		totalPrintedAllocSize += topAllocs[i].second;
+		numPrintedAllocations++;
+	}
+
+	stream << "Top " << numPrintedAllocations << " allocations: " << precision <<  totalPrintedAllocSize/bytesInAMegaByte << "Mb\n";
+	stream << "Total allocations: " << precision << totalSize/bytesInAMegaByte << "Mb" << 
+		" (difference between total and top " << numPrintedAllocations << " allocations : " << (totalSize - totalPrintedAllocSize)/bytesInAMegaByte << "Mb)\n\n";
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <stddef.h>
+#include <ostream>
+#include <vector>
+
+#include "StackTable.h"
+
+class HeapProfiler;
+
+// Append the top allocating sites to Heapy_Profile.txt in the working directory.
+// A non zero sampleInterval notes that sizes are estimates from sampling.
+void printTopAllocationReport(HeapProfiler *heapProfiler, size_t sampleInterval, int numToPrint);
+
+// Cut allocs down to the count biggest sites, smallest first, and return the amount of
+// memory allocated by all of them. For when the sites are not in a HeapProfiler.
+size_t selectTopAllocationSites(std::vector<std::pair<StackId, size_t>> &allocs, size_t count);
+
+// Write a report on the top sites, as returned by HeapProfiler::getTopAllocationSites or
+// selectTopAllocationSites. Their stacks are in stackTable.
+void writeTopAllocationReport(std::ostream &stream, const StackTable &stackTable,
+                              const std::vector<std::pair<StackId, size_t>> &topAllocs, size_t totalSize, size_t sampleInterval);
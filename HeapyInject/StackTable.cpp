@@ -0,0 +1,468 @@
+#include "StackTable.h"
+#include "Unwinder.h"
+
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <Windows.h>
+#include "dbghelp.h"
+#else
+#include "ElfSymbols.h"
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <cxxabi.h>
+#include <sstream>
+#endif
+
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define HEAPY_SSE2
+#endif
+
+static void *symbolProcess = 0;
+
+// Symbols for every address looked up so far, shared by all reports so frames like
+// main or the CRT startup are only resolved once. Addresses without a symbol are
+// cached with an empty name. Never freed, the last report is written from a static
+// destructor which can run after this file's.
+static std::mutex symbolCacheMutex;
+static std::unordered_map<void*, SymbolInfo> &symbolCache = *new std::unordered_map<void*, SymbolInfo>();
+
+void setSymbolProcess(void *process){
+	std::lock_guard<std::mutex> lk(symbolCacheMutex);
+	symbolProcess = process;
+	symbolCache.clear();
+}
+
+StackTrace::StackTrace() : depth(0), hash(0), repeated(false){
+	memset(backtrace, 0, sizeof(void*)*backtraceSize);
+}
+
+// Most frames of the profiler's own there can be above the allocating function: trace,
+// the hook, and the hook's entry point and interposer.
+static const size_t maxProfilerFrames = 8;
+
+// Heapy only captures stacks here, so the thread's previous capture was its last trace.
+static __declspec( thread ) StackHash lastTraceHash = 0;
+
+void StackTrace::trace(size_t maxDepth){
+	// The profiler's frames are captured too and then dropped, so the stack starts at the
+	// function which allocated and still gets maxDepth frames of it.
+	void *frames[backtraceSize + maxProfilerFrames];
+	maxDepth = (std::min)(maxDepth, (size_t)backtraceSize);
+	size_t captured = captureStack(frames, maxDepth + maxProfilerFrames, &repeated);
+	size_t skipped = countProfilerFrames(frames, captured);
+	depth = (std::min)(captured - skipped, maxDepth);
+	memcpy(backtrace, frames + skipped, depth*sizeof(void*));
+	if(repeated)
+		hash = lastTraceHash;
+	else
+		computeHash();
+	lastTraceHash = hash;
+}
+
+void StackTrace::computeHash(){
+	// Compute simple polynomial hash of the stack trace.
+	// Note: CaptureStackBackTrace returns plain sum of all pointers as BackTraceHash.
+	const size_t BASE = sizeof(size_t) > 4 ? 11400714819323198485ULL : 2654435769U;
+	hash = 0;
+	for (size_t i = 0; i < depth; i++)
+		hash = hash * BASE + (size_t)backtrace[i];
+}
+
+void StackTrace::print(std::ostream &stream) const {
+	printStackFrames(backtrace, depth, stream);
+}
+
+#ifdef _WIN32
+static SymbolInfo lookupSymbol(void *process, void *address){
+	const int MAXSYMBOLNAME = 128 - sizeof(IMAGEHLP_SYMBOL);
+	char symbol64_buf[sizeof(IMAGEHLP_SYMBOL) + MAXSYMBOLNAME] = {0};
+	IMAGEHLP_SYMBOL *symbol = reinterpret_cast<IMAGEHLP_SYMBOL*>(symbol64_buf);
+	symbol->SizeOfStruct = sizeof(IMAGEHLP_SYMBOL);
+	symbol->MaxNameLength = MAXSYMBOLNAME - 1;
+
+	SymbolInfo info;
+	info.line = 0;
+	if(!SymGetSymFromAddr(process, (DWORD64)address, 0, symbol))
+		return info;
+	info.name = symbol->Name;
+
+	// Filename + line info if available.
+	IMAGEHLP_LINE lineSymbol = {0};
+	lineSymbol.SizeOfStruct = sizeof(IMAGEHLP_LINE);
+	DWORD displacement;
+	if(SymGetLineFromAddr(process, (DWORD64)address, &displacement, &lineSymbol)){
+		info.file = lineSymbol.FileName;
+		info.line = lineSymbol.LineNumber;
+	}
+	return info;
+}
+#else
+// Where another process had each of its modules mapped, refreshed for each batch
+// unless they came from a dump.
+static std::vector<ProfileDump::Module> symbolModules;
+static bool dumpModules = false;
+
+static SymbolInfo lookupSymbol(void *process, void *address){
+	// Only dynamic symbols for the current process. Another process, the target in out
+	// of process mode, or the modules of a dump have their files read for their full
+	// symbol tables. Functions
+	// without a symbol get their module and offset instead, which addr2line can resolve.
+	SymbolInfo info;
+	info.line = 0;
+	const char *path = 0;
+	uintptr_t base = 0;
+	std::string symbolName;
+	if(process || dumpModules){
+		for(const ProfileDump::Module &module : symbolModules){
+			if((uintptr_t)address >= module.base && (uintptr_t)address - module.base < module.size){
+				path = module.path.c_str();
+				base = (uintptr_t)module.base;
+			}
+		}
+		if(!path)
+			return info;
+		findElfSymbol(path, base, (uintptr_t)address, symbolName);
+	}else{
+		Dl_info dl;
+		if(!dladdr(address, &dl) || !dl.dli_fname)
+			return info;
+		path = dl.dli_fname;
+		base = (uintptr_t)dl.dli_fbase;
+		if(dl.dli_sname)
+			symbolName = dl.dli_sname;
+	}
+
+	if(!symbolName.empty()){
+		int status;
+		char *demangled = abi::__cxa_demangle(symbolName.c_str(), 0, 0, &status);
+		info.name = status == 0 ? demangled : symbolName;
+		::free(demangled);
+	}else{
+		const char *module = strrchr(path, '/');
+		std::ostringstream name;
+		name << (module ? module + 1 : path) << "+0x" << std::hex << ((uintptr_t)address - base);
+		info.name = name.str();
+	}
+	return info;
+}
+#endif
+
+void resolveSymbols(std::vector<void*> addresses){
+#ifdef _WIN32
+	void *process = symbolProcess ? symbolProcess : GetCurrentProcess();
+#else
+	void *process = symbolProcess;
+#endif
+	std::lock_guard<std::mutex> lk(symbolCacheMutex);
+#ifndef _WIN32
+	// Picks up modules the process has loaded since last time.
+	if(process && !dumpModules)
+		getProcessModules((unsigned long)(uintptr_t)process, symbolModules);
+#endif
+
+	// Only look up each new address once, in address order so consecutive lookups
+	// tend to hit the same module.
+	std::sort(addresses.begin(), addresses.end());
+	addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+	for(void *address : addresses){
+		if(address && symbolCache.find(address) == symbolCache.end())
+			symbolCache[address] = lookupSymbol(process, address);
+	}
+}
+
+#ifndef _WIN32
+void setSymbolModules(const std::vector<ProfileDump::Module> &modules){
+	{
+		std::lock_guard<std::mutex> lk(symbolCacheMutex);
+		symbolModules = modules;
+		dumpModules = true;
+	}
+	forgetMissingSymbols();
+}
+#endif
+
+void forgetMissingSymbols(){
+	std::lock_guard<std::mutex> lk(symbolCacheMutex);
+	for(auto it = symbolCache.begin(); it != symbolCache.end();){
+		if(it->second.name.empty())
+			it = symbolCache.erase(it);
+		else
+			++it;
+	}
+}
+
+bool getSymbol(void *address, SymbolInfo &symbol){
+	resolveSymbols(std::vector<void*>(1, address));
+
+	std::lock_guard<std::mutex> lk(symbolCacheMutex);
+	symbol = symbolCache[address];
+	return !symbol.name.empty();
+}
+
+void printStackFrames(void *const *frames, size_t depth, std::ostream &stream){
+	// Anything not resolved up front by the caller is looked up here.
+	resolveSymbols(std::vector<void*>(frames, frames + depth));
+
+	std::lock_guard<std::mutex> lk(symbolCacheMutex);
+
+	// Print out stack trace.
+	for(size_t i = 0; i < depth; ++i){
+		if(frames[i]){
+			// Output stack frame symbols if available.
+			const SymbolInfo &symbol = symbolCache[frames[i]];
+			if(!symbol.name.empty()){
+				stream << "    " << symbol.name;
+
+				// Output filename + line info if available.
+				if(!symbol.file.empty())
+					stream << "    " << symbol.file << ":" << symbol.line;
+
+				stream << "    (";
+			}else{
+				stream << "    <no symbol> " << "    (";
+			}
+			// As a number, libstdc++ counts the 0x of a pointer in its padded width.
+			stream << "0x" << std::hex << std::setw(sizeof(void*)*2) << std::setfill('0') << (uintptr_t)frames[i] << std::dec << std::setfill(' ') << ")\n";
+		}else{
+			break;
+		}
+	}
+}
+
+// Compare two arrays of frames. Stacks are at most backtraceSize frames so it's
+// cheaper to compare everything without branching than to stop early.
+static bool framesEqual(void *const *a, void *const *b, size_t depth){
+	const char *pa = (const char*)a;
+	const char *pb = (const char*)b;
+	size_t bytes = depth*sizeof(void*);
+	size_t i = 0;
+#ifdef HEAPY_SSE2
+	__m128i diff = _mm_setzero_si128();
+	for(; i + 16 <= bytes; i += 16){
+		__m128i va = _mm_loadu_si128((const __m128i*)(pa + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(pb + i));
+		diff = _mm_or_si128(diff, _mm_xor_si128(va, vb));
+	}
+	if(_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF)
+		return false;
+#endif
+	return memcmp(pa + i, pb + i, bytes - i) == 0;
+}
+
+StackTable::StackTable() : arena(0), arenaUsed(arenaChunkFrames){
+}
+
+StackTable::Shard &StackTable::shardFor(StackHash hash){
+	return shards[(hash ^ (hash >> 16)) % numShards];
+}
+
+size_t StackTable::homeSlot(StackHash hash, size_t mask){
+	// The polynomial hash's low bits only depend on the low bits of the frames, mix
+	// every bit in. The shard came from the low bits too.
+	uint64_t h = (uint64_t)hash;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return (size_t)h & mask;
+}
+
+void StackTable::placeSlot(Slot *slots, size_t capacity, StackHash hash, StackId id){
+	size_t mask = capacity - 1;
+	size_t i = homeSlot(hash, mask);
+	while(slots[i].id != invalidStackId)
+		i = (i + 1) & mask;
+	slots[i].hash = hash;
+	slots[i].id = id;
+}
+
+StackId StackTable::lookup(const Shard &shard, const StackTrace &trace) const {
+	if(!shard.capacity)
+		return invalidStackId;
+
+	size_t mask = shard.capacity - 1;
+	for(size_t i = homeSlot(trace.hash, mask); shard.slots[i].id != invalidStackId; i = (i + 1) & mask){
+		const Slot &slot = shard.slots[i];
+		if(slot.hash == trace.hash && matches(slot.id, trace))
+			return slot.id;
+	}
+	return invalidStackId;
+}
+
+void StackTable::addSlot(Shard &shard, StackHash hash, StackId id){
+	// Keep the load under three quarters so runs stay short. The index is small next
+	// to the frames, so it's rehashed in one go.
+	if((shard.count + 1)*4 > shard.capacity*3){
+		size_t capacity = shard.capacity ? shard.capacity*2 : minShardCapacity;
+		Slot *slots = (Slot*)arenaAllocate(capacity*sizeof(Slot));
+		for(size_t i = 0; i < capacity; ++i)
+			slots[i].id = invalidStackId;
+		for(size_t i = 0; i < shard.capacity; ++i){
+			if(shard.slots[i].id != invalidStackId)
+				placeSlot(slots, capacity, shard.slots[i].hash, shard.slots[i].id);
+		}
+		arenaFree(shard.slots);
+		shard.slots = slots;
+		shard.capacity = capacity;
+	}
+
+	placeSlot(shard.slots, shard.capacity, hash, id);
+	++shard.count;
+}
+
+void StackTable::removeSlot(Shard &shard, StackHash hash, StackId id){
+	if(!shard.capacity)
+		return;
+
+	size_t mask = shard.capacity - 1;
+	size_t hole = homeSlot(hash, mask);
+	while(shard.slots[hole].id != id){
+		if(shard.slots[hole].id == invalidStackId)
+			return;
+		hole = (hole + 1) & mask;
+	}
+
+	// Backward shift deletion as in PointerTable, so there are no tombstones.
+	for(size_t i = (hole + 1) & mask; shard.slots[i].id != invalidStackId; i = (i + 1) & mask){
+		size_t home = homeSlot(shard.slots[i].hash, mask);
+		if(((i - home) & mask) >= ((i - hole) & mask)){
+			shard.slots[hole] = shard.slots[i];
+			hole = i;
+		}
+	}
+	shard.slots[hole].id = invalidStackId;
+	--shard.count;
+}
+
+StackId StackTable::intern(const StackTrace &trace){
+	Shard &shard = shardFor(trace.hash);
+	std::lock_guard<std::mutex> lk(shard.mutex);
+	StackId id = lookup(shard, trace);
+	if(id != invalidStackId)
+		return id;
+
+	id = append(trace);
+	if(id != overflowId)
+		addSlot(shard, trace.hash, id);
+	return id;
+}
+
+StackId StackTable::find(const StackTrace &trace){
+	Shard &shard = shardFor(trace.hash);
+	std::lock_guard<std::mutex> lk(shard.mutex);
+	return lookup(shard, trace);
+}
+
+StackTable::~StackTable(){
+	for(size_t i = 0; i < numShards; ++i)
+		arenaFree(shards[i].slots);
+	for(size_t i = 0; i < arenaChunks.size(); ++i)
+		delete [] arenaChunks[i];
+}
+
+bool StackTable::matches(StackId id, const StackTrace &trace) const {
+	const Entry &entry = entries[id];
+	if(entry.unlinked.load(std::memory_order_acquire))
+		return false;
+	void *const *frames = entry.frames.load(std::memory_order_acquire);
+	return frames && entry.depth.load(std::memory_order_relaxed) == trace.depth && framesEqual(frames, trace.backtrace, trace.depth);
+}
+
+StackId StackTable::append(const StackTrace &trace){
+	std::lock_guard<std::mutex> lk(appendMutex);
+
+	bool reused = !freeIds.empty();
+	size_t id;
+	if(reused){
+		id = freeIds.back();
+		freeIds.pop_back();
+	}else{
+		id = entries.size();
+		if(id > overflowId)
+			return overflowId;
+		entries.reserve(id + 1);
+	}
+
+	// The last id is the overflow stack, it keeps no frames.
+	size_t depth = id == overflowId ? 0 : trace.depth;
+
+	void **frames;
+	std::vector<void**> &recycled = freeFrames[depth];
+	if(!recycled.empty()){
+		frames = recycled.back();
+		recycled.pop_back();
+	}else{
+		if(!arena || arenaUsed + depth > arenaChunkFrames){
+			arena = new void*[arenaChunkFrames];
+			arenaChunks.push_back(arena);
+			arenaUsed = 0;
+		}
+		frames = arena + arenaUsed;
+		arenaUsed += depth;
+	}
+	memcpy(frames, trace.backtrace, sizeof(void*)*depth);
+
+	Entry &entry = entries[id];
+	entry.depth.store(depth, std::memory_order_relaxed);
+	entry.hash.store(trace.hash, std::memory_order_relaxed);
+	entry.frames.store(frames, std::memory_order_release);
+	entry.unlinked.store(false, std::memory_order_release);
+	if(!reused)
+		entries.publish(id + 1);
+	return (StackId)id;
+}
+
+void StackTable::unlink(StackId id){
+	if(id == overflowId)
+		return;
+	Entry &entry = entries[id];
+	StackHash hash = entry.hash.load(std::memory_order_relaxed);
+	Shard &shard = shardFor(hash);
+	std::lock_guard<std::mutex> lk(shard.mutex);
+	removeSlot(shard, hash, id);
+	entry.unlinked.store(true, std::memory_order_release);
+}
+
+void StackTable::release(StackId id){
+	if(id == overflowId)
+		return;
+	Entry &entry = entries[id];
+	size_t depth = entry.depth.load(std::memory_order_relaxed);
+	entry.depth.store(0, std::memory_order_relaxed);
+	void **frames = entry.frames.exchange(0);
+
+	std::lock_guard<std::mutex> lk(appendMutex);
+	freeFrames[depth].push_back(frames);
+	freeIds.push_back(id);
+}
+
+bool StackTable::isReleased(StackId id) const {
+	return entries[id].frames.load(std::memory_order_acquire) == 0;
+}
+
+size_t StackTable::size() const {
+	return entries.size();
+}
+
+size_t StackTable::depth(StackId id) const {
+	const Entry &entry = entries[id];
+	return entry.frames.load(std::memory_order_acquire) ? entry.depth.load(std::memory_order_relaxed) : 0;
+}
+
+void *const *StackTable::frames(StackId id) const {
+	return entries[id].frames.load(std::memory_order_acquire);
+}
+
+void StackTable::print(StackId id, std::ostream &stream) const {
+	const Entry &entry = entries[id];
+	void *const *frames = entry.frames.load(std::memory_order_acquire);
+	if(frames)
+		printStackFrames(frames, entry.depth.load(std::memory_order_relaxed), stream);
+}
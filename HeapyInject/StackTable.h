@@ -0,0 +1,159 @@
+#pragma once
+#include <ostream>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+
+#include "Platform.h"
+#include "Arena.h"
+#include "ChunkedArray.h"
+#include "ProfileDump.h"
+
+const int backtraceSize = 64;
+// Depth of the first, cheap, capture in adaptive depth mode.
+const int shallowBacktraceSize = 8;
+typedef size_t StackHash;
+typedef uint32_t StackId;
+const StackId invalidStackId = 0xFFFFFFFF;
+
+// The stack of an allocation, starting at the function which allocated. The profiler's
+// own frames are left out when it is captured.
+struct StackTrace{
+	void *backtrace[backtraceSize];
+	size_t depth;
+	StackHash hash;
+	// Set by trace when the thread's previous trace had exactly the same frames, which
+	// allocations in a loop do, so whatever it was interned as can be used again.
+	bool repeated;
+
+	StackTrace();
+	void trace(size_t maxDepth = backtraceSize);
+	void computeHash();
+	void print(std::ostream &stream) const;
+};
+
+// Print frames with symbol information.
+void printStackFrames(void *const *frames, size_t depth, std::ostream &stream);
+
+// Process whose symbols are used when printing, defaults to the current process. A
+// process handle, or on Linux the process id.
+void setSymbolProcess(void *process);
+
+#ifndef _WIN32
+// Symbolise against the modules a dump recorded instead of a live process, as
+// --symbolize does. Addresses which had no symbol are looked up again.
+void setSymbolModules(const std::vector<ProfileDump::Module> &modules);
+#endif
+
+// Look up symbols for a batch of frames ahead of printing them. Results are cached
+// for the life of the process so only addresses never seen before cost anything.
+void resolveSymbols(std::vector<void*> addresses);
+
+// Retry addresses which had no symbol, after new modules have been loaded.
+void forgetMissingSymbols();
+
+struct SymbolInfo{
+	std::string name;
+	// Empty if there is no line information.
+	std::string file;
+	unsigned line;
+};
+
+// Symbol for a single address, through the same cache. Returns false if it has none.
+bool getSymbol(void *address, SymbolInfo &symbol);
+
+// Append only table of every stack trace we have seen. Each unique trace is stored once,
+// with only as many frames as it has, and is referred to everywhere else by a small id.
+class StackTable : public CacheAligned{
+public:
+	StackTable();
+	~StackTable();
+
+	// Return the id of this trace, adding it if we have not seen it before.
+	// Traces are only ever the same stack if all their frames match.
+	StackId intern(const StackTrace &trace);
+
+	// Once every id is in use new stacks all get this one, an empty stack which
+	// stands for all of them. It's never unlinked or released.
+	static const StackId overflowId = (1 << 28) - 1;
+
+	// Id of this trace if it has been interned, otherwise invalidStackId.
+	StackId find(const StackTrace &trace);
+
+	// Whether the stack with this id has exactly the frames of trace. Unlinked stacks
+	// never match anything.
+	bool matches(StackId id, const StackTrace &trace) const;
+
+	// Collecting dead stacks. Unlinking takes a stack out of the index, so intern and find
+	// never return it again, but leaves its frames readable by anyone who already has its
+	// id. Releasing an unlinked stack frees its frames and lets its id be reused, so that
+	// must wait until nobody can still be using it.
+	void unlink(StackId id);
+	void release(StackId id);
+	bool isReleased(StackId id) const;
+
+	// Ids run from zero to size - 1, released ids have no frames.
+	size_t size() const;
+
+	size_t depth(StackId id) const;
+	void *const *frames(StackId id) const;
+	void print(StackId id, std::ostream &stream) const;
+
+private:
+	static const size_t numShards = 64;
+
+	static const size_t arenaChunkFrames = 64*1024;
+
+	// Depth and hash change when an id is reused, while lock-free readers may
+	// still look at the entry, so they're atomic too. They are written before
+	// the release store of frames and read after acquiring it.
+	struct Entry{
+		std::atomic<void**> frames;
+		std::atomic<size_t> depth;
+		std::atomic<StackHash> hash;
+		std::atomic<bool> unlinked;
+	};
+
+	// Hash to id index, sharded like the profiler tables. Each shard is an open
+	// addressing table of (hash, id) pairs with linear probing, like PointerTable,
+	// and different stacks with the same hash get a slot each. Empty slots have
+	// invalidStackId.
+	struct Slot{
+		StackHash hash;
+		StackId id;
+	};
+
+	struct __declspec(align(64)) Shard{
+		std::mutex mutex;
+		Slot *slots;
+		size_t capacity;
+		size_t count;
+
+		Shard() : slots(0), capacity(0), count(0){}
+	};
+
+	static const size_t minShardCapacity = 16;
+
+	Shard &shardFor(StackHash hash);
+	static size_t homeSlot(StackHash hash, size_t mask);
+	static void placeSlot(Slot *slots, size_t capacity, StackHash hash, StackId id);
+	StackId lookup(const Shard &shard, const StackTrace &trace) const;
+	void addSlot(Shard &shard, StackHash hash, StackId id);
+	void removeSlot(Shard &shard, StackHash hash, StackId id);
+	StackId append(const StackTrace &trace);
+
+	Shard shards[numShards];
+	ChunkedArray<Entry> entries;
+
+	// Frames of all stacks are packed into large chunks, a stack never spans two.
+	// Frames of released stacks are kept per depth and handed to the next stack
+	// of that depth, with their id.
+	std::mutex appendMutex;
+	void **arena;
+	size_t arenaUsed;
+	std::vector<void**> arenaChunks;
+	std::vector<void**> freeFrames[backtraceSize + 1];
+	std::vector<StackId> freeIds;
+};
@@ -0,0 +1,981 @@
+#include "Unwinder.h"
+#include "Platform.h"
+
+#include "ProfileDump.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <execinfo.h>
+#include <pthread.h>
+#include <link.h>
+#endif
+#include <string.h>
+#include <stdint.h>
+
+#include <vector>
+#include <algorithm>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static UnwinderKind unwinder = systemUnwinder;
+
+static bool buildUnwindTable();
+
+bool setUnwinder(UnwinderKind kind){
+#if defined(_WIN32) && defined(_M_X64)
+	// x64 MSVC never keeps frame pointers, in Heapy's own hooks or anywhere else, so
+	// the walk would skip or garble frames.
+	if(kind == framePointerUnwinder)
+		return false;
+#endif
+	if(kind == unwindTableUnwinder && !buildUnwindTable())
+		return false;
+	unwinder = kind;
+	return true;
+}
+
+bool parseUnwinder(const char *name, UnwinderKind &kind){
+	if(strcmp(name, "system") == 0)
+		kind = systemUnwinder;
+	else if(strcmp(name, "framepointer") == 0)
+		kind = framePointerUnwinder;
+	else if(strcmp(name, "table") == 0)
+		kind = unwindTableUnwinder;
+	else
+		return false;
+	return true;
+}
+
+#ifndef _WIN32
+static __declspec( thread ) size_t threadStackLow = 0;
+static __declspec( thread ) size_t threadStackHigh = 0;
+#endif
+
+// Bounds of the current thread's stack.
+static void getStackBounds(size_t &low, size_t &high){
+#ifdef _WIN32
+	NT_TIB *tib = (NT_TIB*)NtCurrentTeb();
+	low = (size_t)tib->StackLimit;
+	high = (size_t)tib->StackBase;
+#else
+	// Looking them up is slow, the main thread's even reads /proc, so once per thread.
+	if(!threadStackHigh){
+		pthread_attr_t attr;
+		void *stack;
+		size_t size;
+		if(pthread_getattr_np(pthread_self(), &attr) == 0){
+			if(pthread_attr_getstack(&attr, &stack, &size) == 0){
+				threadStackLow = (size_t)stack;
+				threadStackHigh = (size_t)stack + size;
+			}
+			pthread_attr_destroy(&attr);
+		}
+	}
+	low = threadStackLow;
+	high = threadStackHigh;
+#endif
+}
+
+// The last stack this thread captured, innermost frame first, with the stack address
+// each return address was read from. Allocations in a loop tend to share all but
+// their innermost few frames, which the unwinders which walk the stack themselves copy
+// from here instead of unwinding them again. The system unwinder can't say where it
+// found each return address, so it neither uses nor updates it.
+static const size_t maxCachedFrames = 64;
+struct CachedStack{
+	UnwinderKind unwinder;
+	size_t maxFrames;
+	size_t depth;
+	// False if the capture stopped at its maximum depth before the end of the stack.
+	bool complete;
+	size_t slots[maxCachedFrames];
+	void *frames[maxCachedFrames];
+};
+static __declspec( thread ) CachedStack cachedStack;
+
+// A capture's progress against the cached one.
+struct CacheWalk{
+	size_t slots[maxCachedFrames];
+	// Where the walk has got to in the cached stack.
+	size_t cached;
+	bool complete;
+	// Every frame came from the cache, the capture is the same as the last one.
+	bool repeated;
+};
+
+// Whether frames from index onwards are still on the stack. If every return address
+// is still in the same place, then so are the frames which put them there.
+static bool cachedFramesLive(size_t index){
+	for(size_t i = index; i < cachedStack.depth; ++i){
+		if(*(size_t*)cachedStack.slots[i] != (size_t)cachedStack.frames[i])
+			return false;
+	}
+	return true;
+}
+
+// Called with each return address's slot before it is added. If the walk has joined the
+// last capture the rest of the frames are copied from it and it returns true.
+static bool joinCachedStack(size_t slot, void **frames, size_t &depth, size_t maxFrames, CacheWalk &walk){
+	if(cachedStack.unwinder != unwinder)
+		return false;
+
+	// Slots only get further up the stack in both captures, so walk them together
+	// looking for the point where this one joins the last one.
+	while(walk.cached < cachedStack.depth && cachedStack.slots[walk.cached] < slot)
+		++walk.cached;
+	// A shallower capture than this one can't be used if it didn't reach the end.
+	size_t available = cachedStack.depth - walk.cached;
+	if(walk.cached == cachedStack.depth || cachedStack.slots[walk.cached] != slot ||
+	   (!cachedStack.complete && available < maxFrames - depth) || !cachedFramesLive(walk.cached))
+		return false;
+
+	size_t count = (std::min)(available, maxFrames - depth);
+	walk.complete = cachedStack.complete && count == available;
+	walk.repeated = depth == 0 && walk.cached == 0 && count == available && cachedStack.maxFrames == maxFrames;
+	memcpy(frames + depth, cachedStack.frames + walk.cached, count*sizeof(void*));
+	if(depth < maxCachedFrames)
+		memcpy(walk.slots + depth, cachedStack.slots + walk.cached, ((std::min)(depth + count, maxCachedFrames) - depth)*sizeof(size_t));
+	depth += count;
+	return true;
+}
+
+static void addFrame(void *frame, size_t slot, void **frames, size_t &depth, CacheWalk &walk){
+	if(depth < maxCachedFrames)
+		walk.slots[depth] = slot;
+	frames[depth++] = frame;
+}
+
+static void saveCachedStack(void *const *frames, size_t depth, size_t maxFrames, const CacheWalk &walk){
+	size_t cachedDepth = (std::min)(depth, maxCachedFrames);
+	memcpy(cachedStack.frames, frames, cachedDepth*sizeof(void*));
+	memcpy(cachedStack.slots, walk.slots, cachedDepth*sizeof(size_t));
+	cachedStack.unwinder = unwinder;
+	cachedStack.maxFrames = maxFrames;
+	cachedStack.depth = cachedDepth;
+	cachedStack.complete = walk.complete && cachedDepth == depth;
+}
+
+#if defined(_M_X64) || defined(__x86_64__)
+// Where a function keeps its return address and the caller's rbp. Offsets are from rsp,
+// or from rbp for code which uses it as a frame pointer. On Windows a rule covers a
+// whole function once past its prolog, on Linux each row of a function's CFA table,
+// where the frame is laid out the same, gets a rule of its own.
+struct UnwindRule{
+	uint64_t begin;
+	uint32_t length;
+	int32_t returnOffset;
+	int32_t rbpOffset;
+	uint8_t prologSize;
+	bool frameBased;
+	bool rbpSaved;
+	bool rbpFrameBased;
+	// The thread's first function, which has nothing to return to.
+	bool outermost;
+};
+
+// Sorted by begin, built once and only read after that.
+static const UnwindRule *unwindRules = 0;
+static size_t numUnwindRules = 0;
+
+#ifdef _WIN32
+// Layout of the unwind information .pdata entries point to, see "x64 exception handling"
+// on MSDN. Unwind codes describe the prolog in reverse order.
+struct UnwindCode{
+	uint8_t codeOffset;
+	uint8_t unwindOp : 4;
+	uint8_t opInfo : 4;
+};
+
+struct UnwindInfo{
+	uint8_t version : 3;
+	uint8_t flags : 5;
+	uint8_t sizeOfProlog;
+	uint8_t countOfCodes;
+	uint8_t frameRegister : 4;
+	uint8_t frameOffset : 4;
+	UnwindCode codes[1];
+};
+
+enum UnwindOp{
+	pushNonvol = 0, allocLarge, allocSmall, setFramePointer, saveNonvol, saveNonvolFar,
+	// Epilog descriptions in version 2, an xmm save in version 1.
+	epilogOrSaveXmm, spareOrSaveXmmFar, saveXmm128, saveXmm128Far, pushMachineFrame
+};
+
+static const uint8_t unwindChainInfo = 4;
+static const uint8_t registerRbp = 5;
+
+static bool compileUnwindRule(uint8_t *imageBase, const RUNTIME_FUNCTION *function, UnwindRule &rule){
+	rule.begin = (uint64_t)imageBase + function->BeginAddress;
+	rule.length = function->EndAddress - function->BeginAddress;
+	rule.rbpSaved = false;
+	rule.outermost = false;
+
+	// Track rsp at the end of the prolog as an offset from rsp or rbp, simulating each
+	// operation the same way RtlVirtualUnwind does.
+	int32_t offset = 0;
+	bool frameBased = false;
+
+	const UnwindInfo *info = (const UnwindInfo*)(imageBase + function->UnwindData);
+	rule.prologSize = info->sizeOfProlog;
+	for(int chain = 0; chain < 32; ++chain){
+		if(info->version > 2)
+			return false;
+
+		const uint16_t *slots = (const uint16_t*)info->codes;
+		for(unsigned i = 0; i < info->countOfCodes;){
+			const UnwindCode &code = info->codes[i];
+			switch(code.unwindOp){
+			case pushNonvol:
+				if(code.opInfo == registerRbp && !rule.rbpSaved){
+					rule.rbpSaved = true;
+					rule.rbpOffset = offset;
+					rule.rbpFrameBased = frameBased;
+				}
+				offset += 8;
+				i += 1;
+				break;
+			case allocLarge:
+				if(code.opInfo == 0){
+					offset += slots[i + 1]*8;
+					i += 2;
+				}else{
+					offset += slots[i + 1] | (slots[i + 2] << 16);
+					i += 3;
+				}
+				break;
+			case allocSmall:
+				offset += code.opInfo*8 + 8;
+				i += 1;
+				break;
+			case setFramePointer:
+				// We only follow rbp between frames.
+				if(info->frameRegister != registerRbp)
+					return false;
+				frameBased = true;
+				offset = -(int32_t)info->frameOffset*16;
+				i += 1;
+				break;
+			case saveNonvol:
+			case saveNonvolFar:{
+				int32_t saveOffset = code.unwindOp == saveNonvol ? slots[i + 1]*8 : slots[i + 1] | (slots[i + 2] << 16);
+				if(code.opInfo == registerRbp && !rule.rbpSaved){
+					rule.rbpSaved = true;
+					rule.rbpOffset = offset + saveOffset;
+					rule.rbpFrameBased = frameBased;
+				}
+				i += code.unwindOp == saveNonvol ? 2 : 3;
+				break;
+			}
+			case epilogOrSaveXmm:
+			case saveXmm128:
+				i += 2;
+				break;
+			case spareOrSaveXmmFar:
+			case saveXmm128Far:
+				i += 3;
+				break;
+			default:
+				// Machine frames are for interrupts and exceptions, not calls.
+				return false;
+			}
+		}
+
+		if(!(info->flags & unwindChainInfo))
+			break;
+
+		// The rest of the prolog is described by the function this one is chained to.
+		const RUNTIME_FUNCTION *chained = (const RUNTIME_FUNCTION*)&info->codes[(info->countOfCodes + 1) & ~1];
+		info = (const UnwindInfo*)(imageBase + chained->UnwindData);
+	}
+
+	rule.returnOffset = offset;
+	rule.frameBased = frameBased;
+	return true;
+}
+
+static void compileModuleUnwindRules(uint8_t *imageBase, std::vector<UnwindRule> &rules){
+	IMAGE_DOS_HEADER *dosHeader = (IMAGE_DOS_HEADER*)imageBase;
+	if(dosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+		return;
+	IMAGE_NT_HEADERS64 *ntHeaders = (IMAGE_NT_HEADERS64*)(imageBase + dosHeader->e_lfanew);
+	if(ntHeaders->Signature != IMAGE_NT_SIGNATURE || ntHeaders->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+		return;
+
+	const IMAGE_DATA_DIRECTORY &directory = ntHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+	const RUNTIME_FUNCTION *functions = (const RUNTIME_FUNCTION*)(imageBase + directory.VirtualAddress);
+	size_t numFunctions = directory.Size / sizeof(RUNTIME_FUNCTION);
+	for(size_t i = 0; i < numFunctions; ++i){
+		const RUNTIME_FUNCTION *function = &functions[i];
+
+		// The low bit marks an entry which just points at the real one.
+		if(function->UnwindData & 1)
+			function = (const RUNTIME_FUNCTION*)(imageBase + (function->UnwindData & ~1));
+
+		UnwindRule rule;
+		if(compileUnwindRule(imageBase, function, rule)){
+			rule.begin = (uint64_t)imageBase + functions[i].BeginAddress;
+			rule.length = functions[i].EndAddress - functions[i].BeginAddress;
+			rules.push_back(rule);
+		}
+	}
+}
+
+#else
+// DWARF register numbers on x86-64.
+static const unsigned dwarfRbp = 6;
+static const unsigned dwarfRsp = 7;
+static const unsigned dwarfReturnAddress = 16;
+
+// Pointer encodings in .eh_frame and .eh_frame_hdr, a format in the low bits and what
+// it's relative to in the high ones.
+static const uint8_t encodingOmit = 0xFF;
+static const uint8_t encodingPcRelative = 0x10;
+static const uint8_t encodingDataRelative = 0x30;
+static const uint8_t encodingSigned4 = 0x0B;
+
+template <typename T>
+static T readValue(const uint8_t *&p){
+	T value;
+	memcpy(&value, p, sizeof(T));
+	p += sizeof(T);
+	return value;
+}
+
+static uint64_t readUleb(const uint8_t *&p){
+	uint64_t value = 0;
+	unsigned shift = 0;
+	uint8_t byte;
+	do{
+		byte = *p++;
+		if(shift < 64)
+			value |= (uint64_t)(byte & 0x7F) << shift;
+		shift += 7;
+	}while(byte & 0x80);
+	return value;
+}
+
+static int64_t readSleb(const uint8_t *&p){
+	uint64_t value = 0;
+	unsigned shift = 0;
+	uint8_t byte;
+	do{
+		byte = *p++;
+		if(shift < 64)
+			value |= (uint64_t)(byte & 0x7F) << shift;
+		shift += 7;
+	}while(byte & 0x80);
+	if(shift < 64 && (byte & 0x40))
+		value |= ~(uint64_t)0 << shift;
+	return (int64_t)value;
+}
+
+// Data relative pointers are only used by .eh_frame_hdr, relative to its start.
+static bool readEncoded(const uint8_t *&p, uint8_t encoding, const uint8_t *dataBase, uint64_t &value){
+	const uint8_t *field = p;
+	switch(encoding & 0x0F){
+	case 0x00: case 0x04: case 0x0C: value = readValue<uint64_t>(p); break;
+	case 0x01: value = readUleb(p); break;
+	case 0x02: value = readValue<uint16_t>(p); break;
+	case 0x03: value = readValue<uint32_t>(p); break;
+	case 0x09: value = (uint64_t)readSleb(p); break;
+	case 0x0A: value = (uint64_t)(int64_t)readValue<int16_t>(p); break;
+	case 0x0B: value = (uint64_t)(int64_t)readValue<int32_t>(p); break;
+	default: return false;
+	}
+	switch(encoding & 0x70){
+	case 0: break;
+	case encodingPcRelative: value += (uint64_t)field; break;
+	case encodingDataRelative: value += (uint64_t)dataBase; break;
+	default: return false;
+	}
+	return true;
+}
+
+// Where rbp or the return address is, as of one row of the CFA table.
+enum SavedRule{ notSaved, savedAtOffset, savedElsewhere };
+
+struct CfaState{
+	unsigned cfaRegister;
+	int64_t cfaOffset;
+	// False when the CFA is a DWARF expression.
+	bool cfaValid;
+	SavedRule rbpRule;
+	int64_t rbpOffset;
+	SavedRule returnRule;
+	int64_t returnOffset;
+};
+
+struct CieInfo{
+	uint64_t codeAlign;
+	int64_t dataAlign;
+	uint8_t fdeEncoding;
+	bool hasAugmentationData;
+	CfaState initial;
+};
+
+static void setSaved(CfaState &state, uint64_t reg, SavedRule rule, int64_t offset){
+	if(reg == dwarfRbp){
+		state.rbpRule = rule;
+		state.rbpOffset = offset;
+	}else if(reg == dwarfReturnAddress){
+		state.returnRule = rule;
+		state.returnOffset = offset;
+	}
+}
+
+static void restoreSaved(CfaState &state, const CfaState &initial, uint64_t reg){
+	if(reg == dwarfRbp){
+		state.rbpRule = initial.rbpRule;
+		state.rbpOffset = initial.rbpOffset;
+	}else if(reg == dwarfReturnAddress){
+		state.returnRule = initial.returnRule;
+		state.returnOffset = initial.returnOffset;
+	}
+}
+
+// The rule for one row, if its frame is laid out the way the walk can follow: the CFA
+// rsp or rbp based and the return address just below it, which is where calls put it.
+static void addRowRule(const CfaState &state, uint64_t begin, uint64_t end, std::vector<UnwindRule> &rules){
+	if(end <= begin || !state.cfaValid || (state.cfaRegister != dwarfRsp && state.cfaRegister != dwarfRbp) ||
+	   state.rbpRule == savedElsewhere)
+		return;
+	bool outermost = state.returnRule == notSaved;
+	if(!outermost && (state.returnRule != savedAtOffset || state.returnOffset != -8))
+		return;
+
+	UnwindRule rule;
+	rule.begin = begin;
+	rule.length = (uint32_t)(end - begin);
+	rule.frameBased = state.cfaRegister == dwarfRbp;
+	rule.returnOffset = (int32_t)(state.cfaOffset + state.returnOffset);
+	rule.rbpSaved = state.rbpRule == savedAtOffset;
+	rule.rbpOffset = (int32_t)(state.cfaOffset + state.rbpOffset);
+	rule.rbpFrameBased = rule.frameBased;
+	rule.prologSize = 0;
+	rule.outermost = outermost;
+
+	// Rows often only differ in registers the walk doesn't use.
+	if(!rules.empty()){
+		UnwindRule &last = rules.back();
+		if(last.begin + last.length == rule.begin && last.frameBased == rule.frameBased &&
+		   last.returnOffset == rule.returnOffset && last.rbpSaved == rule.rbpSaved &&
+		   (!rule.rbpSaved || last.rbpOffset == rule.rbpOffset) && last.outermost == rule.outermost){
+			last.length += rule.length;
+			return;
+		}
+	}
+	rules.push_back(rule);
+}
+
+// Runs a CIE's initial instructions, or an FDE's instructions from location, adding a
+// rule for each row up to limit if rules is given. Returns false on anything it
+// doesn't understand, rows so far are kept.
+static bool runCfaProgram(const uint8_t *p, const uint8_t *end, const CieInfo &cie, CfaState &state,
+                          uint64_t location, uint64_t limit, std::vector<UnwindRule> *rules){
+	CfaState remembered[8];
+	size_t numRemembered = 0;
+	while(p < end){
+		uint8_t op = *p++;
+		uint64_t next = location;
+		uint64_t reg;
+		switch(op >> 6){
+		case 1:
+			next = location + (op & 0x3F)*cie.codeAlign;
+			break;
+		case 2:
+			setSaved(state, op & 0x3F, savedAtOffset, (int64_t)readUleb(p)*cie.dataAlign);
+			break;
+		case 3:
+			restoreSaved(state, cie.initial, op & 0x3F);
+			break;
+		default:
+			switch(op){
+			case 0x00: // nop
+				break;
+			case 0x01: // set_loc
+				if(!readEncoded(p, cie.fdeEncoding, 0, next))
+					return false;
+				break;
+			case 0x02: next = location + readValue<uint8_t>(p)*cie.codeAlign; break;
+			case 0x03: next = location + readValue<uint16_t>(p)*cie.codeAlign; break;
+			case 0x04: next = location + readValue<uint32_t>(p)*cie.codeAlign; break;
+			case 0x05: // offset_extended
+				reg = readUleb(p);
+				setSaved(state, reg, savedAtOffset, (int64_t)readUleb(p)*cie.dataAlign);
+				break;
+			case 0x06: // restore_extended
+				restoreSaved(state, cie.initial, readUleb(p));
+				break;
+			case 0x07: // undefined
+				setSaved(state, readUleb(p), notSaved, 0);
+				break;
+			case 0x08: // same_value
+				reg = readUleb(p);
+				if(reg != dwarfReturnAddress)
+					setSaved(state, reg, notSaved, 0);
+				break;
+			case 0x09: // register
+				setSaved(state, readUleb(p), savedElsewhere, 0);
+				readUleb(p);
+				break;
+			case 0x0A: // remember_state
+				if(numRemembered == sizeof(remembered)/sizeof(remembered[0]))
+					return false;
+				remembered[numRemembered++] = state;
+				break;
+			case 0x0B: // restore_state, the CFA included
+				if(!numRemembered)
+					return false;
+				state = remembered[--numRemembered];
+				break;
+			case 0x0C: // def_cfa
+				state.cfaRegister = (unsigned)readUleb(p);
+				state.cfaOffset = (int64_t)readUleb(p);
+				state.cfaValid = true;
+				break;
+			case 0x0D: // def_cfa_register
+				state.cfaRegister = (unsigned)readUleb(p);
+				break;
+			case 0x0E: // def_cfa_offset
+				state.cfaOffset = (int64_t)readUleb(p);
+				break;
+			case 0x0F: // def_cfa_expression
+				state.cfaValid = false;
+				p += readUleb(p);
+				break;
+			case 0x10: // expression
+			case 0x16: // val_expression
+				setSaved(state, readUleb(p), savedElsewhere, 0);
+				p += readUleb(p);
+				break;
+			case 0x11: // offset_extended_sf
+				reg = readUleb(p);
+				setSaved(state, reg, savedAtOffset, readSleb(p)*cie.dataAlign);
+				break;
+			case 0x12: // def_cfa_sf
+				state.cfaRegister = (unsigned)readUleb(p);
+				state.cfaOffset = readSleb(p)*cie.dataAlign;
+				state.cfaValid = true;
+				break;
+			case 0x13: // def_cfa_offset_sf
+				state.cfaOffset = readSleb(p)*cie.dataAlign;
+				break;
+			case 0x14: // val_offset
+				setSaved(state, readUleb(p), savedElsewhere, 0);
+				readUleb(p);
+				break;
+			case 0x15: // val_offset_sf
+				setSaved(state, readUleb(p), savedElsewhere, 0);
+				readSleb(p);
+				break;
+			case 0x2E: // GNU_args_size
+				readUleb(p);
+				break;
+			case 0x2F: // GNU_negative_offset_extended
+				reg = readUleb(p);
+				setSaved(state, reg, savedAtOffset, -(int64_t)readUleb(p)*cie.dataAlign);
+				break;
+			default:
+				return false;
+			}
+		}
+
+		if(next != location){
+			if(rules)
+				addRowRule(state, location, (std::min)(next, limit), *rules);
+			location = next;
+		}
+	}
+	if(rules)
+		addRowRule(state, location, limit, *rules);
+	return true;
+}
+
+static bool parseCie(const uint8_t *cie, CieInfo &info){
+	uint32_t length = readValue<uint32_t>(cie);
+	if(length == 0 || length == 0xFFFFFFFF)
+		return false;
+	const uint8_t *end = cie + length;
+	const uint8_t *p = cie;
+	if(readValue<uint32_t>(p) != 0)
+		return false;
+	uint8_t version = *p++;
+	if(version != 1 && version != 3)
+		return false;
+	const char *augmentation = (const char*)p;
+	p += strlen(augmentation) + 1;
+	info.codeAlign = readUleb(p);
+	info.dataAlign = readSleb(p);
+	uint64_t returnRegister = version == 1 ? *p++ : readUleb(p);
+	if(returnRegister != dwarfReturnAddress)
+		return false;
+
+	info.fdeEncoding = 0;
+	info.hasAugmentationData = augmentation[0] == 'z';
+	if(info.hasAugmentationData){
+		uint64_t dataLength = readUleb(p);
+		const uint8_t *data = p;
+		p += dataLength;
+		for(const char *a = augmentation + 1; *a; ++a){
+			uint64_t personality;
+			switch(*a){
+			case 'R':
+				info.fdeEncoding = *data++;
+				break;
+			case 'L':
+				data++;
+				break;
+			case 'P':{
+				uint8_t encoding = *data++;
+				if(!readEncoded(data, encoding & 0x7F, 0, personality))
+					return false;
+				break;
+			}
+			case 'B':
+				break;
+			default:
+				// Signal frames ('S') don't have a return address from a call.
+				return false;
+			}
+		}
+	}else if(augmentation[0]){
+		return false;
+	}
+
+	CfaState &state = info.initial;
+	state.cfaRegister = dwarfRsp;
+	state.cfaOffset = 0;
+	state.cfaValid = true;
+	state.rbpRule = notSaved;
+	state.rbpOffset = 0;
+	state.returnRule = notSaved;
+	state.returnOffset = 0;
+	return runCfaProgram(p, end, info, state, 0, 0, 0);
+}
+
+static void compileFdeUnwindRules(const uint8_t *fde, std::vector<UnwindRule> &rules){
+	const uint8_t *p = fde;
+	uint32_t length = readValue<uint32_t>(p);
+	if(length == 0 || length == 0xFFFFFFFF)
+		return;
+	const uint8_t *end = p + length;
+
+	// The CIE is found relative to the field pointing at it.
+	const uint8_t *ciePointer = p;
+	const uint8_t *cie = ciePointer - readValue<uint32_t>(p);
+	CieInfo info;
+	if(!parseCie(cie, info))
+		return;
+
+	uint64_t begin, range;
+	if(!readEncoded(p, info.fdeEncoding, 0, begin) || !readEncoded(p, info.fdeEncoding & 0x0F, 0, range))
+		return;
+	if(info.hasAugmentationData)
+		p += readUleb(p);
+
+	CfaState state = info.initial;
+	runCfaProgram(p, end, info, state, begin, begin + range, &rules);
+}
+
+// Every function of a module has an FDE in .eh_frame, .eh_frame_hdr has a sorted table
+// of them for the unwinder in the C runtime which we use to find them all.
+static int compileModuleUnwindRules(dl_phdr_info *info, size_t, void *context){
+	std::vector<UnwindRule> &rules = *(std::vector<UnwindRule>*)context;
+	const uint8_t *header = 0;
+	for(int i = 0; i < info->dlpi_phnum; ++i){
+		if(info->dlpi_phdr[i].p_type == PT_GNU_EH_FRAME)
+			header = (const uint8_t*)(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+	}
+	if(!header || header[0] != 1)
+		return 0;
+
+	// Version, then the encodings of the .eh_frame pointer, the FDE count and the table.
+	uint8_t frameEncoding = header[1];
+	uint8_t countEncoding = header[2];
+	uint8_t tableEncoding = header[3];
+	const uint8_t *p = header + 4;
+	uint64_t frame, count;
+	if(frameEncoding == encodingOmit || !readEncoded(p, frameEncoding, header, frame) ||
+	   countEncoding == encodingOmit || !readEncoded(p, countEncoding, header, count) ||
+	   tableEncoding != (encodingDataRelative | encodingSigned4))
+		return 0;
+
+	// Pairs of the function's start and its FDE.
+	for(uint64_t i = 0; i < count; ++i){
+		const uint8_t *entry = p + i*8 + 4;
+		compileFdeUnwindRules(header + readValue<int32_t>(entry), rules);
+	}
+	return 0;
+}
+#endif
+
+static bool buildUnwindTable(){
+	if(unwindRules)
+		return true;
+
+	std::vector<UnwindRule> rules;
+#ifdef _WIN32
+	std::vector<ProfileDump::Module> modules;
+	getProcessModules(GetCurrentProcessId(), modules);
+	for(const ProfileDump::Module &module : modules)
+		compileModuleUnwindRules((uint8_t*)(size_t)module.base, rules);
+#else
+	dl_iterate_phdr(compileModuleUnwindRules, &rules);
+#endif
+	std::sort(rules.begin(), rules.end(),
+		[](const UnwindRule &a, const UnwindRule &b){
+			return a.begin < b.begin;
+		}
+	);
+
+	// Yes this leaks - the table lives as long as the process.
+	UnwindRule *table = new UnwindRule[rules.size()];
+	std::copy(rules.begin(), rules.end(), table);
+	numUnwindRules = rules.size();
+	unwindRules = table;
+	return true;
+}
+
+static const UnwindRule *findUnwindRule(uint64_t address){
+	const UnwindRule *end = unwindRules + numUnwindRules;
+	const UnwindRule *rule = std::upper_bound(unwindRules, end, address,
+		[](uint64_t a, const UnwindRule &r){
+			return a < r.begin;
+		}
+	);
+	if(rule == unwindRules)
+		return 0;
+	--rule;
+
+	// Return addresses are never inside a prolog, unless it calls __chkstk.
+	uint64_t offset = address - rule->begin;
+	if(offset >= rule->length || offset < rule->prologSize)
+		return 0;
+	return rule;
+}
+
+// Returns false if the stack runs through code the table knows nothing about.
+static __declspec(noinline) bool unwindTableBacktrace(void **frames, size_t maxFrames, size_t &depth, bool &repeated){
+	size_t stackLow, stackHigh;
+	getStackBounds(stackLow, stackHigh);
+
+#ifdef _WIN32
+	CONTEXT context;
+	RtlCaptureContext(&context);
+	uint64_t rip = context.Rip;
+	uint64_t rsp = context.Rsp;
+	uint64_t rbp = context.Rbp;
+#else
+	// All three at the same instruction, which the table has a row for.
+	uint64_t rip, rsp, rbp;
+	__asm__ volatile("lea 0(%%rip), %0\n\tmov %%rsp, %1\n\tmov %%rbp, %2" : "=r"(rip), "=r"(rsp), "=r"(rbp));
+#endif
+
+	// Skip our own frame, the first one returns into captureStack.
+	depth = 0;
+	bool first = true;
+	CacheWalk walk = {};
+	while(depth < maxFrames){
+#ifdef _WIN32
+		const UnwindRule *rule = findUnwindRule(rip);
+#else
+		// A call can be the last instruction of a function which doesn't return, so look
+		// up the call rather than the return address.
+		const UnwindRule *rule = findUnwindRule(first ? rip : rip - 1);
+#endif
+		if(!rule)
+			return false;
+		if(rule->outermost){
+			walk.complete = true;
+			break;
+		}
+
+		uint64_t base = rule->frameBased ? rbp : rsp;
+		uint64_t returnSlot = base + rule->returnOffset;
+		if(returnSlot < stackLow || returnSlot + 8 > stackHigh)
+			return false;
+
+		if(rule->rbpSaved){
+			uint64_t rbpSlot = (rule->rbpFrameBased ? rbp : rsp) + rule->rbpOffset;
+			if(rbpSlot < stackLow || rbpSlot + 8 > stackHigh)
+				return false;
+			rbp = *(uint64_t*)rbpSlot;
+		}
+		rip = *(uint64_t*)returnSlot;
+		rsp = returnSlot + 8;
+
+		// The thread's first frame returns to nowhere.
+		if(!rip){
+			walk.complete = true;
+			break;
+		}
+		if(first){
+			first = false;
+			continue;
+		}
+
+		if(joinCachedStack((size_t)returnSlot, frames, depth, maxFrames, walk))
+			break;
+		addFrame((void*)rip, (size_t)returnSlot, frames, depth, walk);
+	}
+
+	saveCachedStack(frames, depth, maxFrames, walk);
+	repeated = walk.repeated;
+	return true;
+}
+#else
+static bool buildUnwindTable(){
+	// Rules are only compiled for x64 code.
+	return false;
+}
+#endif
+
+// The walk has to start from a real frame, so these functions must keep their frame
+// pointers even in builds which otherwise omit them. This only works on x86, the
+// rest of Heapy is built with /Oy- there.
+#ifdef _MSC_VER
+#pragma optimize("y", off)
+#endif
+// Starts from the frame of captureStack, so the first return address is its caller's.
+// That's passed in rather than found here, as captureStack may jump here without a
+// frame of its own.
+static __declspec(noinline) size_t framePointerBacktrace(void **frames, size_t maxFrames, void **framePointer, bool &repeated){
+	// Only follow frame pointers which land inside this thread's stack.
+	size_t stackLow, stackHigh;
+	getStackBounds(stackLow, stackHigh);
+
+	// Each frame starts with the caller's frame pointer followed by the return address.
+	size_t depth = 0;
+	CacheWalk walk = {};
+	bool joined = false;
+	while(depth < maxFrames){
+		size_t address = (size_t)framePointer;
+		if(address < stackLow || address + 2*sizeof(void*) > stackHigh || (address & (sizeof(void*) - 1)))
+			break;
+
+		void *returnAddress = framePointer[1];
+		if(!returnAddress)
+			break;
+		if(joinCachedStack((size_t)&framePointer[1], frames, depth, maxFrames, walk)){
+			joined = true;
+			break;
+		}
+		addFrame(returnAddress, (size_t)&framePointer[1], frames, depth, walk);
+
+		// Callers' frames are always further up the stack.
+		void **next = (void**)framePointer[0];
+		if(next <= framePointer)
+			break;
+		framePointer = next;
+	}
+	if(!joined)
+		walk.complete = depth < maxFrames;
+
+	saveCachedStack(frames, depth, maxFrames, walk);
+	repeated = walk.repeated;
+	return depth;
+}
+
+__declspec(noinline) size_t captureStack(void **frames, size_t maxFrames, bool *repeated){
+	bool sameFrames = false;
+	if(repeated)
+		*repeated = false;
+
+	if(unwinder == framePointerUnwinder){
+#ifdef _MSC_VER
+		void **framePointer = (void**)_AddressOfReturnAddress() - 1;
+#else
+		void **framePointer = (void**)__builtin_frame_address(0);
+#endif
+		size_t depth = framePointerBacktrace(frames, maxFrames, framePointer, sameFrames);
+		if(repeated)
+			*repeated = sameFrames;
+		return depth;
+	}
+
+#if defined(_M_X64) || defined(__x86_64__)
+	size_t depth;
+	if(unwinder == unwindTableUnwinder && unwindTableBacktrace(frames, maxFrames, depth, sameFrames)){
+		if(repeated)
+			*repeated = sameFrames;
+		return depth;
+	}
+#endif
+
+	// Skip this function so both unwinders start from the same frame.
+#ifdef _WIN32
+	return CaptureStackBackTrace(1, (DWORD)maxFrames, frames, 0);
+#else
+	void *buffer[128];
+	int captured = backtrace(buffer, (int)(std::min)(maxFrames + 1, sizeof(buffer)/sizeof(buffer[0])));
+	if(captured <= 1)
+		return 0;
+	memcpy(frames, buffer + 1, (captured - 1)*sizeof(void*));
+	return captured - 1;
+#endif
+}
+#ifdef _MSC_VER
+#pragma optimize("", on)
+#endif
+
+// Address range of the profiler's module, empty until setProfilerModule.
+static uintptr_t profilerModuleStart = 0;
+static uintptr_t profilerModuleEnd = 0;
+
+#ifndef _WIN32
+struct ModuleRangeSearch{
+	uintptr_t address;
+	uintptr_t start;
+	uintptr_t end;
+};
+
+// A module spans from its lowest loaded segment to the end of its highest.
+static int findModuleRangeCallback(dl_phdr_info *info, size_t, void *context){
+	ModuleRangeSearch &search = *(ModuleRangeSearch*)context;
+	uintptr_t start = UINTPTR_MAX;
+	uintptr_t end = 0;
+	for(int i = 0; i < info->dlpi_phnum; ++i){
+		const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+		if(phdr.p_type != PT_LOAD)
+			continue;
+		start = (std::min)(start, (uintptr_t)(info->dlpi_addr + phdr.p_vaddr));
+		end = (std::max)(end, (uintptr_t)(info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz));
+	}
+	if(search.address < start || search.address >= end)
+		return 0;
+	search.start = start;
+	search.end = end;
+	return 1;
+}
+#endif
+
+void setProfilerModule(void *address){
+#ifdef _WIN32
+	HMODULE module;
+	if(!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCWSTR)address, &module))
+		return;
+	IMAGE_DOS_HEADER *dosHeader = (IMAGE_DOS_HEADER*)module;
+	IMAGE_NT_HEADERS *ntHeaders = (IMAGE_NT_HEADERS*)((char*)module + dosHeader->e_lfanew);
+	profilerModuleStart = (uintptr_t)module;
+	profilerModuleEnd = profilerModuleStart + ntHeaders->OptionalHeader.SizeOfImage;
+#else
+	ModuleRangeSearch search = {(uintptr_t)address, 0, 0};
+	if(!dl_iterate_phdr(findModuleRangeCallback, &search))
+		return;
+	profilerModuleStart = search.start;
+	profilerModuleEnd = search.end;
+#endif
+}
+
+size_t countProfilerFrames(void *const *frames, size_t depth){
+	if(!profilerModuleEnd)
+		return depth ? 1 : 0;
+	size_t count = 0;
+	while(count < depth && (uintptr_t)frames[count] - profilerModuleStart < profilerModuleEnd - profilerModuleStart)
+		++count;
+	return count;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <stddef.h>
+
+// Ways of capturing the stack of the current thread for StackTrace::trace.
+enum UnwinderKind{
+	// CaptureStackBackTrace, works on any code but is the slowest.
+	systemUnwinder,
+	// Follows the chain of saved frame pointers. Much cheaper, but stops at the first
+	// function built without frame pointers, so the profiled program must be built with
+	// them too: /Oy- on x86, -fno-omit-frame-pointer on Linux. Not supported on x64
+	// Windows, where MSVC has no way to keep them.
+	framePointerUnwinder,
+	// x64 only. Each module's unwind information, .pdata on Windows and .eh_frame on
+	// Linux, is compiled once into a sorted table of rules giving where each function
+	// keeps its return address, so a step is a binary search and a couple of loads with
+	// no locks or allocation. Works on code built without frame pointers. Falls back
+	// on the system unwinder for stacks through modules loaded after the table was
+	// built.
+	unwindTableUnwinder
+};
+
+// Returns false if the unwinder is not supported here, the current one is kept.
+// The unwind table is built for the modules loaded at the time this is called.
+bool setUnwinder(UnwinderKind kind);
+
+// Parse an unwinder name as given on the command line, "system", "framepointer"
+// or "table".
+bool parseUnwinder(const char *name, UnwinderKind &kind);
+
+// Fill frames with return addresses, starting with the caller of captureStack.
+// Returns the number of frames captured. The frame pointer and table unwinders copy
+// the outer frames this thread's previous capture shared instead of unwinding them.
+// If repeated is given it's set when all of the frames were, so the stack is exactly
+// the one captured last time with the same maxFrames.
+size_t captureStack(void **frames, size_t maxFrames, bool *repeated = 0);
+
+// Stacks are captured from inside the profiler's hooks, so their innermost frames are the
+// profiler's own. Takes the address range of the module containing address, the one the
+// hooks are built into, for countProfilerFrames.
+void setProfilerModule(void *address);
+
+// Number of frames at the start of a stack captured by StackTrace::trace which are in the
+// profiler's module. Until setProfilerModule is called that is just the frame of
+// StackTrace::trace itself, as when the profiler is linked into a test program.
+size_t countProfilerFrames(void *const *frames, size_t depth);
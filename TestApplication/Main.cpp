@@ -1,24 +1,39 @@
-#include <windows.h>
-#include <iostream>
-
-void LeakyFunction(){
-	malloc(1024*1024*5); // leak 5Mb
-}
-
-void NonLeakyFunction(){
-	auto p = malloc(1024*1024); // allocate 1Mb
-	std::cout << "TestApplication: Sleeping..." << std::endl;
-	Sleep(15000);
-	free(p); // free the Mb
-}
-
-int main()
-{
-	std::cout << "TestApplication: Creating some leaks..." << std::endl;
-	for(int i = 0; i < 5; ++i){
-		LeakyFunction();
-	}
-	NonLeakyFunction();
-	std::cout << "TestApplication: Exiting..." << std::endl;
-	return 0;
-}
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+#include <iostream>
+
+// How long NonLeakyFunction holds on to its Mb, long enough for a report to see it.
+int sleepMs = 15000;
+
+void LeakyFunction(){
+	malloc(1024*1024*5); // leak 5Mb
+}
+
+void NonLeakyFunction(){
+	auto p = malloc(1024*1024); // allocate 1Mb
+	std::cout << "TestApplication: Sleeping..." << std::endl;
+#ifdef _WIN32
+	Sleep(sleepMs);
+#else
+	usleep(sleepMs*1000);
+#endif
+	free(p); // free the Mb
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc > 1)
+		sleepMs = atoi(argv[1]);
+
+	std::cout << "TestApplication: Creating some leaks..." << std::endl;
+	for(int i = 0; i < 5; ++i){
+		LeakyFunction();
+	}
+	NonLeakyFunction();
+	std::cout << "TestApplication: Exiting..." << std::endl;
+	return 0;
+}
@@ -28,7 +28,12 @@
 
 #pragma once
 
+#if defined _WIN32
 #include <Windows.h>
+#elif !defined WINAPI
+// Linux x86-64 has just the one calling convention.
+#define WINAPI
+#endif
 
 // MinHook Error Codes.
 typedef enum MH_STATUS
@@ -29,12 +29,25 @@
 #include <cassert>
 #include <vector>
 #include <algorithm>
+#if defined _WIN32
 #include <Windows.h>
+#else
+#include "linux.h"
+#endif
 
 #include "buffer.h"
 
 namespace MinHook { namespace
 {
+#if !defined _WIN32
+	// Blocks are reserved with PROT_NONE and buffers are made accessible with mprotect,
+	// the PROT_* flags stand in for the page protections.
+	typedef int DWORD;
+	const DWORD PAGE_EXECUTE_READ = PROT_READ | PROT_EXEC;
+	const DWORD PAGE_READONLY = PROT_READ;
+#define TYPE_ALIGNMENT(t) alignof(t)
+#endif
+
 	struct MEMORY_BLOCK
 	{
 		void*	pAddress;
@@ -49,10 +62,10 @@ namespace MinHook { namespace
 	bool operator <(const MEMORY_BLOCK& lhs, const T& rhs);
 	template <typename T>
 	bool operator <(const T& lhs, const MEMORY_BLOCK& rhs);
-	bool operator <(const MEMORY_BLOCK& lhs, const MEMORY_BLOCK& rhs);
 
 	void*			AllocateBuffer(void* const pOrigin, DWORD protect, size_t size);
 	MEMORY_BLOCK*	GetMemoryBlock(void* const pOrigin, DWORD protect, size_t capacity);
+	void			ReleaseBlock(void* pAddress);
 
 	const size_t BlockSize = 0x10000;
 
@@ -67,7 +80,11 @@ namespace MinHook
 {
 	void InitializeBuffer()
 	{
-#if defined _M_X64
+#if defined _M_X64 && !defined _WIN32
+		// The lowest address mmap hands out by default, and the top of user space.
+		gMinAddress = 0x10000;
+		gMaxAddress = 0x7FFFFFFEFFFF;
+#elif defined _M_X64
 		SYSTEM_INFO si;
 		GetSystemInfo(&si);
 
@@ -81,7 +98,7 @@ namespace MinHook
 		for (size_t i = 0, count = gMemoryBlocks.size(); i < count; ++i)
 		{
 			MEMORY_BLOCK& block = gMemoryBlocks[i];
-			VirtualFree(block.pAddress, 0, MEM_RELEASE);
+			ReleaseBlock(block.pAddress);
 		}
 
 		std::vector<MEMORY_BLOCK> v;
@@ -117,7 +134,7 @@ namespace MinHook
 
 				if (block.fixedCount == 0)
 				{
-					VirtualFree(block.pAddress, 0, MEM_RELEASE);
+					ReleaseBlock(block.pAddress);
 					gMemoryBlocks.erase(gMemoryBlocks.begin()+i);
 				}
 
@@ -143,7 +160,7 @@ namespace MinHook
 
 			if (block.fixedCount == 0)
 			{
-				VirtualFree(block.pAddress, 0, MEM_RELEASE);
+				ReleaseBlock(block.pAddress);
 				gMemoryBlocks.erase(gMemoryBlocks.begin()+i);
 				i--;
 				count--;
@@ -163,8 +180,12 @@ namespace MinHook
 
 			void* pBuffer = reinterpret_cast<char*>(block.pAddress) + block.fixedSize;
 			size_t size = block.uncommittedSize;
+#if defined _WIN32
 			DWORD op;
 			VirtualProtect(pBuffer, size, block.protect, &op);
+#else
+			ProtectPages(pBuffer, size, block.protect);
+#endif
 
 			block.fixedSize += size;
 			block.uncommittedSize = 0;
@@ -192,6 +213,7 @@ namespace MinHook { namespace
 		}
 
 		void* pBuffer = reinterpret_cast<char*>(pBlock->pAddress) + pBlock->fixedSize + pBlock->uncommittedSize;
+#if defined _WIN32
 		if (VirtualAlloc(pBuffer, size, MEM_COMMIT, pBlock->protect) == NULL)
 		{
 			return NULL;
@@ -203,6 +225,13 @@ namespace MinHook { namespace
 		{
 			return NULL;
 		}
+#else
+		// Writable until CommitBuffer.
+		if (!ProtectPages(pBuffer, size, pBlock->protect | PROT_WRITE))
+		{
+			return NULL;
+		}
+#endif
 
 		pBlock->uncommittedSize += size;
 		pBlock->uncommittedCount++;
@@ -228,7 +257,6 @@ namespace MinHook { namespace
 #endif
 
 		// łɓo^ς݂̗̈̒gp\Ȃ̂΁AԂ
-		MEMORY_BLOCK* pBlock = NULL;
 		{
 			mb_iter ib = gMemoryBlocks.begin();
 			mb_iter ie = gMemoryBlocks.end();
@@ -258,11 +286,31 @@ namespace MinHook { namespace
 			intptr_t min = minAddr / BlockSize;
 			intptr_t max = maxAddr / BlockSize;
 			int rel = 0;
+#if defined _WIN32
 			MEMORY_BASIC_INFORMATION mi = { 0 };
+#endif
 			for (int i = 0; i < (max - min + 1); ++i)
 			{
 				rel = -rel + (i & 1);
 				void* pQuery = reinterpret_cast<void*>(((min + max) / 2 + rel) * BlockSize);
+#if !defined _WIN32
+				// Ask for each address in turn, mmap fails if anything is already there.
+				pAlloc = mmap(pQuery, BlockSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+				if (pAlloc == MAP_FAILED)
+				{
+					pAlloc = NULL;
+				}
+				else if (pAlloc != pQuery)
+				{
+					// Kernels before 4.17 take the address as a hint only.
+					munmap(pAlloc, BlockSize);
+					pAlloc = NULL;
+				}
+				else
+				{
+					break;
+				}
+#else
 				VirtualQuery(pQuery, &mi, sizeof(mi));
 				if (mi.State == MEM_FREE)
 				{
@@ -272,12 +320,21 @@ namespace MinHook { namespace
 						break;
 					}
 				}
+#endif
 			}
 		}
 		else
 #endif		// X86[hł́AAhX͖ɂȂȂ
 		{
+#if defined _WIN32
 			pAlloc = VirtualAlloc(NULL, BlockSize, MEM_RESERVE, protect);
+#else
+			pAlloc = mmap(NULL, BlockSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (pAlloc == MAP_FAILED)
+			{
+				pAlloc = NULL;
+			}
+#endif
 		}
 
 		if (pAlloc != NULL)
@@ -299,6 +356,15 @@ namespace MinHook { namespace
 		return NULL;
 	}
 
+	void ReleaseBlock(void* pAddress)
+	{
+#if defined _WIN32
+		VirtualFree(pAddress, 0, MEM_RELEASE);
+#else
+		munmap(pAddress, BlockSize);
+#endif
+	}
+
 	template <typename T>
 	bool operator <(const MEMORY_BLOCK& lhs, const T& rhs)
 	{
@@ -310,9 +376,4 @@ namespace MinHook { namespace
 	{
 		return reinterpret_cast<void*>(lhs) < rhs.pAddress;
 	}
-
-	bool operator <(const MEMORY_BLOCK& lhs, const MEMORY_BLOCK& rhs)
-	{
-		return lhs.pAddress < rhs.pAddress;
-	}
 }}
\ No newline at end of file
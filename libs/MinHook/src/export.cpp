@@ -26,7 +26,9 @@
  *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#if defined _WIN32
 #include <Windows.h>
+#endif
 #include "MinHook.h"
 #include "hook.h"
 
@@ -30,7 +30,11 @@
 #include <vector>
 #include <algorithm>
 #include <functional>
+#if defined _WIN32
 #include <Windows.h>
+#else
+#include "linux.h"
+#endif
 
 #include "MinHook.h"
 #include "hook.h"
@@ -538,8 +542,13 @@ namespace MinHook { namespace
 			patchSize += sizeof(JMP_REL_SHORT);
 		}
 
+#if defined _WIN32
 		DWORD oldProtect;
 		if (!VirtualProtect(pPatchTarget, patchSize, PAGE_EXECUTE_READWRITE, &oldProtect))
+#else
+		int oldProtect;
+		if (!QueryProtection(pPatchTarget, &oldProtect) || !ProtectPages(pPatchTarget, patchSize, PROT_READ | PROT_WRITE | PROT_EXEC))
+#endif
 		{
 			return MH_ERROR_MEMORY_PROTECT;
 		}
@@ -559,7 +568,11 @@ namespace MinHook { namespace
 			memcpy(pHook->pTarget, &jmpAbove, sizeof(jmpAbove));
 		}
 
+#if defined _WIN32
 		VirtualProtect(pPatchTarget, patchSize, oldProtect, &oldProtect);
+#else
+		ProtectPages(pPatchTarget, patchSize, oldProtect);
+#endif
 
 		pHook->isEnabled = true;
 		pHook->queueEnable = true;
@@ -577,15 +590,24 @@ namespace MinHook { namespace
 			patchSize += sizeof(JMP_REL_SHORT);
 		}
 
+#if defined _WIN32
 		DWORD oldProtect;
 		if (!VirtualProtect(pPatchTarget, patchSize, PAGE_EXECUTE_READWRITE, &oldProtect))
+#else
+		int oldProtect;
+		if (!QueryProtection(pPatchTarget, &oldProtect) || !ProtectPages(pPatchTarget, patchSize, PROT_READ | PROT_WRITE | PROT_EXEC))
+#endif
 		{
 			return MH_ERROR_MEMORY_PROTECT;
 		}
 
 		memcpy(pPatchTarget, pHook->pBackup, patchSize);
 
+#if defined _WIN32
 		VirtualProtect(pPatchTarget, patchSize, oldProtect, &oldProtect);
+#else
+		ProtectPages(pPatchTarget, patchSize, oldProtect);
+#endif
 
 		pHook->isEnabled = false;
 		pHook->queueEnable = false;
@@ -679,6 +701,10 @@ namespace MinHook { namespace
 
 	bool IsExecutableAddress(void* pAddress)
 	{
+#if !defined _WIN32
+		int protect;
+		return (QueryProtection(pAddress, &protect) && (protect & PROT_EXEC) != 0);
+#else
 		static const DWORD PageExecuteMask 
 			= (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY);
 
@@ -687,6 +713,7 @@ namespace MinHook { namespace
 		VirtualQuery(pAddress, &mi, sizeof(mi));
 
 		return ((mi.Protect & PageExecuteMask) != 0);
+#endif
 	}
 
 	void WriteRelativeJump(void* pFrom, void* const pTo)
@@ -0,0 +1,71 @@
+/*
+ *  Linux x86-64 stand-ins for the Windows memory functions MinHook uses.
+ *  Added for Heapy, not part of upstream MinHook.
+ */
+
+#if !defined _WIN32
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "linux.h"
+
+namespace MinHook
+{
+	bool QueryProtection(void* pAddress, int* pProtect)
+	{
+		// Plain system calls only: hooks are written while the other threads are frozen,
+		// and one of them may be holding the malloc lock.
+		int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			return false;
+		}
+
+		uintptr_t address = reinterpret_cast<uintptr_t>(pAddress);
+		bool found = false;
+		char buffer[8192];
+		size_t used = 0;
+		ssize_t n;
+		while (!found && (n = read(fd, buffer + used, sizeof(buffer) - 1 - used)) > 0)
+		{
+			used += n;
+			buffer[used] = 0;
+
+			// Each line is: start-end perms offset device inode path
+			char* line = buffer;
+			char* end;
+			while ((end = strchr(line, '\n')) != NULL)
+			{
+				char* p = line;
+				uintptr_t start = strtoull(p, &p, 16);
+				uintptr_t stop = strtoull(p + 1, &p, 16);
+				if (start <= address && address < stop)
+				{
+					*pProtect = (p[1] == 'r' ? PROT_READ : 0) | (p[2] == 'w' ? PROT_WRITE : 0) | (p[3] == 'x' ? PROT_EXEC : 0);
+					found = true;
+					break;
+				}
+				line = end + 1;
+			}
+
+			// Keep the partial line for the next read.
+			used = buffer + used - line;
+			memmove(buffer, line, used);
+		}
+
+		close(fd);
+		return found;
+	}
+
+	bool ProtectPages(void* pAddress, size_t size, int protect)
+	{
+		uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+		uintptr_t start = reinterpret_cast<uintptr_t>(pAddress) & ~(pageSize - 1);
+		uintptr_t end = reinterpret_cast<uintptr_t>(pAddress) + size;
+		return mprotect(reinterpret_cast<void*>(start), end - start, protect) == 0;
+	}
+}
+
+#endif
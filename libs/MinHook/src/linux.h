@@ -0,0 +1,35 @@
+/*
+ *  Linux x86-64 stand-ins for the Windows memory functions MinHook uses.
+ *  Added for Heapy, not part of upstream MinHook.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if !defined __x86_64__
+#error MinHook only supports x86-64 on Linux
+#endif
+
+// Older headers lack it, older kernels take the address as a hint instead.
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// The x64 code paths are the ones which apply.
+#ifndef _M_X64
+#define _M_X64
+#endif
+
+namespace MinHook
+{
+	// Like VirtualQuery, gets the PROT_* flags of the mapping containing pAddress.
+	// Returns false if nothing is mapped there.
+	bool	QueryProtection(void* pAddress, int* pProtect);
+
+	// Like VirtualProtect, which mprotect isn't quite: pAddress need not be page aligned.
+	bool	ProtectPages(void* pAddress, size_t size, int protect);
+}
@@ -29,11 +29,26 @@
 #include <cassert>
 #include <vector>
 #include <algorithm>
+#if defined _WIN32
 #include <windows.h>
 #include <TlHelp32.h>
+#else
+#include <atomic>
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
 
 #include "thread.h"
 
+#if defined _WIN32
 namespace MinHook { namespace
 {
 	// ICloseHandleWindowsnh
@@ -61,10 +76,12 @@ namespace MinHook { namespace
 	};
 
 }}
+#endif
 
 // CriticalSection, CriticalSection::ScopedLock ̎
 namespace MinHook
 {
+#if defined _WIN32
 	CriticalSection::CriticalSection()
 	{
 		InitializeCriticalSection(&cs_);
@@ -84,6 +101,32 @@ namespace MinHook
 	{
 		LeaveCriticalSection(&cs_);
 	}
+#else
+	// Recursive, like a critical section.
+	CriticalSection::CriticalSection()
+	{
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&cs_, &attr);
+		pthread_mutexattr_destroy(&attr);
+	}
+
+	CriticalSection::~CriticalSection()
+	{
+		pthread_mutex_destroy(&cs_);
+	}
+
+	void CriticalSection::enter()
+	{
+		pthread_mutex_lock(&cs_);
+	}
+
+	void CriticalSection::leave()
+	{
+		pthread_mutex_unlock(&cs_);
+	}
+#endif
 
 	CriticalSection::ScopedLock::ScopedLock(CriticalSection& cs)
 		: cs_(cs)
@@ -112,6 +155,11 @@ namespace MinHook
 	{
 		Unfreeze(threads_);
 	}
+}
+
+#if defined _WIN32
+namespace MinHook
+{
 
 	void ScopedThreadExclusive::GetThreads(std::vector<DWORD>& threads)
 	{
@@ -185,4 +233,147 @@ namespace MinHook
 		}
 	}
 }
+#else
+// Other threads are frozen by sending each one a signal. The handler moves its thread
+// off any instruction which is about to be overwritten, as SetThreadContext does on
+// Windows, then waits until the threads are released.
+namespace MinHook { namespace
+{
+	// A real time signal which programs are unlikely to be using themselves.
+	inline int FreezeSignal()
+	{
+		return SIGRTMAX - 2;
+	}
+
+	// Signals carry the generation they were sent in, one which arrives late, from a
+	// thread which had it blocked, is ignored.
+	std::atomic<int>	gGeneration(0);
+	std::atomic<bool>	gReleased(true);
+	std::atomic<int>	gFrozenCount(0);
+	std::atomic<int>	gHandlerCount(0);
+	const std::vector<uintptr_t>* gpOldIPs = NULL;
+	const std::vector<uintptr_t>* gpNewIPs = NULL;
+
+	void FreezeHandler(int, siginfo_t* pInfo, void* pContext)
+	{
+		int savedErrno = errno;
+		gHandlerCount++;
+		if (pInfo->si_code == SI_QUEUE && pInfo->si_value.sival_int == gGeneration && !gReleased)
+		{
+			greg_t& ip = static_cast<ucontext_t*>(pContext)->uc_mcontext.gregs[REG_RIP];
+			for (size_t i = 0; i < gpOldIPs->size(); ++i)
+			{
+				if (static_cast<uintptr_t>(ip) == (*gpOldIPs)[ i ])
+				{
+					ip = static_cast<greg_t>((*gpNewIPs)[ i ]);
+					break;
+				}
+			}
+
+			gFrozenCount++;
+			while (!gReleased)
+			{
+				sched_yield();
+			}
+		}
+		gHandlerCount--;
+		errno = savedErrno;
+	}
+
+	// Like pthread_sigqueue, but to a thread id.
+	bool SendFreezeSignal(pid_t tid, int generation)
+	{
+		siginfo_t info;
+		memset(&info, 0, sizeof(info));
+		info.si_signo = FreezeSignal();
+		info.si_code = SI_QUEUE;
+		info.si_pid = getpid();
+		info.si_uid = getuid();
+		info.si_value.sival_int = generation;
+		return syscall(SYS_rt_tgsigqueueinfo, getpid(), tid, info.si_signo, &info) == 0;
+	}
 
+	uint64_t MonotonicMilliseconds()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+	}
+}}
+
+namespace MinHook
+{
+	void ScopedThreadExclusive::GetThreads(std::vector<DWORD>& threads)
+	{
+		DIR* pDir = opendir("/proc/self/task");
+		if (pDir == NULL)
+		{
+			return;
+		}
+
+		pid_t self = static_cast<pid_t>(syscall(SYS_gettid));
+		while (dirent* pEntry = readdir(pDir))
+		{
+			pid_t tid = static_cast<pid_t>(atoi(pEntry->d_name));
+			if (tid > 0 && tid != self)
+			{
+				threads.push_back(tid);
+			}
+		}
+		closedir(pDir);
+	}
+
+	void ScopedThreadExclusive::Freeze(
+		const std::vector<DWORD>& threads, const std::vector<uintptr_t>& oldIPs, const std::vector<uintptr_t>& newIPs)
+	{
+		assert(("ScopedThreadExclusive::freeze", (oldIPs.size() == newIPs.size())));
+
+		static bool handlerInstalled = false;
+		if (!handlerInstalled)
+		{
+			// Stays installed, a thread which has the signal blocked can still get it later.
+			struct sigaction action;
+			memset(&action, 0, sizeof(action));
+			action.sa_sigaction = FreezeHandler;
+			action.sa_flags = SA_SIGINFO | SA_RESTART;
+			sigfillset(&action.sa_mask);
+			sigaction(FreezeSignal(), &action, NULL);
+			handlerInstalled = true;
+		}
+
+		gpOldIPs = &oldIPs;
+		gpNewIPs = &newIPs;
+		gFrozenCount = 0;
+		gReleased = false;
+
+		int generation = gGeneration;
+		int signalled = 0;
+		for (size_t i = 0, count = threads.size(); i < count; ++i)
+		{
+			if (SendFreezeSignal(threads[i], generation))
+			{
+				signalled++;
+			}
+		}
+
+		// Threads which have exited since, or which block the signal, never arrive.
+		uint64_t deadline = MonotonicMilliseconds() + 100;
+		while (gFrozenCount < signalled && MonotonicMilliseconds() < deadline)
+		{
+			sched_yield();
+		}
+	}
+
+	void ScopedThreadExclusive::Unfreeze(const std::vector<DWORD>&)
+	{
+		// Anything still in the handler after this saw the old generation and is waiting
+		// to be released, nothing new gets past the generation check.
+		gGeneration++;
+		gReleased = true;
+		while (gHandlerCount > 0)
+		{
+			sched_yield();
+		}
+	}
+}
+#endif
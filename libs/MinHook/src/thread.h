@@ -29,7 +29,12 @@
 #pragma once
 
 #include <vector>
+#if defined _WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/types.h>
+#endif
 
 #include "trampoline.h"
 
@@ -53,7 +58,11 @@ namespace MinHook
 		};
 
 	private:
+#if defined _WIN32
 		CRITICAL_SECTION cs_;
+#else
+		pthread_mutex_t cs_;
+#endif
 	public:
 		CriticalSection();
 		~CriticalSection();
@@ -65,6 +74,9 @@ namespace MinHook
 	class ScopedThreadExclusive
 	{
 	private:
+#if !defined _WIN32
+		typedef pid_t DWORD;
+#endif
 		std::vector<DWORD> threads_;
 	public:
 		ScopedThreadExclusive(const std::vector<uintptr_t>& oldIPs, const std::vector<uintptr_t>& newIPs);
@@ -28,11 +28,15 @@
 
 #include <cassert>
 #include <vector>
+#if defined _WIN32
 #include <Windows.h>
+#else
+#include "linux.h"
+#endif
 #include <algorithm>
 
 #if defined _M_X64
-#include "hde64/include/hde64.h"
+#include "HDE64/include/hde64.h"
 #elif defined _M_IX86
 #include "hde32/hde32.h"
 #endif
@@ -378,6 +382,10 @@ namespace MinHook { namespace
 
 	bool IsExecutableAddress(void* pAddress)
 	{
+#if !defined _WIN32
+		int protect;
+		return (QueryProtection(pAddress, &protect) && (protect & PROT_EXEC) != 0);
+#else
 		static const DWORD PageExecuteMask 
 			= (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY);
 
@@ -386,6 +394,7 @@ namespace MinHook { namespace
 		VirtualQuery(pAddress, &mi, sizeof(mi));
 
 		return ((mi.Protect & PageExecuteMask) != 0);
+#endif
 	}
 }}
 